@@ -0,0 +1,336 @@
+/**
+ * @file    allocator.h
+ * @author  Jinwook Jung (jinwookjung@kaist.ac.kr)
+ * @date    2017-10-18 17:05:12
+ *
+ * Allocators for the storage of Matrix.
+ *
+ * - AlignedAllocator: cache-line (64-byte) aligned buffers, the default.
+ * - HugePageAllocator: large buffers on 2 MB boundaries, advised to use
+ *   transparent huge pages.
+ * - PoolAllocator: keeps freed buffers and hands them out again for
+ *   requests of the same size.
+ *
+ * All of them default-initialize elements that are constructed without a
+ * value, so std::vector<double, A>(n) does not zero its elements. Matrix
+ * relies on this to skip the zeroing pass for storage it overwrites.
+ */
+
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <new>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdint>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace matrix_kernel
+{
+
+/**
+ * Allocate bytes aligned to alignment, a power of two. Throws
+ * std::bad_alloc on failure; zero bytes gives NULL.
+ *
+ * The buffer is carved out of a slightly larger malloc() block, with the
+ * block address stored just before it: posix_memalign() costs several
+ * times as much as malloc() for small buffers.
+ */
+inline void* allocate_aligned (size_t bytes, size_t alignment)
+{
+    if (bytes == 0) {
+        return NULL;
+    }
+    size_t extra = alignment - 1 + sizeof(void*);
+    if (bytes > static_cast<size_t>(-1) - extra) {
+        throw std::bad_alloc();
+    }
+    void* block = malloc(bytes + extra);
+    if (block == NULL) {
+        throw std::bad_alloc();
+    }
+    uintptr_t p = (reinterpret_cast<uintptr_t>(block) + extra) & ~(alignment - 1);
+    reinterpret_cast<void**>(p)[-1] = block;
+    return reinterpret_cast<void*>(p);
+}
+
+inline void deallocate_aligned (void* p)
+{
+    if (p) {
+        free(static_cast<void**>(p)[-1]);
+    }
+}
+
+
+/**
+ * What the allocators below have in common: element construction that
+ * default-initializes when no value is given.
+ */
+template <typename T>
+struct DefaultInitAllocator
+{
+    typedef T value_type;
+
+    template <typename U, typename... Args>
+    void construct (U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+    template <typename U>
+    void construct (U* p) {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    static size_t get_num_bytes (size_t n) {
+        if (n > static_cast<size_t>(-1) / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        return n*sizeof(T);
+    }
+};
+
+
+/**
+ * Per-thread lists of freed buffers, by size, for PoolAllocator.
+ *
+ * A buffer goes back to the pool of the thread that frees it. Once a
+ * thread holds max_cached_bytes, further buffers are freed instead. The
+ * pool of a thread is released when the thread exits; buffers freed after
+ * that point, e.g. by static destructors, are freed directly.
+ */
+template <size_t Alignment>
+class BufferPool
+{
+private:
+    std::unordered_map<size_t, std::vector<void*>> buffers_;
+    size_t num_cached_bytes_;
+
+    BufferPool () : num_cached_bytes_(0) {}
+
+    /// Set once the calling thread's pool has been destroyed.
+    static bool& is_destroyed () {
+        static thread_local bool destroyed = false;
+        return destroyed;
+    }
+
+    struct Holder {
+        BufferPool pool_;
+        ~Holder () {
+            pool_.release();
+            is_destroyed() = true;
+        }
+    };
+
+    static BufferPool* get_thread_pool () {
+        if (is_destroyed()) {
+            return NULL;
+        }
+        static thread_local Holder holder;
+        return &holder.pool_;
+    }
+
+public:
+    static size_t& max_cached_bytes () {
+        static size_t bytes = size_t(256) << 20;
+        return bytes;
+    }
+
+    static void* take (size_t bytes) {
+        BufferPool* pool = get_thread_pool();
+        if (pool && bytes > 0) {
+            auto it = pool->buffers_.find(bytes);
+            if (it != pool->buffers_.end() && !it->second.empty()) {
+                void* p = it->second.back();
+                it->second.pop_back();
+                pool->num_cached_bytes_ -= bytes;
+                return p;
+            }
+        }
+        return allocate_aligned(bytes, Alignment);
+    }
+
+    static void give (void* p, size_t bytes) {
+        if (p == NULL) {
+            return;
+        }
+        BufferPool* pool = get_thread_pool();
+        if (pool == NULL || pool->num_cached_bytes_ + bytes > max_cached_bytes()) {
+            deallocate_aligned(p);
+            return;
+        }
+        pool->buffers_[bytes].push_back(p);
+        pool->num_cached_bytes_ += bytes;
+    }
+
+    /**
+     * Free the buffers cached by the calling thread.
+     */
+    void release () {
+        for (auto& b : buffers_) {
+            for (void* p : b.second) {
+                deallocate_aligned(p);
+            }
+        }
+        buffers_.clear();
+        num_cached_bytes_ = 0;
+    }
+
+    static void release_thread_pool () {
+        if (BufferPool* pool = get_thread_pool()) {
+            pool->release();
+        }
+    }
+};
+
+}   // End of namespace matrix_kernel
+
+
+/**
+ * Buffers aligned to Alignment bytes (a cache line by default), so SIMD
+ * loads of the first elements never straddle cache lines.
+ */
+template <typename T, size_t Alignment = 64>
+class AlignedAllocator : public matrix_kernel::DefaultInitAllocator<T>
+{
+public:
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator () {}
+    template <typename U> AlignedAllocator (const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate (size_t n) {
+        size_t bytes = this->get_num_bytes(n);
+        return static_cast<T*>(matrix_kernel::allocate_aligned(bytes, Alignment));
+    }
+    void deallocate (T* p, size_t) {
+        matrix_kernel::deallocate_aligned(p);
+    }
+};
+
+
+/**
+ * Buffers of at least 2 MB are mapped on a 2 MB boundary and advised to
+ * use transparent huge pages, which cuts TLB misses on large matrices.
+ * Smaller buffers, and every buffer on systems without madvise, come from
+ * AlignedAllocator.
+ */
+template <typename T>
+class HugePageAllocator : public matrix_kernel::DefaultInitAllocator<T>
+{
+public:
+    static const size_t huge_page_size = size_t(2) << 20;
+
+    template <typename U> struct rebind { typedef HugePageAllocator<U> other; };
+
+    HugePageAllocator () {}
+    template <typename U> HugePageAllocator (const HugePageAllocator<U>&) {}
+
+    T* allocate (size_t n) {
+        size_t bytes = this->get_num_bytes(n);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (bytes >= huge_page_size) {
+            // Map a page more than needed and trim both ends to the boundary.
+            size_t size = get_mapped_size(bytes);
+            size_t mapped = size + huge_page_size;
+            void* p = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+            uintptr_t aligned = (begin + huge_page_size - 1) & ~(huge_page_size - 1);
+            if (aligned > begin) {
+                munmap(p, aligned - begin);
+            }
+            if (aligned + size < begin + mapped) {
+                munmap(reinterpret_cast<void*>(aligned + size),
+                       begin + mapped - aligned - size);
+            }
+            madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+            return reinterpret_cast<T*>(aligned);
+        }
+#endif
+        return static_cast<T*>(matrix_kernel::allocate_aligned(bytes, 64));
+    }
+
+    void deallocate (T* p, size_t n) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        size_t bytes = n*sizeof(T);
+        if (bytes >= huge_page_size) {
+            munmap(p, get_mapped_size(bytes));
+            return;
+        }
+#else
+        (void) n;
+#endif
+        matrix_kernel::deallocate_aligned(p);
+    }
+
+private:
+    static size_t get_mapped_size (size_t bytes) {
+        return (bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+    }
+};
+
+template <typename T>
+const size_t HugePageAllocator<T>::huge_page_size;
+
+
+/**
+ * Aligned buffers recycled through a per-thread pool, so that temporaries
+ * of the same shape reuse the buffer of the last one instead of going to
+ * the heap. See matrix_kernel::BufferPool.
+ */
+template <typename T, size_t Alignment = 64>
+class PoolAllocator : public matrix_kernel::DefaultInitAllocator<T>
+{
+public:
+    typedef matrix_kernel::BufferPool<Alignment> Pool;
+
+    template <typename U> struct rebind { typedef PoolAllocator<U, Alignment> other; };
+
+    PoolAllocator () {}
+    template <typename U> PoolAllocator (const PoolAllocator<U, Alignment>&) {}
+
+    T* allocate (size_t n) {
+        return static_cast<T*>(Pool::take(this->get_num_bytes(n)));
+    }
+    void deallocate (T* p, size_t n) {
+        Pool::give(p, n*sizeof(T));
+    }
+
+    /**
+     * Bytes each thread may keep in its pool, shared by all PoolAllocators
+     * of the same alignment. Set it before starting threads.
+     */
+    static void set_max_cached_bytes (size_t bytes) { Pool::max_cached_bytes() = bytes; }
+
+    /**
+     * Free the buffers pooled by the calling thread.
+     */
+    static void release () { Pool::release_thread_pool(); }
+};
+
+
+// Allocators of one kind are interchangeable: memory from one can be
+// freed by another.
+template <typename T, typename U, size_t A>
+bool operator== (const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return true; }
+template <typename T, typename U, size_t A>
+bool operator!= (const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return false; }
+
+template <typename T, typename U>
+bool operator== (const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!= (const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return false; }
+
+template <typename T, typename U, size_t A>
+bool operator== (const PoolAllocator<T, A>&, const PoolAllocator<U, A>&) { return true; }
+template <typename T, typename U, size_t A>
+bool operator!= (const PoolAllocator<T, A>&, const PoolAllocator<U, A>&) { return false; }
+
+#endif
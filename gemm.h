@@ -0,0 +1,503 @@
+/**
+ * @file    gemm.h
+ * @author  Jinwook Jung (jinwookjung@kaist.ac.kr)
+ * @date    2017-10-18 17:05:12
+ *
+ * Cache-blocked general matrix multiplication, C = alpha*A*B + beta*C.
+ *
+ * The loops follow the usual GotoBLAS structure: B is packed one KC x NC
+ * panel at a time, A one MC x KC block at a time, and a register-blocked
+ * micro-kernel multiplies an MR-row sliver of A by an NR-column sliver of
+ * B. float and double use an AVX-512 or AVX2/FMA micro-kernel picked at
+ * run time; every other type uses a portable scalar kernel.
+ */
+
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include "thread_pool.h"
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) \
+    && !defined(MATRIX_NO_SIMD)
+#include <immintrin.h>
+#define MATRIX_HAVE_X86_KERNELS
+#endif
+
+namespace matrix_kernel
+{
+
+/**
+ * A micro-kernel and the block sizes that go with it.
+ *
+ * The kernel computes an MR x NR tile: c = alpha*a*b + beta*c, where a is
+ * a packed MR x k sliver (column by column), b a packed k x NR sliver (row
+ * by row) and c is row-major with row stride rsc. If beta is zero, c is
+ * not read.
+ */
+template <typename T>
+struct Kernel
+{
+    typedef void (*Func)(size_t k, const T* a, const T* b, T alpha, T beta,
+                         T* c, ptrdiff_t rsc);
+
+    Func func_;
+    size_t mr_;                 ///< Rows of a tile.
+    size_t nr_;                 ///< Columns of a tile.
+    size_t mc_;                 ///< Rows of a packed block of A (L2).
+    size_t kc_;                 ///< Depth of the packed blocks (L1).
+    size_t nc_;                 ///< Columns of a packed panel of B (L3).
+};
+
+
+/**
+ * Portable micro-kernel for any element type.
+ */
+template <typename T, size_t MR, size_t NR>
+void scalar_kernel (size_t k, const T* a, const T* b, T alpha, T beta,
+                    T* c, ptrdiff_t rsc)
+{
+    T ab[MR][NR];
+    for (size_t i = 0; i < MR; i++) {
+        for (size_t j = 0; j < NR; j++) {
+            ab[i][j] = T(0);
+        }
+    }
+
+    for (size_t p = 0; p < k; p++) {
+        for (size_t i = 0; i < MR; i++) {
+            for (size_t j = 0; j < NR; j++) {
+                ab[i][j] += a[i] * b[j];
+            }
+        }
+        a += MR;
+        b += NR;
+    }
+
+    for (size_t i = 0; i < MR; i++) {
+        T* ci = c + i*rsc;
+        for (size_t j = 0; j < NR; j++) {
+            ci[j] = (beta == T(0)) ? alpha*ab[i][j] : alpha*ab[i][j] + beta*ci[j];
+        }
+    }
+}
+
+
+#if defined(MATRIX_HAVE_X86_KERNELS)
+
+/**
+ * AVX2 vector operations. Overloaded on the element type so that one
+ * kernel template serves float and double.
+ */
+struct Avx2
+{
+    __attribute__((target("avx2,fma"), always_inline))
+    static inline __m256d load (const double* p) { return _mm256_loadu_pd(p); }
+    __attribute__((target("avx2,fma"), always_inline))
+    static inline __m256 load (const float* p) { return _mm256_loadu_ps(p); }
+
+    __attribute__((target("avx2,fma"), always_inline))
+    static inline __m256d set1 (double v) { return _mm256_set1_pd(v); }
+    __attribute__((target("avx2,fma"), always_inline))
+    static inline __m256 set1 (float v) { return _mm256_set1_ps(v); }
+
+    __attribute__((target("avx2,fma"), always_inline))
+    static inline void store (double* p, __m256d v) { _mm256_storeu_pd(p, v); }
+    __attribute__((target("avx2,fma"), always_inline))
+    static inline void store (float* p, __m256 v) { _mm256_storeu_ps(p, v); }
+
+    __attribute__((target("avx2,fma"), always_inline))
+    static inline __m256d fmadd (__m256d a, __m256d b, __m256d c) {
+        return _mm256_fmadd_pd(a, b, c);
+    }
+    __attribute__((target("avx2,fma"), always_inline))
+    static inline __m256 fmadd (__m256 a, __m256 b, __m256 c) {
+        return _mm256_fmadd_ps(a, b, c);
+    }
+
+    __attribute__((target("avx2,fma"), always_inline))
+    static inline __m256d mul (__m256d a, __m256d b) { return _mm256_mul_pd(a, b); }
+    __attribute__((target("avx2,fma"), always_inline))
+    static inline __m256 mul (__m256 a, __m256 b) { return _mm256_mul_ps(a, b); }
+};
+
+
+/**
+ * AVX-512 vector operations.
+ */
+struct Avx512
+{
+    __attribute__((target("avx512f"), always_inline))
+    static inline __m512d load (const double* p) { return _mm512_loadu_pd(p); }
+    __attribute__((target("avx512f"), always_inline))
+    static inline __m512 load (const float* p) { return _mm512_loadu_ps(p); }
+
+    __attribute__((target("avx512f"), always_inline))
+    static inline __m512d set1 (double v) { return _mm512_set1_pd(v); }
+    __attribute__((target("avx512f"), always_inline))
+    static inline __m512 set1 (float v) { return _mm512_set1_ps(v); }
+
+    __attribute__((target("avx512f"), always_inline))
+    static inline void store (double* p, __m512d v) { _mm512_storeu_pd(p, v); }
+    __attribute__((target("avx512f"), always_inline))
+    static inline void store (float* p, __m512 v) { _mm512_storeu_ps(p, v); }
+
+    __attribute__((target("avx512f"), always_inline))
+    static inline __m512d fmadd (__m512d a, __m512d b, __m512d c) {
+        return _mm512_fmadd_pd(a, b, c);
+    }
+    __attribute__((target("avx512f"), always_inline))
+    static inline __m512 fmadd (__m512 a, __m512 b, __m512 c) {
+        return _mm512_fmadd_ps(a, b, c);
+    }
+
+    __attribute__((target("avx512f"), always_inline))
+    static inline __m512d mul (__m512d a, __m512d b) { return _mm512_mul_pd(a, b); }
+    __attribute__((target("avx512f"), always_inline))
+    static inline __m512 mul (__m512 a, __m512 b) { return _mm512_mul_ps(a, b); }
+};
+
+
+/**
+ * Vector types of each instruction set.
+ */
+template <typename Isa, typename T> struct Vector;
+template <> struct Vector<Avx2, double>   { typedef __m256d type; };
+template <> struct Vector<Avx2, float>    { typedef __m256  type; };
+template <> struct Vector<Avx512, double> { typedef __m512d type; };
+template <> struct Vector<Avx512, float>  { typedef __m512  type; };
+
+// The body of the SIMD kernels: 6 rows by 2 vectors, so 12 accumulators
+// plus 2 vectors of b and a broadcast stay in registers. The rows are
+// spelled out because GCC does not unroll the row loop at -O2 and would
+// keep the accumulators in memory.
+#define MATRIX_SIMD_KERNEL_FMA_ROW(Isa, i)                                  \
+    ai = Isa::set1(a[i]);                                                   \
+    c##i##0 = Isa::fmadd(ai, b0, c##i##0);                                  \
+    c##i##1 = Isa::fmadd(ai, b1, c##i##1);
+
+#define MATRIX_SIMD_KERNEL_STORE_ROW(Isa, i)                                \
+    if (beta == T(0)) {                                                     \
+        Isa::store(c + i*rsc, Isa::mul(va, c##i##0));                       \
+        Isa::store(c + i*rsc + W, Isa::mul(va, c##i##1));                   \
+    } else {                                                                \
+        Isa::store(c + i*rsc, Isa::fmadd(va, c##i##0,                       \
+                                         Isa::mul(vb, Isa::load(c + i*rsc)))); \
+        Isa::store(c + i*rsc + W, Isa::fmadd(va, c##i##1,                   \
+                                   Isa::mul(vb, Isa::load(c + i*rsc + W)))); \
+    }
+
+#define MATRIX_SIMD_KERNEL_BODY(Isa)                                        \
+    typedef typename Vector<Isa, T>::type V;                                \
+    const size_t W = sizeof(V) / sizeof(T);                                 \
+    for (size_t i = 0; i < 6; i++) {                                        \
+        _mm_prefetch(reinterpret_cast<const char*>(c + i*rsc), _MM_HINT_T0); \
+        _mm_prefetch(reinterpret_cast<const char*>(c + i*rsc + 2*W - 1),    \
+                     _MM_HINT_T0);                                          \
+    }                                                                       \
+    V c00 = Isa::set1(T(0)), c01 = c00, c10 = c00, c11 = c00;               \
+    V c20 = c00, c21 = c00, c30 = c00, c31 = c00;                           \
+    V c40 = c00, c41 = c00, c50 = c00, c51 = c00;                           \
+    for (size_t p = 0; p < k; p++) {                                        \
+        V b0 = Isa::load(b);                                                \
+        V b1 = Isa::load(b + W);                                            \
+        V ai;                                                               \
+        MATRIX_SIMD_KERNEL_FMA_ROW(Isa, 0)                                  \
+        MATRIX_SIMD_KERNEL_FMA_ROW(Isa, 1)                                  \
+        MATRIX_SIMD_KERNEL_FMA_ROW(Isa, 2)                                  \
+        MATRIX_SIMD_KERNEL_FMA_ROW(Isa, 3)                                  \
+        MATRIX_SIMD_KERNEL_FMA_ROW(Isa, 4)                                  \
+        MATRIX_SIMD_KERNEL_FMA_ROW(Isa, 5)                                  \
+        a += 6;                                                             \
+        b += 2*W;                                                           \
+    }                                                                       \
+    V va = Isa::set1(alpha);                                                \
+    V vb = Isa::set1(beta);                                                 \
+    MATRIX_SIMD_KERNEL_STORE_ROW(Isa, 0)                                    \
+    MATRIX_SIMD_KERNEL_STORE_ROW(Isa, 1)                                    \
+    MATRIX_SIMD_KERNEL_STORE_ROW(Isa, 2)                                    \
+    MATRIX_SIMD_KERNEL_STORE_ROW(Isa, 3)                                    \
+    MATRIX_SIMD_KERNEL_STORE_ROW(Isa, 4)                                    \
+    MATRIX_SIMD_KERNEL_STORE_ROW(Isa, 5)
+
+template <typename T>
+__attribute__((target("avx2,fma")))
+void avx2_kernel (size_t k, const T* a, const T* b, T alpha, T beta,
+                  T* c, ptrdiff_t rsc)
+{
+    MATRIX_SIMD_KERNEL_BODY(Avx2)
+}
+
+template <typename T>
+__attribute__((target("avx512f")))
+void avx512_kernel (size_t k, const T* a, const T* b, T alpha, T beta,
+                    T* c, ptrdiff_t rsc)
+{
+    MATRIX_SIMD_KERNEL_BODY(Avx512)
+}
+
+#undef MATRIX_SIMD_KERNEL_BODY
+#undef MATRIX_SIMD_KERNEL_STORE_ROW
+#undef MATRIX_SIMD_KERNEL_FMA_ROW
+
+
+/**
+ * Pick the widest kernel the CPU supports.
+ */
+template <typename T>
+Kernel<T> select_simd_kernel (const Kernel<T>& fallback)
+{
+    const size_t w = 32 / sizeof(T);     // Lanes of a 256-bit vector.
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        Kernel<T> kernel = { &avx512_kernel<T>, 6, 4*w, 672, 192, 4096 };
+        return kernel;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        Kernel<T> kernel = { &avx2_kernel<T>, 6, 2*w, 96, 256, 4096 };
+        return kernel;
+    }
+    return fallback;
+}
+
+#endif  // MATRIX_HAVE_X86_KERNELS
+
+
+/**
+ * @return The micro-kernel for T.
+ */
+template <typename T>
+const Kernel<T>& get_kernel ()
+{
+    static const Kernel<T> kernel = { &scalar_kernel<T, 4, 4>, 4, 4, 128, 256, 4096 };
+    return kernel;
+}
+
+#if defined(MATRIX_HAVE_X86_KERNELS)
+template <>
+inline const Kernel<float>& get_kernel<float> ()
+{
+    static const Kernel<float> fallback = { &scalar_kernel<float, 4, 4>, 4, 4, 128, 256, 4096 };
+    static const Kernel<float> kernel = select_simd_kernel<float>(fallback);
+    return kernel;
+}
+
+template <>
+inline const Kernel<double>& get_kernel<double> ()
+{
+    static const Kernel<double> fallback = { &scalar_kernel<double, 4, 4>, 4, 4, 128, 256, 4096 };
+    static const Kernel<double> kernel = select_simd_kernel<double>(fallback);
+    return kernel;
+}
+#endif
+
+
+/**
+ * Pack an mb x kb block of A into slivers of mr rows, each stored column
+ * by column. Rows past mb are zero.
+ */
+template <typename T>
+void pack_a (size_t mb, size_t kb, const T* a, ptrdiff_t rsa, ptrdiff_t csa,
+             size_t mr, T* ap)
+{
+    for (size_t i = 0; i < mb; i += mr) {
+        size_t rows = std::min(mr, mb - i);
+        for (size_t p = 0; p < kb; p++) {
+            const T* ai = a + i*rsa + p*csa;
+            size_t r = 0;
+            for (; r < rows; r++) {
+                ap[r] = ai[r*rsa];
+            }
+            for (; r < mr; r++) {
+                ap[r] = T(0);
+            }
+            ap += mr;
+        }
+    }
+}
+
+
+/**
+ * Pack a kb x nb panel of B into slivers of nr columns, each stored row by
+ * row. Columns past nb are zero.
+ */
+template <typename T>
+void pack_b (size_t kb, size_t nb, const T* b, ptrdiff_t rsb, ptrdiff_t csb,
+             size_t nr, T* bp)
+{
+    for (size_t j = 0; j < nb; j += nr) {
+        size_t cols = std::min(nr, nb - j);
+        for (size_t p = 0; p < kb; p++) {
+            const T* bj = b + p*rsb + j*csb;
+            size_t q = 0;
+            if (csb == 1) {
+                for (; q < cols; q++) {
+                    bp[q] = bj[q];
+                }
+            } else {
+                for (; q < cols; q++) {
+                    bp[q] = bj[q*csb];
+                }
+            }
+            for (; q < nr; q++) {
+                bp[q] = T(0);
+            }
+            bp += nr;
+        }
+    }
+}
+
+
+/**
+ * Grow buf to hold n elements starting at a cache line boundary, so that
+ * the vector loads of the kernels never split a line.
+ * @return The aligned start of buf.
+ */
+template <typename T>
+T* get_aligned (std::vector<T>& buf, size_t n)
+{
+    const size_t line = 64;
+    buf.resize(n + line/sizeof(T) + 1);
+    size_t addr = reinterpret_cast<size_t>(buf.data());
+    if (line % sizeof(T) != 0 || addr % sizeof(T) != 0) {
+        return buf.data();
+    }
+    return buf.data() + ((line - addr % line) % line) / sizeof(T);
+}
+
+
+/**
+ * Multiply a packed block of A by a packed panel of B into C, one tile at
+ * a time. Edge tiles and column-strided C go through a local tile.
+ */
+template <typename T>
+void multiply_block (const Kernel<T>& kernel, size_t mb, size_t nb, size_t kb,
+                     T alpha, const T* ap, const T* bp, T beta,
+                     T* c, ptrdiff_t rsc, ptrdiff_t csc)
+{
+    const size_t mr = kernel.mr_;
+    const size_t nr = kernel.nr_;
+    T tile[256];        // Large enough for any kernel above.
+
+    for (size_t j = 0; j < nb; j += nr) {
+        size_t cols = std::min(nr, nb - j);
+        const T* bj = bp + j*kb;
+
+        for (size_t i = 0; i < mb; i += mr) {
+            size_t rows = std::min(mr, mb - i);
+            const T* ai = ap + i*kb;
+            T* cij = c + i*rsc + j*csc;
+
+            if (rows == mr && cols == nr && csc == 1) {
+                kernel.func_(kb, ai, bj, alpha, beta, cij, rsc);
+                continue;
+            }
+
+            kernel.func_(kb, ai, bj, T(1), T(0), tile, static_cast<ptrdiff_t>(nr));
+            for (size_t r = 0; r < rows; r++) {
+                for (size_t q = 0; q < cols; q++) {
+                    T& dst = cij[r*rsc + q*csc];
+                    dst = (beta == T(0)) ? alpha*tile[r*nr + q]
+                                         : alpha*tile[r*nr + q] + beta*dst;
+                }
+            }
+        }
+    }
+}
+
+
+/**
+ * C = alpha*A*B + beta*C, where A is m x k, B is k x n and C is m x n.
+ * Each operand is given by a pointer to its first element and its row and
+ * column strides, so row-major, column-major and transposed operands all
+ * work. If beta is zero, C is not read. C must not overlap A or B.
+ *
+ * The tiles of C are split among num_threads threads (zero means
+ * get_num_threads()). Every element of C is computed by one thread in the
+ * same order whatever the thread count, so the result is bitwise the same
+ * for any number of threads.
+ */
+template <typename T>
+void gemm (size_t m, size_t n, size_t k, T alpha,
+           const T* a, ptrdiff_t rsa, ptrdiff_t csa,
+           const T* b, ptrdiff_t rsb, ptrdiff_t csb,
+           T beta, T* c, ptrdiff_t rsc, ptrdiff_t csc,
+           size_t num_threads = 0)
+{
+    if (m == 0 || n == 0) {
+        return;
+    }
+    if (k == 0 || alpha == T(0)) {
+        parallel_for(0, m, 64, [&](size_t i0, size_t i1) {
+            for (size_t i = i0; i < i1; i++) {
+                for (size_t j = 0; j < n; j++) {
+                    T& dst = c[i*rsc + j*csc];
+                    dst = (beta == T(0)) ? T(0) : beta*dst;
+                }
+            }
+        }, num_threads);
+        return;
+    }
+
+    const Kernel<T>& kernel = get_kernel<T>();
+    const size_t mr = kernel.mr_;
+    const size_t nr = kernel.nr_;
+    const size_t mc = kernel.mc_;
+    const size_t kc = kernel.kc_;
+    const size_t nc = kernel.nc_;
+
+    // Threads do not pay off below a few million flops.
+    if (num_threads == 0) {
+        num_threads = get_num_threads();
+    }
+    if (m*n*k < (1 << 20)) {
+        num_threads = 1;
+    }
+
+    // The packed panel of B is shared; blocks of A are packed by each task
+    // into a buffer of the thread running it.
+    static thread_local std::vector<T> b_buf;
+    T* bp = get_aligned(b_buf, (std::min(nc, n) + nr) * std::min(kc, k));
+
+    for (size_t jc = 0; jc < n; jc += nc) {
+        size_t nb = std::min(nc, n - jc);
+        size_t num_slivers = (nb + nr - 1) / nr;
+
+        // Split the panel into blocks of rows of C times runs of slivers,
+        // with at least one task per thread.
+        size_t num_row_blocks = (m + mc - 1) / mc;
+        size_t num_col_runs = std::min(num_slivers,
+                                       (num_threads + num_row_blocks - 1) / num_row_blocks);
+        size_t run_slivers = (num_slivers + num_col_runs - 1) / num_col_runs;
+        num_col_runs = (num_slivers + run_slivers - 1) / run_slivers;
+
+        for (size_t pc = 0; pc < k; pc += kc) {
+            size_t kb = std::min(kc, k - pc);
+            T beta_p = (pc == 0) ? beta : T(1);
+
+            parallel_for(0, num_slivers, 16, [&](size_t s0, size_t s1) {
+                pack_b(kb, std::min(s1*nr, nb) - s0*nr, b + pc*rsb + (jc + s0*nr)*csb,
+                       rsb, csb, nr, bp + s0*nr*kb);
+            }, num_threads);
+
+            ThreadPool::get().run(num_row_blocks * num_col_runs, [&](size_t t) {
+                static thread_local std::vector<T> a_buf;
+                size_t ic = (t / num_col_runs) * mc;
+                size_t mb = std::min(mc, m - ic);
+                size_t j0 = (t % num_col_runs) * run_slivers * nr;
+                size_t j1 = std::min(nb, j0 + run_slivers*nr);
+
+                T* ap = get_aligned(a_buf, (std::min(mc, m) + mr) * kc);
+                pack_a(mb, kb, a + ic*rsa + pc*csa, rsa, csa, mr, ap);
+                multiply_block(kernel, mb, j1 - j0, kb, alpha, ap, bp + j0*kb,
+                               beta_p, c + ic*rsc + (jc + j0)*csc, rsc, csc);
+            }, num_threads);
+        }
+    }
+}
+
+}   // End of namespace matrix_kernel
+
+#endif
@@ -0,0 +1,465 @@
+/**
+ * @file    BinaryLog.h
+ * @author  Jinwook Jung (jinwookjungs@gmail.com)
+ * @date    2017-09-23 01:46:19
+ * @brief   Deferred-formatting binary logging for my_log.
+ *
+ * A call site registers its format string once; afterwards a record only
+ * copies the site id and the raw argument bytes into a per-thread buffer.
+ * Formatting happens offline in log_decode, which prints the records in
+ * the same form as the text Logger:
+ *
+ *      my_log::BinaryLog::open("trace.bin");
+ *      LOGBW("net {} has slack {}", net_id, slack);
+ *      my_log::BinaryLog::close();
+ *
+ *      $ ./log_decode trace.bin
+ *      (W) net 12 has slack -0.25
+ *
+ * File layout (host byte order):
+ *      file header : "MYLOGBIN", u32 version, u32 length, logger header
+ *      site        : u8 'S', u32 id, u8 verbosity, u32 line,
+ *                    u16 length, file, u16 length, format,
+ *                    u8 number of args, one type tag per arg
+ *      record      : u8 'R', u32 id, args
+ *                    (i: int64, u: uint64, d: double, c: char, b: bool,
+ *                     s: u32 length + bytes)
+ */
+
+#ifndef BINARY_LOG_H
+#define BINARY_LOG_H
+
+#include <cstdio>
+#include <cstdint>
+#include <type_traits>
+#include "Logger.h"
+
+//-----------------------------------------------------------------------------
+// Binary logging macros
+//-----------------------------------------------------------------------------
+#define LOGB(V, ...) \
+    do { \
+        if (my_log::LoggerCtrl::is_within_max_verbosity<V>() \
+            && my_log::BinaryLog::is_open()) { \
+            static my_log::BinarySite my_log_site_; \
+            my_log::BinaryLog::write(my_log_site_, V, __FILE__, __LINE__, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOGB_(...)  LOGB(my_log::LogVerbosity::message, __VA_ARGS__)
+#define LOGBE(...)  LOGB(my_log::LogVerbosity::error, __VA_ARGS__)
+#define LOGBW(...)  LOGB(my_log::LogVerbosity::warning, __VA_ARGS__)
+#define LOGBI(...)  LOGB(my_log::LogVerbosity::info, __VA_ARGS__)
+#define LOGBD(...)  LOGB(my_log::LogVerbosity::debug, __VA_ARGS__)
+
+namespace my_log
+{
+
+const char binary_log_magic[8] = { 'M', 'Y', 'L', 'O', 'G', 'B', 'I', 'N' };
+const uint32_t binary_log_version = 1;
+const char binary_log_site_tag = 'S';
+const char binary_log_record_tag = 'R';
+
+
+/**
+ * Per-call-site state. The id is assigned when the site is first used in
+ * a file; the upper half holds the generation of that file, so sites are
+ * registered again when the log is reopened.
+ */
+struct BinarySite
+{
+    std::atomic<uint64_t> key_;
+
+    BinarySite () : key_(0) {}
+};
+
+
+/**
+ * How an argument of type T is stored in a record.
+ */
+template <typename T, typename Enable = void>
+struct BinaryArg;
+
+template <typename T>
+struct BinaryArg<T, typename std::enable_if<std::is_integral<T>::value
+                                            && std::is_signed<T>::value
+                                            && !std::is_same<T, char>::value>::type>
+{
+    static const char tag = 'i';
+    static size_t size (T) { return sizeof(int64_t); }
+    static char* put (char* p, T v) {
+        int64_t x = v;
+        std::memcpy(p, &x, sizeof(x));
+        return p + sizeof(x);
+    }
+};
+
+template <typename T>
+struct BinaryArg<T, typename std::enable_if<std::is_integral<T>::value
+                                            && std::is_unsigned<T>::value
+                                            && !std::is_same<T, bool>::value>::type>
+{
+    static const char tag = 'u';
+    static size_t size (T) { return sizeof(uint64_t); }
+    static char* put (char* p, T v) {
+        uint64_t x = v;
+        std::memcpy(p, &x, sizeof(x));
+        return p + sizeof(x);
+    }
+};
+
+template <typename T>
+struct BinaryArg<T, typename std::enable_if<std::is_floating_point<T>::value>::type>
+{
+    static const char tag = 'd';
+    static size_t size (T) { return sizeof(double); }
+    static char* put (char* p, T v) {
+        double x = v;
+        std::memcpy(p, &x, sizeof(x));
+        return p + sizeof(x);
+    }
+};
+
+template <>
+struct BinaryArg<char>
+{
+    static const char tag = 'c';
+    static size_t size (char) { return 1; }
+    static char* put (char* p, char v) { *p = v; return p + 1; }
+};
+
+template <>
+struct BinaryArg<bool>
+{
+    static const char tag = 'b';
+    static size_t size (bool) { return 1; }
+    static char* put (char* p, bool v) { *p = v ? 1 : 0; return p + 1; }
+};
+
+/**
+ * Strings are stored by value, so the argument may go away right after
+ * the call.
+ */
+struct BinaryStringArg
+{
+    static const char tag = 's';
+    static size_t size (const char*, size_t len) {
+        return sizeof(uint32_t) + len;
+    }
+    static char* put (char* p, const char* s, size_t len) {
+        uint32_t n = static_cast<uint32_t>(len);
+        std::memcpy(p, &n, sizeof(n));
+        std::memcpy(p + sizeof(n), s, len);
+        return p + sizeof(n) + len;
+    }
+};
+
+template <>
+struct BinaryArg<const char*> : BinaryStringArg
+{
+    static size_t size (const char* s) {
+        return BinaryStringArg::size(s, std::strlen(s));
+    }
+    static char* put (char* p, const char* s) {
+        return BinaryStringArg::put(p, s, std::strlen(s));
+    }
+};
+
+template <>
+struct BinaryArg<char*> : BinaryArg<const char*> {};
+
+template <>
+struct BinaryArg<std::string> : BinaryStringArg
+{
+    static size_t size (const std::string& s) {
+        return BinaryStringArg::size(s.data(), s.size());
+    }
+    static char* put (char* p, const std::string& s) {
+        return BinaryStringArg::put(p, s.data(), s.size());
+    }
+};
+
+
+/**
+ * The binary log file and the per-thread record buffers that feed it.
+ */
+class BinaryLog
+{
+private:
+    /**
+     * Records of one thread. The flag is only contended while another
+     * thread flushes the buffer, so taking it costs one atomic exchange.
+     */
+    struct ThreadBuffer {
+        static const size_t capacity = 1 << 16;
+
+        std::atomic<bool> busy_;
+        size_t size_;
+        uint32_t generation_;       ///< The file the records were made for.
+        std::unique_ptr<char[]> data_;
+
+        ThreadBuffer () : busy_(false), size_(0), generation_(0),
+                          data_(new char[capacity]) {
+            BinaryLog::get().add_buffer(this);
+        }
+        ~ThreadBuffer () {
+            BinaryLog::get().remove_buffer(this);
+        }
+
+        void lock () {
+            while (busy_.exchange(true, std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
+        void unlock () {
+            busy_.store(false, std::memory_order_release);
+        }
+    };
+
+    std::FILE* file_;
+    std::atomic<bool> is_open_;
+    std::atomic<uint32_t> generation_;      ///< Incremented on every open.
+    uint32_t num_sites_;
+    std::mutex file_mutex_;                 ///< Guards file_ and num_sites_.
+    std::mutex buffers_mutex_;              ///< Guards buffers_.
+    std::vector<ThreadBuffer*> buffers_;
+    std::atomic<uint64_t> num_dropped_;     ///< Records too large for a buffer.
+
+    BinaryLog () : file_(NULL), is_open_(false), generation_(0), num_sites_(0),
+                   num_dropped_(0) {}
+    BinaryLog (const BinaryLog& bl) = delete;
+    BinaryLog& operator= (const BinaryLog& bl) = delete;
+
+    ~BinaryLog () {
+        close();
+    }
+
+    static BinaryLog& get () {
+        static BinaryLog bl;
+        return bl;
+    }
+
+    static ThreadBuffer& get_thread_buffer () {
+        static thread_local ThreadBuffer tb;
+        return tb;
+    }
+
+    void add_buffer (ThreadBuffer* tb) {
+        std::lock_guard<std::mutex> lock(buffers_mutex_);
+        buffers_.push_back(tb);
+    }
+
+    void remove_buffer (ThreadBuffer* tb) {
+        std::lock_guard<std::mutex> lock(buffers_mutex_);
+        tb->lock();
+        write_buffer(*tb);
+        tb->unlock();
+        buffers_.erase(std::remove(buffers_.begin(), buffers_.end(), tb),
+                       buffers_.end());
+    }
+
+    /**
+     * Move the contents of tb to the file. Records made for an earlier
+     * file refer to its site ids, so they are discarded. The caller holds
+     * tb's flag.
+     */
+    void write_buffer (ThreadBuffer& tb) {
+        if (tb.size_ > 0) {
+            std::lock_guard<std::mutex> lock(file_mutex_);
+            if (file_ && tb.generation_ == generation_.load(std::memory_order_relaxed)) {
+                std::fwrite(tb.data_.get(), 1, tb.size_, file_);
+            }
+            tb.size_ = 0;
+        }
+    }
+
+    template <typename T>
+    static void write_raw (std::string& out, const T& v) {
+        out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    /**
+     * Assign an id to the site and write its definition. The definition
+     * reaches the file before any record that refers to it.
+     */
+    void register_site (BinarySite& site, LogVerbosity v, const char* file,
+                        uint32_t line, const char* format,
+                        const char* tags, uint8_t num_args) {
+        std::lock_guard<std::mutex> lock(file_mutex_);
+        uint64_t generation = generation_.load(std::memory_order_relaxed);
+        if ((site.key_.load(std::memory_order_relaxed) >> 32) == generation
+            || file_ == NULL) {
+            return;
+        }
+
+        const char* base_name = std::strrchr(file, '/');
+        base_name = base_name ? base_name + 1 : file;
+        uint16_t file_len = static_cast<uint16_t>(std::strlen(base_name));
+        uint16_t format_len = static_cast<uint16_t>(std::strlen(format));
+        uint32_t id = ++num_sites_;
+
+        std::string def;
+        def.push_back(binary_log_site_tag);
+        write_raw(def, id);
+        write_raw(def, static_cast<uint8_t>(v));
+        write_raw(def, line);
+        write_raw(def, file_len);
+        def.append(base_name, file_len);
+        write_raw(def, format_len);
+        def.append(format, format_len);
+        write_raw(def, num_args);
+        def.append(tags, num_args);
+        std::fwrite(def.data(), 1, def.size(), file_);
+
+        site.key_.store((generation << 32) | id, std::memory_order_release);
+    }
+
+    //-------------------------------------------------------------------------
+    // Argument encoding
+    //-------------------------------------------------------------------------
+    template <typename T>
+    struct ArgTraits {
+        typedef BinaryArg<typename std::decay<T>::type> type;
+    };
+
+    static size_t args_size () { return 0; }
+
+    template <typename T, typename... Args>
+    static size_t args_size (const T& v, const Args&... args) {
+        return ArgTraits<T>::type::size(v) + args_size(args...);
+    }
+
+    static char* put_args (char* p) { return p; }
+
+    template <typename T, typename... Args>
+    static char* put_args (char* p, const T& v, const Args&... args) {
+        return put_args(ArgTraits<T>::type::put(p, v), args...);
+    }
+
+public:
+    /**
+     * Start writing binary records to path. The current LoggerCtrl header
+     * is stored in the file header.
+     * @return false if the file cannot be opened.
+     */
+    static bool open (const std::string& path) {
+        close();
+
+        BinaryLog& bl = BinaryLog::get();
+        std::lock_guard<std::mutex> lock(bl.file_mutex_);
+        bl.file_ = std::fopen(path.c_str(), "wb");
+        if (bl.file_ == NULL) {
+            return false;
+        }
+
+        const std::string& header = LoggerCtrl::get_header();
+        uint32_t header_len = static_cast<uint32_t>(header.size());
+        std::fwrite(binary_log_magic, 1, sizeof(binary_log_magic), bl.file_);
+        std::fwrite(&binary_log_version, sizeof(binary_log_version), 1, bl.file_);
+        std::fwrite(&header_len, sizeof(header_len), 1, bl.file_);
+        std::fwrite(header.data(), 1, header_len, bl.file_);
+
+        bl.num_sites_ = 0;
+        bl.generation_.fetch_add(1, std::memory_order_relaxed);
+        bl.is_open_.store(true, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Flush all thread buffers and close the file. Sites are registered
+     * again if the log is reopened.
+     */
+    static void close () {
+        BinaryLog& bl = BinaryLog::get();
+        if (!bl.is_open_.exchange(false, std::memory_order_acq_rel)) {
+            return;
+        }
+        flush();
+
+        std::lock_guard<std::mutex> lock(bl.file_mutex_);
+        std::fclose(bl.file_);
+        bl.file_ = NULL;
+    }
+
+    /**
+     * Move the records of every thread to the file.
+     */
+    static void flush () {
+        BinaryLog& bl = BinaryLog::get();
+        std::lock_guard<std::mutex> lock(bl.buffers_mutex_);
+        for (auto tb : bl.buffers_) {
+            tb->lock();
+            bl.write_buffer(*tb);
+            tb->unlock();
+        }
+
+        std::lock_guard<std::mutex> file_lock(bl.file_mutex_);
+        if (bl.file_) {
+            std::fflush(bl.file_);
+        }
+    }
+
+    static bool is_open () {
+        return BinaryLog::get().is_open_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @return The number of records dropped because they did not fit in a
+     * thread buffer (ThreadBuffer::capacity bytes).
+     */
+    static uint64_t get_num_dropped () {
+        return BinaryLog::get().num_dropped_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Append a record for site. A record larger than a thread buffer is
+     * dropped and counted (see get_num_dropped). Use the LOGB* macros
+     * instead of calling this directly.
+     */
+    template <typename... Args>
+    static void write (BinarySite& site, LogVerbosity v, const char* file,
+                       uint32_t line, const char* format, const Args&... args) {
+        BinaryLog& bl = BinaryLog::get();
+        uint64_t key = site.key_.load(std::memory_order_acquire);
+        if ((key >> 32) != bl.generation_.load(std::memory_order_relaxed)) {
+            const char tags[] = { ArgTraits<Args>::type::tag..., 0 };
+            bl.register_site(site, v, file, line, format, tags,
+                             static_cast<uint8_t>(sizeof...(Args)));
+            key = site.key_.load(std::memory_order_acquire);
+            if ((key >> 32) != bl.generation_.load(std::memory_order_relaxed)) {
+                return;
+            }
+        }
+        uint32_t id = static_cast<uint32_t>(key);
+
+        size_t size = 1 + sizeof(id) + args_size(args...);
+        ThreadBuffer& tb = get_thread_buffer();
+        if (size > ThreadBuffer::capacity) {
+            bl.num_dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // The log may have been closed and reopened since the id was
+        // read; the record then carries the old generation and is
+        // discarded by write_buffer rather than written to the new file.
+        tb.lock();
+        uint32_t generation = static_cast<uint32_t>(key >> 32);
+        if (tb.generation_ != generation) {
+            bl.write_buffer(tb);
+            tb.generation_ = generation;
+        }
+        if (tb.size_ + size > ThreadBuffer::capacity) {
+            bl.write_buffer(tb);
+        }
+        char* p = tb.data_.get() + tb.size_;
+        *p++ = binary_log_record_tag;
+        std::memcpy(p, &id, sizeof(id));
+        put_args(p + sizeof(id), args...);
+        tb.size_ += size;
+        tb.unlock();
+    }
+};
+
+}   // End of namespace my_log
+
+#endif
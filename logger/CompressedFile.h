@@ -0,0 +1,537 @@
+/**
+ * @file    CompressedFile.h
+ * @author  Jinwook Jung (jinwookjungs@gmail.com)
+ * @date    2017-09-23 01:46:19
+ * @brief   A log file that is compressed block by block in the background.
+ *
+ * File layout:
+ *
+ *      "MYLOGCMP" version:u32
+ *      { "BLK1" codec:u8 raw_size:u32 data_size:u32 checksum:u32 data }*
+ *
+ * Each block is compressed on its own, so a file cut short by a crash can
+ * be read up to the last complete block. The checksum is the FNV-1a hash
+ * of the uncompressed data. Build with -DMY_LOG_HAVE_ZLIB (and -lz) to use
+ * zlib; otherwise blocks use the built-in LzCodec.
+ */
+
+#ifndef COMPRESSED_FILE_H
+#define COMPRESSED_FILE_H
+
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(MY_LOG_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+namespace my_log
+{
+
+const char compressed_log_magic[8] = { 'M', 'Y', 'L', 'O', 'G', 'C', 'M', 'P' };
+const uint32_t compressed_log_version = 1;
+const char compressed_block_magic[4] = { 'B', 'L', 'K', '1' };
+const size_t compressed_block_header_size = 17;
+/// Largest uncompressed block the writer produces; readers reject larger
+/// sizes as corrupted rather than allocate them.
+const size_t compressed_max_block_size = 64 << 20;
+
+/**
+ * How the data of a block is stored.
+ */
+enum class BlockCodec : uint8_t {
+    raw  = 'r',
+    lz   = 'l',
+    zlib = 'z'
+};
+
+
+/**
+ * A small LZ77 codec in the spirit of LZ4: fast, no entropy coding.
+ *
+ * A block is a series of sequences. Each sequence is a token byte (high
+ * nibble: literal length, low nibble: match length - 4), optional length
+ * extension bytes for the literals, the literals, a 16-bit little-endian
+ * match offset, and optional length extension bytes for the match. A
+ * nibble of 15 is followed by bytes that are added to it until one is
+ * less than 255. The last sequence has literals only.
+ */
+class LzCodec
+{
+private:
+    static const size_t min_match = 4;
+    static const size_t hash_bits = 14;
+    static const size_t max_offset = 65535;
+
+    static uint32_t read32 (const char* p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static size_t hash (uint32_t v) {
+        return (v * 2654435761u) >> (32 - hash_bits);
+    }
+
+    static void append_length (std::string& out, size_t len) {
+        for (; len >= 255; len -= 255) {
+            out.push_back(static_cast<char>(255));
+        }
+        out.push_back(static_cast<char>(len));
+    }
+
+    static void append_sequence (std::string& out, const char* literals,
+                                 size_t num_literals, size_t offset,
+                                 size_t match_len) {
+        size_t lit_nibble = std::min<size_t>(num_literals, 15);
+        size_t match_nibble = (match_len == 0)
+                              ? 0 : std::min<size_t>(match_len - min_match, 15);
+        out.push_back(static_cast<char>((lit_nibble << 4) | match_nibble));
+        if (lit_nibble == 15) {
+            append_length(out, num_literals - 15);
+        }
+        out.append(literals, num_literals);
+        if (match_len == 0) {
+            return;
+        }
+        out.push_back(static_cast<char>(offset & 0xff));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (match_nibble == 15) {
+            append_length(out, match_len - min_match - 15);
+        }
+    }
+
+    static bool read_length (const unsigned char*& p, const unsigned char* end,
+                             size_t& len) {
+        unsigned char b;
+        do {
+            if (p == end) {
+                return false;
+            }
+            b = *p++;
+            len += b;
+        } while (b == 255);
+        return true;
+    }
+
+public:
+    /**
+     * Append the compressed form of src[0, n) to out.
+     */
+    static void compress (const char* src, size_t n, std::string& out) {
+        std::vector<uint32_t> table(1 << hash_bits, 0);
+        size_t anchor = 0;
+        size_t i = 0;
+
+        // Positions are stored plus one so that zero means empty.
+        while (n >= min_match && i + min_match <= n) {
+            uint32_t v = read32(src + i);
+            size_t h = hash(v);
+            size_t candidate = table[h];
+            table[h] = static_cast<uint32_t>(i + 1);
+
+            if (candidate == 0 || i + 1 - candidate > max_offset
+                || read32(src + candidate - 1) != v) {
+                i++;
+                continue;
+            }
+
+            size_t match = candidate - 1;
+            size_t len = min_match;
+            while (i + len < n && src[match + len] == src[i + len]) {
+                len++;
+            }
+            append_sequence(out, src + anchor, i - anchor, i - match, len);
+            i += len;
+            anchor = i;
+        }
+        append_sequence(out, src + anchor, n - anchor, 0, 0);
+    }
+
+    /**
+     * Decompress src[0, n) into dst, which must hold exactly raw_size
+     * bytes.
+     * @return false if the data is corrupted.
+     */
+    static bool decompress (const char* src, size_t n, char* dst, size_t raw_size) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(src);
+        const unsigned char* end = p + n;
+        size_t out = 0;
+
+        while (p < end) {
+            unsigned char token = *p++;
+            size_t num_literals = token >> 4;
+            if (num_literals == 15 && !read_length(p, end, num_literals)) {
+                return false;
+            }
+            if (num_literals > static_cast<size_t>(end - p)
+                || num_literals > raw_size - out) {
+                return false;
+            }
+            std::memcpy(dst + out, p, num_literals);
+            p += num_literals;
+            out += num_literals;
+
+            if (p == end) {
+                break;
+            }
+            if (end - p < 2) {
+                return false;
+            }
+            size_t offset = p[0] | (static_cast<size_t>(p[1]) << 8);
+            p += 2;
+            size_t match_len = token & 0x0f;
+            if (match_len == 15 && !read_length(p, end, match_len)) {
+                return false;
+            }
+            match_len += min_match;
+            if (offset == 0 || offset > out || match_len > raw_size - out) {
+                return false;
+            }
+            // Byte by byte: the match may overlap the bytes it produces.
+            for (size_t k = 0; k < match_len; k++, out++) {
+                dst[out] = dst[out - offset];
+            }
+        }
+        return out == raw_size;
+    }
+};
+
+
+/**
+ * Compresses and decompresses blocks with the best available codec.
+ */
+class BlockCompressor
+{
+public:
+    static uint32_t get_checksum (const char* data, size_t n) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; i++) {
+            h = (h ^ static_cast<unsigned char>(data[i])) * 16777619u;
+        }
+        return h;
+    }
+
+    /**
+     * Compress src[0, n) into out.
+     * @return The codec used; raw if compression did not pay off.
+     */
+    static BlockCodec compress (const char* src, size_t n, std::string& out,
+                                int level) {
+        out.clear();
+#if defined(MY_LOG_HAVE_ZLIB)
+        uLongf len = compressBound(static_cast<uLong>(n));
+        out.resize(len);
+        if (compress2(reinterpret_cast<Bytef*>(&out[0]), &len,
+                      reinterpret_cast<const Bytef*>(src),
+                      static_cast<uLong>(n), level) == Z_OK && len < n) {
+            out.resize(len);
+            return BlockCodec::zlib;
+        }
+        out.clear();
+#else
+        (void) level;
+        LzCodec::compress(src, n, out);
+        if (out.size() < n) {
+            return BlockCodec::lz;
+        }
+        out.clear();
+#endif
+        out.assign(src, n);
+        return BlockCodec::raw;
+    }
+
+    /**
+     * Decompress n bytes of src, stored with codec, into raw_size bytes at
+     * dst.
+     * @return false if the data is corrupted or the codec is not built in.
+     */
+    static bool decompress (BlockCodec codec, const char* src, size_t n,
+                            char* dst, size_t raw_size) {
+        switch (codec) {
+            case BlockCodec::raw:
+                if (n != raw_size) {
+                    return false;
+                }
+                std::memcpy(dst, src, n);
+                return true;
+
+            case BlockCodec::lz:
+                return LzCodec::decompress(src, n, dst, raw_size);
+
+            case BlockCodec::zlib: {
+#if defined(MY_LOG_HAVE_ZLIB)
+                uLongf len = static_cast<uLongf>(raw_size);
+                return uncompress(reinterpret_cast<Bytef*>(dst), &len,
+                                  reinterpret_cast<const Bytef*>(src),
+                                  static_cast<uLong>(n)) == Z_OK
+                       && len == raw_size;
+#else
+                return false;
+#endif
+            }
+
+            default:
+                return false;
+        }
+    }
+};
+
+
+/**
+ * A stream buffer that cuts its output into blocks and compresses and
+ * writes them from a background thread.
+ *
+ * The put area is the block being filled, so a write is a memcpy. A block
+ * is handed to the worker when it is full, or on sync once it has been
+ * open for flush_interval; a crash loses at most the records of the open
+ * block and of the blocks still queued. If the worker falls behind by
+ * max_pending blocks, the writer waits.
+ *
+ * A block that cannot be written (e.g. the disk is full) is dropped and
+ * its records are counted; sync() fails from then on. Later blocks are
+ * still written, and log_unpack skips the broken frame between them.
+ */
+class CompressedFileBuffer : public std::streambuf
+{
+private:
+    size_t block_size_;
+    size_t max_pending_;
+    std::chrono::milliseconds flush_interval_;
+    int level_;
+
+    int fd_;
+    std::string block_;                     ///< Block being filled.
+    std::chrono::steady_clock::time_point block_start_;
+
+    std::deque<std::string> pending_;       ///< Full blocks, oldest first.
+    std::vector<std::string> free_;         ///< Recycled block buffers.
+    bool stop_;
+    std::atomic<bool> failed_;              ///< A block could not be written.
+    std::atomic<uint64_t> num_dropped_;     ///< Records in unwritten blocks.
+    std::mutex mutex_;
+    std::condition_variable pending_cv_;
+    std::condition_variable free_cv_;
+    std::thread thread_;
+
+    CompressedFileBuffer (const CompressedFileBuffer& cfb) = delete;
+    CompressedFileBuffer& operator= (const CompressedFileBuffer& cfb) = delete;
+
+    static bool write_all (int fd, const char* data, size_t len) {
+        while (len > 0) {
+            ssize_t n = ::write(fd, data, len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static void append_u32 (std::string& out, uint32_t v) {
+        char bytes[4];
+        std::memcpy(bytes, &v, sizeof(v));
+        out.append(bytes, sizeof(bytes));
+    }
+
+    void reset_put_area () {
+        block_.resize(block_size_);
+        setp(&block_[0], &block_[0] + block_size_);
+        block_start_ = std::chrono::steady_clock::now();
+    }
+
+    /**
+     * Queue the filled part of the block for the worker.
+     */
+    void cut_block () {
+        size_t len = static_cast<size_t>(pptr() - pbase());
+        if (len == 0) {
+            return;
+        }
+        block_.resize(len);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (pending_.size() >= max_pending_) {
+            free_cv_.wait(lock);
+        }
+        pending_.push_back(std::string());
+        pending_.back().swap(block_);
+        if (!free_.empty()) {
+            block_.swap(free_.back());
+            free_.pop_back();
+        }
+        lock.unlock();
+        pending_cv_.notify_one();
+
+        reset_put_area();
+    }
+
+    void run () {
+        std::string data;
+        std::string frame;
+
+        for (;;) {
+            std::string block;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                while (pending_.empty() && !stop_) {
+                    pending_cv_.wait(lock);
+                }
+                if (pending_.empty()) {
+                    break;
+                }
+                block.swap(pending_.front());
+                pending_.pop_front();
+            }
+
+            BlockCodec codec = BlockCompressor::compress(block.data(), block.size(),
+                                                         data, level_);
+            frame.assign(compressed_block_magic, sizeof(compressed_block_magic));
+            frame.push_back(static_cast<char>(codec));
+            append_u32(frame, static_cast<uint32_t>(block.size()));
+            append_u32(frame, static_cast<uint32_t>(data.size()));
+            append_u32(frame, BlockCompressor::get_checksum(block.data(), block.size()));
+            frame.append(data);
+            if (!write_all(fd_, frame.data(), frame.size())) {
+                failed_.store(true, std::memory_order_relaxed);
+                num_dropped_.fetch_add(std::count(block.begin(), block.end(), '\n'),
+                                       std::memory_order_relaxed);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                free_.push_back(std::string());
+                free_.back().swap(block);
+            }
+            free_cv_.notify_one();
+        }
+    }
+
+protected:
+    virtual int_type overflow (int_type c) {
+        if (fd_ < 0) {
+            return traits_type::eof();
+        }
+        cut_block();
+        if (c != traits_type::eof()) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    virtual std::streamsize xsputn (const char* s, std::streamsize n) {
+        if (fd_ < 0) {
+            return 0;
+        }
+        std::streamsize written = 0;
+        while (written < n) {
+            if (pptr() == epptr()) {
+                cut_block();
+            }
+            std::streamsize len = std::min(n - written,
+                                           static_cast<std::streamsize>(epptr() - pptr()));
+            std::memcpy(pptr(), s + written, static_cast<size_t>(len));
+            pbump(static_cast<int>(len));
+            written += len;
+        }
+        return written;
+    }
+
+    /**
+     * Hand the block to the worker if it has been open long enough.
+     * Cutting on every sync would make the blocks too small to compress.
+     * @return -1 if a block has failed to be written.
+     */
+    virtual int sync () {
+        if (fd_ < 0) {
+            return -1;
+        }
+        if (std::chrono::steady_clock::now() - block_start_ >= flush_interval_) {
+            cut_block();
+        }
+        return failed_.load(std::memory_order_relaxed) ? -1 : 0;
+    }
+
+public:
+    /**
+     * @param path           File to write to; an existing file is replaced.
+     * @param block_size     Uncompressed bytes per block, at most
+     *                       compressed_max_block_size.
+     * @param flush_interval Longest time a record waits in the open block,
+     *                       checked whenever the stream is flushed.
+     * @param level          zlib compression level; unused by LzCodec.
+     * @param max_pending    Blocks queued before the writer waits.
+     */
+    CompressedFileBuffer (const std::string& path, size_t block_size = 1 << 20,
+                          std::chrono::milliseconds flush_interval
+                              = std::chrono::milliseconds(1000),
+                          int level = 6, size_t max_pending = 4)
+        : block_size_(std::min(std::max<size_t>(block_size, 1),
+                               compressed_max_block_size)),
+          max_pending_(max_pending > 0 ? max_pending : 1),
+          flush_interval_(flush_interval), level_(level), fd_(-1), stop_(false),
+          failed_(false), num_dropped_(0) {
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            return;
+        }
+
+        std::string header(compressed_log_magic, sizeof(compressed_log_magic));
+        append_u32(header, compressed_log_version);
+        if (!write_all(fd_, header.data(), header.size())) {
+            ::close(fd_);
+            fd_ = -1;
+            return;
+        }
+
+        reset_put_area();
+        thread_ = std::thread(&CompressedFileBuffer::run, this);
+    }
+
+    /**
+     * Compress the open block, wait for the worker and close the file.
+     */
+    ~CompressedFileBuffer () {
+        if (fd_ < 0) {
+            return;
+        }
+        cut_block();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        pending_cv_.notify_one();
+        thread_.join();
+        ::close(fd_);
+    }
+
+    bool is_open () const { return fd_ >= 0; }
+
+    /**
+     * @return Number of records lost in blocks that could not be written.
+     */
+    uint64_t get_num_dropped () const {
+        return num_dropped_.load(std::memory_order_relaxed);
+    }
+};
+
+}   // End of namespace my_log
+
+#endif
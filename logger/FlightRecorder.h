@@ -0,0 +1,267 @@
+/**
+ * @file    FlightRecorder.h
+ * @author  Jinwook Jung (jinwookjungs@gmail.com)
+ * @date    2017-09-23 01:46:19
+ * @brief   Keeps the most recent log records of each thread in memory.
+ */
+
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include "LogUtil.h"
+
+namespace my_log
+{
+
+/**
+ * A fixed-size ring of recent records per thread, dumped to a file on a
+ * crash or on request.
+ *
+ * Recording is a memcpy into the calling thread's ring; there is no I/O
+ * and no locking. Rings are linked into a list that is never shrunk, so
+ * the dump can walk it from a signal handler; the ring of a finished
+ * thread keeps its contents until a new thread takes it over.
+ *
+ * Rings are never freed, since a dump may be reading any of them. A new
+ * thread reuses a free ring of the configured size, so the memory is
+ * bounded by the peak number of recording threads times the ring size,
+ * plus the rings of sizes configured earlier, which are kept until the
+ * process exits. The dump
+ * uses only open, write and close, which are async-signal-safe. A dump
+ * taken while a thread is recording may cut that thread's newest record.
+ */
+class FlightRecorder
+{
+private:
+    struct Ring {
+        Ring* next_;                    ///< Next ring in the list.
+        std::atomic<bool> in_use_;
+        std::atomic<uint64_t> tid_;
+        std::atomic<uint64_t> size_;    ///< Total bytes ever written.
+        size_t capacity_;
+        std::unique_ptr<char[]> data_;
+
+        explicit Ring (size_t capacity)
+            : next_(NULL), in_use_(true), tid_(0), size_(0),
+              capacity_(capacity), data_(new char[capacity]) {}
+    };
+
+    /// Set once the calling thread's ring has been released. Records
+    /// committed later in the thread's teardown (e.g. by the destructor
+    /// of a thread-local Logger) are not recorded.
+    static bool& is_released () {
+        static thread_local bool released = false;
+        return released;
+    }
+
+    /**
+     * Releases the ring of a thread when the thread exits.
+     */
+    struct RingHolder {
+        Ring* ring_;
+
+        RingHolder () : ring_(NULL) {}
+        ~RingHolder () {
+            is_released() = true;
+            if (ring_) {
+                ring_->in_use_.store(false, std::memory_order_release);
+                ring_ = NULL;
+            }
+        }
+    };
+
+    std::atomic<Ring*> rings_;
+    std::atomic<size_t> ring_size_;
+    char path_[PATH_MAX];
+
+    FlightRecorder () : rings_(NULL), ring_size_(1 << 20) {
+        path_[0] = '\0';
+    }
+    FlightRecorder (const FlightRecorder& fr) = delete;
+    FlightRecorder& operator= (const FlightRecorder& fr) = delete;
+
+    static FlightRecorder& get () {
+        static FlightRecorder fr;
+        return fr;
+    }
+
+    /**
+     * Take over a free ring of the current size, or add a new one.
+     */
+    Ring* acquire_ring () {
+        size_t capacity = ring_size_.load(std::memory_order_relaxed);
+        for (Ring* r = rings_.load(std::memory_order_acquire); r; r = r->next_) {
+            bool in_use = false;
+            if (r->capacity_ == capacity
+                && r->in_use_.compare_exchange_strong(in_use, true,
+                                                      std::memory_order_acquire)) {
+                r->size_.store(0, std::memory_order_relaxed);
+                r->tid_.store(LogUtil::get_cached_thread_id(), std::memory_order_relaxed);
+                return r;
+            }
+        }
+
+        Ring* r = new Ring(capacity);
+        r->tid_.store(LogUtil::get_cached_thread_id(), std::memory_order_relaxed);
+        r->next_ = rings_.load(std::memory_order_relaxed);
+        while (!rings_.compare_exchange_weak(r->next_, r,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed)) {}
+        return r;
+    }
+
+    /**
+     * @return The ring of the calling thread, or NULL once the thread has
+     * released it.
+     */
+    static Ring* get_thread_ring () {
+        if (is_released()) {
+            return NULL;
+        }
+        static thread_local RingHolder holder;
+        if (holder.ring_ == NULL) {
+            holder.ring_ = FlightRecorder::get().acquire_ring();
+        }
+        return holder.ring_;
+    }
+
+    static bool write_all (int fd, const char* data, size_t len) {
+        while (len > 0) {
+            ssize_t n = ::write(fd, data, len);
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static void handle_signal (int sig) {
+        dump();
+        // The handler was installed with SA_RESETHAND, so this runs the
+        // default action.
+        raise(sig);
+    }
+
+public:
+    /**
+     * Set the dump file and the size of rings created from now on.
+     */
+    static void configure (const std::string& path, size_t bytes_per_thread) {
+        FlightRecorder& fr = FlightRecorder::get();
+        size_t len = std::min(path.size(), sizeof(fr.path_) - 1);
+        std::memcpy(fr.path_, path.data(), len);
+        fr.path_[len] = '\0';
+        fr.ring_size_.store(bytes_per_thread > 0 ? bytes_per_thread : 1,
+                            std::memory_order_relaxed);
+    }
+
+    /**
+     * Dump the rings when the process receives SIGSEGV, SIGABRT, SIGBUS,
+     * SIGFPE or SIGILL.
+     */
+    static void install_signal_handlers () {
+        FlightRecorder::get();
+
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &FlightRecorder::handle_signal;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESETHAND;
+
+        const int signals[] = { SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL };
+        for (int sig : signals) {
+            sigaction(sig, &sa, NULL);
+        }
+    }
+
+    /**
+     * Append a record to the ring of the calling thread.
+     */
+    static void record (const char* data, size_t len) {
+        Ring* ring = get_thread_ring();
+        if (ring == NULL) {
+            return;
+        }
+        Ring& r = *ring;
+        if (len > r.capacity_) {
+            data += len - r.capacity_;
+            len = r.capacity_;
+        }
+
+        uint64_t size = r.size_.load(std::memory_order_relaxed);
+        size_t pos = static_cast<size_t>(size % r.capacity_);
+        size_t first = std::min(len, r.capacity_ - pos);
+        std::memcpy(r.data_.get() + pos, data, first);
+        std::memcpy(r.data_.get(), data + first, len - first);
+        r.size_.store(size + len, std::memory_order_release);
+    }
+
+    /**
+     * Write every ring, oldest data first, to path (or the configured dump
+     * file if path is NULL). Async-signal-safe.
+     * @return false if the file cannot be written.
+     */
+    static bool dump (const char* path = NULL) {
+        FlightRecorder& fr = FlightRecorder::get();
+        if (path == NULL) {
+            path = fr.path_;
+        }
+        if (path[0] == '\0') {
+            return false;
+        }
+
+        int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+
+        bool ok = true;
+        for (Ring* r = fr.rings_.load(std::memory_order_acquire); r; r = r->next_) {
+            uint64_t size = r->size_.load(std::memory_order_acquire);
+            if (size == 0) {
+                continue;
+            }
+
+            ok = write_all(fd, "=== thread ", 11) && ok;
+            char tid[20];
+            ok = write_all(fd, tid, LogUtil::format_uint(
+                     tid, r->tid_.load(std::memory_order_relaxed))) && ok;
+            ok = write_all(fd, " ===\n", 5) && ok;
+
+            const char* data = r->data_.get();
+            if (size <= r->capacity_) {
+                ok = write_all(fd, data, static_cast<size_t>(size)) && ok;
+            } else {
+                // Skip the partly overwritten oldest line.
+                size_t pos = static_cast<size_t>(size % r->capacity_);
+                size_t begin = pos;
+                while (begin < r->capacity_ && data[begin] != '\n') {
+                    begin++;
+                }
+                if (begin < r->capacity_) {
+                    begin++;
+                    ok = write_all(fd, data + begin, r->capacity_ - begin) && ok;
+                }
+                ok = write_all(fd, data, pos) && ok;
+            }
+        }
+
+        ::close(fd);
+        return ok;
+    }
+};
+
+}   // End of namespace my_log
+
+#endif
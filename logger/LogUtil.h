@@ -0,0 +1,75 @@
+/**
+ * @file    LogUtil.h
+ * @author  Jinwook Jung (jinwookjungs@gmail.com)
+ * @date    2017-09-23 01:46:19
+ * @brief   Helpers shared by the logger and the flight recorder.
+ */
+
+#ifndef LOG_UTIL_H
+#define LOG_UTIL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace my_log
+{
+
+/**
+ * Number formatting and thread ids. format_uint does not allocate or
+ * lock, so the flight recorder also uses it in its signal handler.
+ */
+class LogUtil
+{
+public:
+    /**
+     * Write v as decimal, zero-padded to num_digits, to buf, which must
+     * hold at least max(20, num_digits) chars. No terminating '\0'.
+     * @return Number of chars written.
+     */
+    static size_t format_uint (char* buf, uint64_t v, int num_digits = 1) {
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = static_cast<char>('0' + v % 10);
+            v /= 10;
+        } while (v > 0);
+
+        size_t len = 0;
+        for (int i = n; i < num_digits; i++) {
+            buf[len++] = '0';
+        }
+        while (n > 0) {
+            buf[len++] = digits[--n];
+        }
+        return len;
+    }
+
+    /**
+     * @return The OS thread id on Linux, a small sequential id elsewhere.
+     */
+    static uint64_t get_thread_id () {
+#if defined(__linux__)
+        return static_cast<uint64_t>(syscall(SYS_gettid));
+#else
+        static std::atomic<uint64_t> num_threads(0);
+        return ++num_threads;
+#endif
+    }
+
+    /**
+     * As get_thread_id, looked up once per thread.
+     */
+    static uint64_t get_cached_thread_id () {
+        static thread_local uint64_t tid = get_thread_id();
+        return tid;
+    }
+};
+
+}   // End of namespace my_log
+
+#endif
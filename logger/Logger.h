@@ -15,16 +15,172 @@
 #include <algorithm>
 #include <functional>
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <clocale>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <type_traits>
+#include <time.h>
+#include "LogUtil.h"
+#include "RotatingFile.h"
+#include "CompressedFile.h"
+#include "FlightRecorder.h"
 
 //-----------------------------------------------------------------------------
 // Logging macros
 //-----------------------------------------------------------------------------
-#define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
-#define LOG  my_log::Logger<my_log::LogVerbosity::message>::get()
-#define LOGE my_log::Logger<my_log::LogVerbosity::error>::get()
-#define LOGW my_log::Logger<my_log::LogVerbosity::warning>::get()
-#define LOGI my_log::Logger<my_log::LogVerbosity::info>::get()
-#define LOGD my_log::Logger<my_log::LogVerbosity::debug>::get().set_file_string(my_log::FileString(__FILENAME__, __LINE__))
+
+// The most verbose level compiled in, as the integer value of LogVerbosity
+// (0: message, 1: error, 2: warning, 3: info, 4: debug). Statements above
+// it are removed at compile time, e.g., -DMY_LOG_MAX_VERBOSITY=3 for
+// release builds without any debug logging.
+#ifndef MY_LOG_MAX_VERBOSITY
+#define MY_LOG_MAX_VERBOSITY 4
+#endif
+
+// The level is checked once per statement. When it is disabled, nothing
+// to the right of the macro (including the operands of <<) is evaluated.
+#define MY_LOG_IF_ENABLED(V) \
+    !my_log::LoggerCtrl::is_enabled<V>() ? (void) 0 : my_log::LogVoidify() &
+
+// A statement above MY_LOG_MAX_VERBOSITY. The operands still have to
+// compile, but the dead branch of a constant ?: is never emitted, even at
+// -O0, and no Logger or CallSite is instantiated for it.
+#define MY_LOG_DISABLED \
+    true ? (void) 0 : my_log::LogVoidify() & my_log::NullLogger()
+
+// A reference to the CallSite of the statement. The record is a static of
+// its own lambda; the basename is found at compile time, so the record is
+// constant-initialized (no static-init guard) and a statement only passes
+// a pointer.
+#define MY_LOG_CALL_SITE \
+    []() -> const my_log::CallSite& { \
+        static const my_log::CallSite site = { \
+            __FILE__ + std::integral_constant<size_t, \
+                           my_log::get_base_name_offset(__FILE__)>::value, \
+            __LINE__ }; \
+        return site; \
+    }()
+
+//-----------------------------------------------------------------------------
+// Rate-limited logging macros
+//
+// LOGW_EVERY_N(n)    logs the 1st, (n+1)th, (2n+1)th, ... execution; n = 0
+//                    logs nothing.
+// LOGW_FIRST_N(n)    logs the first n executions.
+// LOGW_RATE(per_sec) is a token bucket of per_sec tokens, refilled at
+//                    per_sec tokens per second: it logs per_sec records per
+//                    second on average, but a statement that has been quiet
+//                    for a second may log a burst of per_sec on top of that,
+//                    i.e., up to 2 * per_sec in one second.
+//
+// The first record of a LOGW_RATE statement after it was suppressed
+// reports how many records were dropped. A statement that stays quiet
+// after being suppressed gets a summary record of its own, written within
+// a second by a background thread (started on the first suppression), and
+// by LoggerCtrl::flush().
+//
+// The state is a per-statement LogLimiter; an admitted statement costs one
+// relaxed atomic increment on top of the verbosity check.
+//-----------------------------------------------------------------------------
+#define MY_LOG_IF_ADMITTED(V, admitted) \
+    !(my_log::LoggerCtrl::is_enabled<V>() && (admitted)) \
+        ? (void) 0 : my_log::LogVoidify() &
+
+// The LogLimiter of the statement. It is constant-initialized, so there is
+// no static-init guard.
+#define MY_LOG_LIMITER \
+    []() -> my_log::LogLimiter& { static my_log::LogLimiter limiter; return limiter; }()
+
+// The LogLimiter of a LOG*_RATE statement, which also knows how to report
+// the records it suppressed.
+#define MY_LOG_RATE_LIMITER(V) \
+    []() -> my_log::LogLimiter& { \
+        static my_log::LogLimiter limiter( \
+            &my_log::Logger<V>::commit_suppressed, \
+            __FILE__ + std::integral_constant<size_t, \
+                           my_log::get_base_name_offset(__FILE__)>::value, \
+            __LINE__); \
+        return limiter; \
+    }()
+
+#define MY_LOG_EVERY_N(V, n) MY_LOG_IF_ADMITTED(V, MY_LOG_LIMITER.every_n(n))
+#define MY_LOG_FIRST_N(V, n) MY_LOG_IF_ADMITTED(V, MY_LOG_LIMITER.first_n(n))
+#define MY_LOG_RATE(V, per_sec) \
+    MY_LOG_IF_ADMITTED(V, my_log::Logger<V>::get().admit( \
+                              MY_LOG_RATE_LIMITER(V).rate(per_sec)))
+
+#define LOG  MY_LOG_IF_ENABLED(my_log::LogVerbosity::message) \
+             my_log::Logger<my_log::LogVerbosity::message>::get()
+
+#if MY_LOG_MAX_VERBOSITY >= 1
+#define LOGE MY_LOG_IF_ENABLED(my_log::LogVerbosity::error) \
+             my_log::Logger<my_log::LogVerbosity::error>::get()
+#define LOGE_EVERY_N(n) MY_LOG_EVERY_N(my_log::LogVerbosity::error, n) \
+                        my_log::Logger<my_log::LogVerbosity::error>::get()
+#define LOGE_FIRST_N(n) MY_LOG_FIRST_N(my_log::LogVerbosity::error, n) \
+                        my_log::Logger<my_log::LogVerbosity::error>::get()
+#define LOGE_RATE(per_sec) MY_LOG_RATE(my_log::LogVerbosity::error, per_sec) \
+                           my_log::Logger<my_log::LogVerbosity::error>::get()
+#else
+#define LOGE               MY_LOG_DISABLED
+#define LOGE_EVERY_N(n)    MY_LOG_DISABLED
+#define LOGE_FIRST_N(n)    MY_LOG_DISABLED
+#define LOGE_RATE(per_sec) MY_LOG_DISABLED
+#endif
+
+#if MY_LOG_MAX_VERBOSITY >= 2
+#define LOGW MY_LOG_IF_ENABLED(my_log::LogVerbosity::warning) \
+             my_log::Logger<my_log::LogVerbosity::warning>::get()
+#define LOGW_EVERY_N(n) MY_LOG_EVERY_N(my_log::LogVerbosity::warning, n) \
+                        my_log::Logger<my_log::LogVerbosity::warning>::get()
+#define LOGW_FIRST_N(n) MY_LOG_FIRST_N(my_log::LogVerbosity::warning, n) \
+                        my_log::Logger<my_log::LogVerbosity::warning>::get()
+#define LOGW_RATE(per_sec) MY_LOG_RATE(my_log::LogVerbosity::warning, per_sec) \
+                           my_log::Logger<my_log::LogVerbosity::warning>::get()
+#else
+#define LOGW               MY_LOG_DISABLED
+#define LOGW_EVERY_N(n)    MY_LOG_DISABLED
+#define LOGW_FIRST_N(n)    MY_LOG_DISABLED
+#define LOGW_RATE(per_sec) MY_LOG_DISABLED
+#endif
+
+#if MY_LOG_MAX_VERBOSITY >= 3
+#define LOGI MY_LOG_IF_ENABLED(my_log::LogVerbosity::info) \
+             my_log::Logger<my_log::LogVerbosity::info>::get()
+#define LOGI_EVERY_N(n) MY_LOG_EVERY_N(my_log::LogVerbosity::info, n) \
+                        my_log::Logger<my_log::LogVerbosity::info>::get()
+#define LOGI_FIRST_N(n) MY_LOG_FIRST_N(my_log::LogVerbosity::info, n) \
+                        my_log::Logger<my_log::LogVerbosity::info>::get()
+#define LOGI_RATE(per_sec) MY_LOG_RATE(my_log::LogVerbosity::info, per_sec) \
+                           my_log::Logger<my_log::LogVerbosity::info>::get()
+#else
+#define LOGI               MY_LOG_DISABLED
+#define LOGI_EVERY_N(n)    MY_LOG_DISABLED
+#define LOGI_FIRST_N(n)    MY_LOG_DISABLED
+#define LOGI_RATE(per_sec) MY_LOG_DISABLED
+#endif
+
+#if MY_LOG_MAX_VERBOSITY >= 4
+#define LOGD MY_LOG_IF_ENABLED(my_log::LogVerbosity::debug) \
+             my_log::Logger<my_log::LogVerbosity::debug>::get().set_call_site(MY_LOG_CALL_SITE)
+#define LOGD_EVERY_N(n) MY_LOG_EVERY_N(my_log::LogVerbosity::debug, n) \
+                        my_log::Logger<my_log::LogVerbosity::debug>::get().set_call_site(MY_LOG_CALL_SITE)
+#define LOGD_FIRST_N(n) MY_LOG_FIRST_N(my_log::LogVerbosity::debug, n) \
+                        my_log::Logger<my_log::LogVerbosity::debug>::get().set_call_site(MY_LOG_CALL_SITE)
+#define LOGD_RATE(per_sec) MY_LOG_RATE(my_log::LogVerbosity::debug, per_sec) \
+                           my_log::Logger<my_log::LogVerbosity::debug>::get().set_call_site(MY_LOG_CALL_SITE)
+#else
+#define LOGD               MY_LOG_DISABLED
+#define LOGD_EVERY_N(n)    MY_LOG_DISABLED
+#define LOGD_FIRST_N(n)    MY_LOG_DISABLED
+#define LOGD_RATE(per_sec) MY_LOG_DISABLED
+#endif
 
 namespace my_log 
 {
@@ -36,61 +192,946 @@ enum class LogVerbosity { message, error, warning, info, debug };
 
 
 /**
- * For passing the file name and the line number at which the logger is called.
+ * The file name and the line number at which the logger is called. One
+ * static instance exists per call site; see MY_LOG_CALL_SITE.
+ */
+struct CallSite
+{
+    const char* file_name_;
+    uint32_t line_num_;
+
+    friend std::ostream& operator<< (std::ostream& os, const CallSite& cs);
+};
+
+inline std::ostream& operator<< (std::ostream& os, const CallSite& cs)
+{   
+    os << cs.file_name_ << ":" << cs.line_num_;
+    return os;
+}
+
+/**
+ * @return Offset of the file name in path, i.e., one past the last '/'.
+ */
+constexpr size_t get_base_name_offset (const char* path, size_t i = 0,
+                                       size_t offset = 0)
+{
+    return path[i] == '\0' 
+           ? offset 
+           : get_base_name_offset(path, i + 1, path[i] == '/' ? i + 1 : offset);
+}
+
+
+/**
+ * Timestamp written at the start of each record.
+ */
+enum class LogTimestamp { 
+    none, 
+    monotonic,          ///< Seconds since boot, e.g., 1234.567890.
+    wall,               ///< Local time, e.g., 2017-09-23 01:46:19.123456.
+    monotonic_coarse,   ///< As monotonic, at timer-tick resolution.
+    wall_coarse         ///< As wall, at timer-tick resolution.
+};
+
+#if defined(CLOCK_MONOTONIC_COARSE) && defined(CLOCK_REALTIME_COARSE)
+#define MY_LOG_CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC_COARSE
+#define MY_LOG_CLOCK_REALTIME_COARSE CLOCK_REALTIME_COARSE
+#else
+#define MY_LOG_CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC
+#define MY_LOG_CLOCK_REALTIME_COARSE CLOCK_REALTIME
+#endif
+
+
+/**
+ * Formats record timestamps and thread ids.
+ *
+ * The clocks are read with clock_gettime, which is served from the vDSO
+ * without a system call; the coarse clocks (Linux) only read the time of
+ * the last timer tick, which is several times cheaper still. The date part
+ * of the wall clock is formatted with localtime_r/strftime once per second
+ * and cached per thread, and the digits are written by hand, so a prefix
+ * costs a few tens of ns.
  */
-struct FileString
+class RecordPrefix
 {
-    std::string file_name_;
+public:
+    /**
+     * Append v as decimal, zero-padded to num_digits.
+     */
+    static void append_uint (std::string& out, uint64_t v, int num_digits = 1) {
+        char buf[20];
+        out.append(buf, LogUtil::format_uint(buf, v, std::min(num_digits, 20)));
+    }
+
+    static void append_timestamp (std::string& out, LogTimestamp ts) {
+        struct timespec now;
+
+        if (ts == LogTimestamp::monotonic || ts == LogTimestamp::monotonic_coarse) {
+            clock_gettime(ts == LogTimestamp::monotonic
+                          ? CLOCK_MONOTONIC : MY_LOG_CLOCK_MONOTONIC_COARSE, &now);
+            append_uint(out, static_cast<uint64_t>(now.tv_sec));
+        } else if (ts == LogTimestamp::wall || ts == LogTimestamp::wall_coarse) {
+            static thread_local time_t cached_sec = -1;
+            static thread_local char cached_date[32];
+            static thread_local size_t cached_len = 0;
+
+            clock_gettime(ts == LogTimestamp::wall
+                          ? CLOCK_REALTIME : MY_LOG_CLOCK_REALTIME_COARSE, &now);
+            if (now.tv_sec != cached_sec) {
+                struct tm tm;
+                localtime_r(&now.tv_sec, &tm);
+                cached_len = std::strftime(cached_date, sizeof(cached_date),
+                                           "%Y-%m-%d %H:%M:%S", &tm);
+                cached_sec = now.tv_sec;
+            }
+            out.append(cached_date, cached_len);
+        } else {
+            return;
+        }
+
+        out.push_back('.');
+        append_uint(out, static_cast<uint64_t>(now.tv_nsec / 1000), 6);
+        out.push_back(' ');
+    }
+
+    /**
+     * Append "[tid] ". The id is looked up once per thread.
+     */
+    static void append_thread_id (std::string& out) {
+        out.push_back('[');
+        append_uint(out, LogUtil::get_cached_thread_id());
+        out.append("] ");
+    }
+};
+
+
+/**
+ * Per-statement state of the rate-limited logging macros.
+ *
+ * A limiter of a LOG*_RATE statement that suppresses a record puts itself
+ * on a global list, so that report_suppressed() can write a summary for
+ * it if the statement never logs again. The list only grows; a limiter is
+ * a static of its statement and lives as long as the program.
+ */
+class LogLimiter
+{
+public:
+    /**
+     * Commits a summary of n suppressed records of the statement at
+     * file_name:line_num.
+     */
+    typedef void (*ReportFunc)(const char* file_name, uint32_t line_num,
+                               uint64_t n);
+
+private:
+    ReportFunc report_;
+    const char* file_name_;
     uint32_t line_num_;
 
-    FileString () : file_name_(), line_num_() {}
-    FileString (std::string file_name, uint32_t line_num) : file_name_(file_name), 
-                                                       line_num_(line_num) {}
+    std::atomic<uint64_t> count_;           ///< Executions.
+    std::atomic<uint64_t> limit_;           ///< Admit while count_ < limit_.
+    std::atomic<int64_t> refill_ms_;        ///< Last refill in ms, 0 before the first.
+    std::atomic<uint64_t> num_suppressed_;  ///< Not reported yet.
+    std::atomic<bool> listed_;
+    LogLimiter* next_;                      ///< Set before listed.
+
+    LogLimiter (const LogLimiter& l) = delete;
+    LogLimiter& operator= (const LogLimiter& l) = delete;
+
+    static int64_t get_time_ms () {
+        struct timespec now;
+        clock_gettime(MY_LOG_CLOCK_MONOTONIC_COARSE, &now);
+        return static_cast<int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+    }
+
+    static std::atomic<LogLimiter*>& get_list () {
+        static std::atomic<LogLimiter*> head(nullptr);
+        return head;
+    }
+
+    /**
+     * @return Number of suppressed records to report with an admitted one.
+     */
+    uint64_t take_suppressed () {
+        return num_suppressed_.load(std::memory_order_relaxed) == 0
+               ? 0 : num_suppressed_.exchange(0, std::memory_order_relaxed);
+    }
+
+    void suppress () {
+        num_suppressed_.fetch_add(1, std::memory_order_relaxed);
+        if (report_ && !listed_.load(std::memory_order_relaxed)
+            && !listed_.exchange(true, std::memory_order_relaxed)) {
+            std::atomic<LogLimiter*>& head = get_list();
+            next_ = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(next_, this,
+                                               std::memory_order_release)) {
+            }
+            Reporter::start();
+        }
+    }
+
+    /**
+     * A thread that writes the summaries of quiet statements once a
+     * second. It is started when a statement is first listed, so a
+     * program that never suppresses a record has no such thread, and it
+     * is stopped at exit before the logger goes away (the logger is
+     * constructed before any statement can be listed).
+     */
+    class Reporter
+    {
+    private:
+        bool stop_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::thread thread_;
+
+        Reporter () : stop_(false) {
+            thread_ = std::thread(&Reporter::run, this);
+        }
+        Reporter (const Reporter& r) = delete;
+        Reporter& operator= (const Reporter& r) = delete;
+
+        ~Reporter () {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cv_.notify_one();
+            thread_.join();
+        }
+
+        void run () {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!cv_.wait_for(lock, std::chrono::seconds(1),
+                                 [this] { return stop_; })) {
+                lock.unlock();
+                report_suppressed();
+                lock.lock();
+            }
+        }
+
+    public:
+        static void start () {
+            static Reporter reporter;
+        }
+    };
+
+    /**
+     * Add the tokens earned since the last refill to an empty bucket, the
+     * execution count of which is count. Whole tokens only are taken, so
+     * the remainder carries over to the next refill.
+     * @return false if no token has been earned, or if another thread has
+     *         refilled the bucket in the meantime.
+     */
+    bool refill (uint64_t count, uint64_t per_sec) {
+        int64_t now = get_time_ms();
+        int64_t last = refill_ms_.load(std::memory_order_relaxed);
+        int64_t elapsed = (last == 0) ? 1000 : std::min<int64_t>(now - last, 1000);
+        if (elapsed <= 0) {
+            return false;       // Refilled after this thread read the clock.
+        }
+        uint64_t num_tokens = static_cast<uint64_t>(elapsed) * per_sec / 1000;
+        if (num_tokens == 0) {
+            return false;
+        }
+
+        int64_t next = (elapsed == 1000)
+                       ? now
+                       : last + static_cast<int64_t>(num_tokens * 1000 / per_sec);
+        if (!refill_ms_.compare_exchange_strong(last, next,
+                                                std::memory_order_relaxed)) {
+            return false;
+        }
+
+        uint64_t limit = limit_.load(std::memory_order_relaxed);
+        while (limit < count + num_tokens
+               && !limit_.compare_exchange_weak(limit, count + num_tokens,
+                                                std::memory_order_relaxed)) {
+        }
+        return true;
+    }
+
+public:
+    constexpr LogLimiter ()
+        : report_(nullptr), file_name_(nullptr), line_num_(0), count_(0),
+          limit_(0), refill_ms_(0), num_suppressed_(0), listed_(false),
+          next_(nullptr) {}
+
+    constexpr LogLimiter (ReportFunc report, const char* file_name,
+                          uint32_t line_num)
+        : report_(report), file_name_(file_name), line_num_(line_num),
+          count_(0), limit_(0), refill_ms_(0), num_suppressed_(0),
+          listed_(false), next_(nullptr) {}
+
+    bool every_n (uint64_t n) {
+        return n != 0 && count_.fetch_add(1, std::memory_order_relaxed) % n == 0;
+    }
+
+    bool first_n (uint64_t n) {
+        return count_.fetch_add(1, std::memory_order_relaxed) < n;
+    }
+
+    /**
+     * Take a token from a bucket of per_sec tokens that refills at per_sec
+     * tokens per second. Only an execution that finds the bucket empty
+     * reads the clock.
+     * @return 0 if suppressed, otherwise one plus the number of executions
+     *         suppressed and not yet reported.
+     */
+    uint64_t rate (uint64_t per_sec) {
+        uint64_t count = count_.fetch_add(1, std::memory_order_relaxed);
+        if (count < limit_.load(std::memory_order_relaxed)
+            || (per_sec > 0 && refill(count, per_sec))) {
+            return 1 + take_suppressed();
+        }
+        suppress();
+        return 0;
+    }
+
+    /**
+     * Write a summary for every statement with suppressed records that
+     * have not been reported with a later record of the statement.
+     */
+    static void report_suppressed () {
+        for (LogLimiter* l = get_list().load(std::memory_order_acquire);
+             l != nullptr; l = l->next_) {
+            uint64_t n = l->take_suppressed();
+            if (n > 0) {
+                l->report_(l->file_name_, l->line_num_, n);
+            }
+        }
+    }
+};
+
+
+/**
+ * Appends JSON tokens to a string. Numbers are formatted without
+ * iostreams, so appending to a buffer that has reached its working size
+ * never allocates.
+ */
+class JsonWriter
+{
+public:
+    static void append_string (std::string& out, const char* s, size_t len) {
+        static const char hex[] = "0123456789abcdef";
+
+        out.push_back('"');
+        for (size_t i = 0; i < len; i++) {
+            unsigned char c = static_cast<unsigned char>(s[i]);
+            switch (c) {
+                case '"':  out.append("\\\"", 2); break;
+                case '\\': out.append("\\\\", 2); break;
+                case '\n': out.append("\\n", 2); break;
+                case '\r': out.append("\\r", 2); break;
+                case '\t': out.append("\\t", 2); break;
+                default:
+                    if (c < 0x20) {
+                        out.append("\\u00", 4);
+                        out.push_back(hex[c >> 4]);
+                        out.push_back(hex[c & 0xf]);
+                    } else {
+                        out.push_back(static_cast<char>(c));
+                    }
+            }
+        }
+        out.push_back('"');
+    }
+
+    static void append_value (std::string& out, const char* v) {
+        append_string(out, v, std::strlen(v));
+    }
+
+    static void append_value (std::string& out, const std::string& v) {
+        append_string(out, v.data(), v.size());
+    }
+
+    static void append_value (std::string& out, char v) {
+        append_string(out, &v, 1);
+    }
+
+    static void append_value (std::string& out, bool v) {
+        out.append(v ? "true" : "false");
+    }
+
+    static void append_value (std::string& out, double v) {
+        if (v != v || v - v != 0) {
+            out.append("null");     // NaN and infinities
+            return;
+        }
+        // The shorter of the two precisions that reads back exactly.
+        char buf[32];
+        int n = std::snprintf(buf, sizeof(buf), "%.15g", v);
+        if (std::strtod(buf, NULL) != v) {
+            n = std::snprintf(buf, sizeof(buf), "%.17g", v);
+        }
+
+        // snprintf follows LC_NUMERIC; JSON always wants a '.'.
+        const char* point = std::localeconv()->decimal_point;
+        size_t point_len = std::strlen(point);
+        const char* p = (point_len == 1 && point[0] == '.')
+                        ? NULL : std::strstr(buf, point);
+        if (p && point_len > 0) {
+            size_t pos = static_cast<size_t>(p - buf);
+            out.append(buf, pos);
+            out.push_back('.');
+            out.append(p + point_len, static_cast<size_t>(n) - pos - point_len);
+            return;
+        }
+        out.append(buf, static_cast<size_t>(n));
+    }
+
+    static void append_value (std::string& out, float v) {
+        append_value(out, static_cast<double>(v));
+    }
+
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value
+                                   && std::is_unsigned<T>::value>::type
+    append_value (std::string& out, T v) {
+        RecordPrefix::append_uint(out, v);
+    }
+
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value
+                                   && std::is_signed<T>::value>::type
+    append_value (std::string& out, T v) {
+        uint64_t u = static_cast<uint64_t>(v);
+        if (v < 0) {
+            out.push_back('-');
+            u = 0 - u;
+        }
+        RecordPrefix::append_uint(out, u);
+    }
+};
+
+
+/**
+ * A stream buffer that appends everything written to it to a string.
+ * Used to build a complete log record before it is committed.
+ */
+class LineBuffer : public std::streambuf
+{
+private:
+    std::string line_;
+
+public:
+    std::string& get_line () { return line_; }
+
+    virtual int_type overflow (int_type c) {
+        if (c != traits_type::eof()) {
+            line_.push_back(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
+    }
+
+    virtual std::streamsize xsputn (const char* s, std::streamsize n) {
+        line_.append(s, static_cast<size_t>(n));
+        return n;
+    }
+};
+
+
+/**
+ * What to do when a record is pushed to a full RecordQueue.
+ */
+enum class OverflowPolicy {
+    block,          ///< Wait until the consumer frees a slot.
+    drop_newest,    ///< Discard the record being pushed.
+    drop_oldest     ///< Discard the oldest queued record to make room.
+};
+
+
+/**
+ * A bounded lock-free queue of log records.
+ *
+ * Each slot carries a sequence number that tells producers and the consumer
+ * whether the slot is free or filled for the current lap (D. Vyukov's
+ * bounded queue). Records are swapped in and out of the slots, so once the
+ * string buffers have grown to the typical record length, neither side
+ * allocates. Popping is also safe from producer threads, which is what
+ * OverflowPolicy::drop_oldest relies on.
+ */
+class RecordQueue
+{
+private:
+    struct Slot {
+        std::atomic<size_t> seq_;
+        LogVerbosity verbosity_;
+        std::string record_;
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+
+    // Producers and the consumer update different cache lines.
+    char pad0_[64];
+    std::atomic<size_t> head_;              ///< Next position to push.
+    char pad1_[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail_;              ///< Next position to pop.
+    char pad2_[64 - sizeof(std::atomic<size_t>)];
+
+    RecordQueue (const RecordQueue& q) = delete;
+    RecordQueue& operator= (const RecordQueue& q) = delete;
+
+public:
+    /**
+     * @param capacity Number of slots, rounded up to a power of two.
+     */
+    explicit RecordQueue (size_t capacity) : head_(0), tail_(0) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots_.reset(new Slot[size]);
+        mask_ = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            slots_[i].seq_.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t get_capacity () const { return mask_ + 1; }
+
+    /**
+     * @return Number of records pushed so far.
+     */
+    uint64_t get_num_pushed () const {
+        return head_.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Push a record of verbosity v. On success, record holds a recycled
+     * buffer.
+     * @return false if the queue is full.
+     */
+    bool try_push (LogVerbosity v, std::string& record) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots_[pos & mask_];
+            size_t seq = slot.seq_.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+                    slot.verbosity_ = v;
+                    slot.record_.swap(record);
+                    slot.seq_.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Pop the oldest record into v and record.
+     * @return false if the queue is empty.
+     */
+    bool try_pop (LogVerbosity& v, std::string& record) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots_[pos & mask_];
+            size_t seq = slot.seq_.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+                    v = slot.verbosity_;
+                    slot.record_.swap(record);
+                    slot.seq_.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+
+/**
+ * Writes log records from a background thread.
+ * Producers only touch the RecordQueue; the worker drains it and hands the
+ * records to a write function, so a slow sink never stalls the logging
+ * thread. The flush function is called whenever the queue runs empty after
+ * records have been written. A writer with nothing left to write calls
+ * neither function, even while it is being destroyed.
+ */
+class AsyncWriter
+{
+public:
+    typedef std::function<void (LogVerbosity, const std::string&)> WriteFunc;
+    typedef std::function<void ()> FlushFunc;
+
+private:
+    WriteFunc write_;
+    FlushFunc flush_;
+    OverflowPolicy policy_;
+    RecordQueue queue_;
+
+    std::atomic<uint64_t> num_retired_;     ///< Records written or evicted.
+    std::atomic<uint64_t> num_flushed_;     ///< num_retired_ as of the last flush_.
+    std::atomic<uint64_t> num_dropped_;     ///< Records lost to overflow.
+    std::atomic<bool> stop_;
+
+    std::mutex mutex_;
+    std::condition_variable wakeup_cv_;
+    std::condition_variable retired_cv_;
+    std::thread thread_;
+
+    AsyncWriter (const AsyncWriter& aw) = delete;
+    AsyncWriter& operator= (const AsyncWriter& aw) = delete;
+
+    void run () {
+        LogVerbosity v;
+        std::string record;
+        uint32_t num_idle = 0;
+
+        for (;;) {
+            if (queue_.try_pop(v, record)) {
+                write_(v, record);
+                num_retired_.fetch_add(1, std::memory_order_release);
+                num_idle = 0;
+                continue;
+            }
+
+            // The queue is empty; push what we have to the devices. Records
+            // evicted by drop_oldest count as retired too, so compare the
+            // counters rather than track whether this thread wrote any.
+            uint64_t retired = num_retired_.load(std::memory_order_acquire);
+            if (retired != num_flushed_.load(std::memory_order_relaxed)) {
+                flush_();
+                num_flushed_.store(retired, std::memory_order_release);
+                std::lock_guard<std::mutex> lock(mutex_);
+                retired_cv_.notify_all();
+            }
+
+            if (stop_.load(std::memory_order_acquire)) {
+                break;
+            }
+
+            // Spin briefly before going to sleep. Producers never take the
+            // lock, so the sleep is bounded by a timeout.
+            if (++num_idle < 64) {
+                std::this_thread::yield();
+            } else {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wakeup_cv_.wait_for(lock, std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+public:
+    AsyncWriter (WriteFunc write, FlushFunc flush, size_t capacity,
+                 OverflowPolicy policy)
+        : write_(write), flush_(flush), policy_(policy), queue_(capacity),
+          num_retired_(0), num_flushed_(0), num_dropped_(0), stop_(false) {
+        thread_ = std::thread(&AsyncWriter::run, this);
+    }
+
+    /**
+     * Drain all queued records, flush if any were written, and stop the
+     * worker. No thread may push while the writer is being destroyed.
+     */
+    ~AsyncWriter () {
+        stop_.store(true, std::memory_order_release);
+        wakeup_cv_.notify_one();
+        thread_.join();
+    }
+
+    /**
+     * Hand a finished record of verbosity v to the worker. On return,
+     * record holds a recycled buffer (or the rejected record if it was
+     * dropped).
+     */
+    void push (LogVerbosity v, std::string& record) {
+        while (!queue_.try_push(v, record)) {
+            switch (policy_) {
+                case OverflowPolicy::drop_newest:
+                    num_dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+
+                case OverflowPolicy::drop_oldest: {
+                    LogVerbosity oldest_v;
+                    std::string oldest;
+                    if (queue_.try_pop(oldest_v, oldest)) {
+                        num_dropped_.fetch_add(1, std::memory_order_relaxed);
+                        num_retired_.fetch_add(1, std::memory_order_release);
+                    }
+                    break;
+                }
+
+                case OverflowPolicy::block:
+                default:
+                    wakeup_cv_.notify_one();
+                    std::this_thread::yield();
+                    break;
+            }
+        }
+    }
+
+    /**
+     * Block until every record pushed before this call has been written
+     * and the sinks have been flushed.
+     */
+    void flush () {
+        uint64_t target = queue_.get_num_pushed();
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (num_flushed_.load(std::memory_order_acquire) < target) {
+            wakeup_cv_.notify_one();
+            retired_cv_.wait_for(lock, std::chrono::milliseconds(1));
+        }
+    }
+
+    uint64_t get_num_dropped () const {
+        return num_dropped_.load(std::memory_order_relaxed);
+    }
+};
+
+
+/**
+ * How a sink of OutStream is written.
+ */
+enum class SinkPolicy {
+    blocking,       ///< The committing thread writes to the sink.
+    non_blocking    ///< A worker of the sink writes; records are dropped when it falls behind.
+};
+
+
+/**
+ * An output stream that redirects the data to multiple streams.
+ *
+ * Each sink has a maximum verbosity and a SinkPolicy. Records written with
+ * write_record only go to the sinks that accept their verbosity; data
+ * written through the ostream interface goes to every sink.
+ *
+ * A sink's stream must outlive the OutStream, or be detached with
+ * clear_streams() before it goes away. The worker of a non-blocking sink
+ * only touches its stream while it has records to write. The OutStream
+ * stops the workers first when it is destroyed.
+ */
+class OutStream : public std::ostream
+{
+private:
+    /**
+     * Collects the output in a put area and hands it to every sink with one
+     * sputn per sink when the area fills up or the stream is flushed.
+     * Writes larger than the area bypass it. Records that every sink
+     * accepts are batched in the put area as well; the others are written
+     * to the sinks that accept them once the area has been emptied.
+     */
+    class StreamBuffer : public std::streambuf {
+    private:
+        static const size_t buffer_size = 4096;
+        static const size_t queue_capacity = 4096;
+
+        struct Sink {
+            std::streambuf* buf_;
+            LogVerbosity max_verbosity_;
+            std::unique_ptr<AsyncWriter> writer_;   ///< Set if non-blocking.
+        };
+
+        std::vector<Sink> sinks_;
+        int min_verbosity_;         ///< Lowest max verbosity of the sinks.
+        char data_[buffer_size];
+
+        static bool accepts (const Sink& sink, LogVerbosity v) {
+            return static_cast<int>(v) <= static_cast<int>(sink.max_verbosity_);
+        }
+
+        /**
+         * Send n bytes to one sink. A non-blocking sink gets a copy on its
+         * queue; the copy buffer is recycled through the queue slots.
+         */
+        static bool write_to (Sink& sink, LogVerbosity v, 
+                              const char* s, std::streamsize n) {
+            if (sink.writer_) {
+                static thread_local std::string record;
+                record.assign(s, static_cast<size_t>(n));
+                sink.writer_->push(v, record);
+                return true;
+            }
+            return sink.buf_->sputn(s, n) == n;
+        }
+
+        /**
+         * Send n bytes to every sink.
+         * @return false if any of the sinks failed.
+         */
+        bool forward (const char* s, std::streamsize n) {
+            bool ok = true;
+            for (auto it = sinks_.begin(); it != sinks_.end(); ++it) {
+                if (!write_to(*it, LogVerbosity::message, s, n)) {
+                    ok = false;
+                }
+            }
+            return ok;
+        }
+
+        /**
+         * Empty the put area.
+         */
+        bool forward_pending () {
+            std::streamsize n = pptr() - pbase();
+            setp(data_, data_ + buffer_size);
+            return n == 0 || forward(data_, n);
+        }
+    
+    public:
+        StreamBuffer () : min_verbosity_(-1) {
+            setp(data_, data_ + buffer_size);
+        }
+
+        /**
+         * Stop the non-blocking sinks before anything else goes away.
+         */
+        ~StreamBuffer () {
+            stop_non_blocking();
+        }
+
+        void add_buffer (std::streambuf* buf, LogVerbosity max_verbosity,
+                         SinkPolicy policy) { 
+            forward_pending();
+
+            Sink sink;
+            sink.buf_ = buf;
+            sink.max_verbosity_ = max_verbosity;
+            if (policy == SinkPolicy::non_blocking) {
+                sink.writer_.reset(new AsyncWriter(
+                    [buf](LogVerbosity, const std::string& record) {
+                        buf->sputn(record.data(), 
+                                   static_cast<std::streamsize>(record.size()));
+                    },
+                    [buf]() { buf->pubsync(); },
+                    queue_capacity, OverflowPolicy::drop_newest));
+            }
+            min_verbosity_ = sinks_.empty()
+                             ? static_cast<int>(max_verbosity)
+                             : std::min(min_verbosity_,
+                                        static_cast<int>(max_verbosity));
+            sinks_.push_back(std::move(sink)); 
+        }
+
+        /**
+         * Drain the non-blocking sinks and detach every sink.
+         */
+        void clear_buffers () {
+            sync();
+            stop_non_blocking();
+            sinks_.clear();
+            min_verbosity_ = -1;
+        }
+
+        /**
+         * Drain the workers of the non-blocking sinks and join them. A
+         * stopped sink is written by the committing thread from then on.
+         * The worker of a sink that has written everything it was given
+         * does not touch the stream again.
+         */
+        void stop_non_blocking () {
+            for (auto it = sinks_.begin(); it != sinks_.end(); ++it) {
+                it->writer_.reset();
+            }
+        }
+
+        /**
+         * @return The highest verbosity accepted by any sink, or -1 if
+         * there are no sinks.
+         */
+        int get_max_verbosity () const {
+            int v = -1;
+            for (auto it = sinks_.begin(); it != sinks_.end(); ++it) {
+                v = std::max(v, static_cast<int>(it->max_verbosity_));
+            }
+            return v;
+        }
+
+        uint64_t get_num_dropped () const {
+            uint64_t n = 0;
+            for (auto it = sinks_.begin(); it != sinks_.end(); ++it) {
+                if (it->writer_) {
+                    n += it->writer_->get_num_dropped();
+                }
+            }
+            return n;
+        }
 
-    friend std::ostream& operator<< (std::ostream& os, const FileString& fs);
-};
+        bool write_record (LogVerbosity v, const char* s, std::streamsize n) {
+            if (static_cast<int>(v) <= min_verbosity_) {
+                return sputn(s, n) == n;
+            }
 
-inline std::ostream& operator<< (std::ostream& os, const FileString& fs)
-{   
-    os << fs.file_name_ << ":" << fs.line_num_;
-    return os;
-}
+            bool ok = forward_pending();
+            for (auto it = sinks_.begin(); it != sinks_.end(); ++it) {
+                if (accepts(*it, v) && !write_to(*it, v, s, n)) {
+                    ok = false;
+                }
+            }
+            return ok;
+        }
 
+        /**
+         * Empty the put area and flush the blocking sinks.
+         */
+        bool sync_blocking () {
+            bool ok = forward_pending();
+            for (auto it = sinks_.begin(); it != sinks_.end(); ++it) {
+                if (!it->writer_ && it->buf_->pubsync() == -1) {
+                    ok = false;
+                }
+            }
+            return ok;
+        }
 
-/**
- * An output stream that redirects the data to multiple streams.
- */
-class OutStream : public std::ostream
-{
-private:
-    class StreamBuffer : public std::streambuf {
-    private:
-        std::vector<std::streambuf*> bufs_;
-    
-    public:
-        void add_buffer (std::streambuf* buf) { 
-            bufs_.push_back(buf); 
+        /**
+         * Wait until the non-blocking sinks have written what they were
+         * given.
+         */
+        void sync_non_blocking () {
+            for (auto it = sinks_.begin(); it != sinks_.end(); ++it) {
+                if (it->writer_) {
+                    it->writer_->flush();
+                }
+            }
         }
 
         virtual int_type overflow (int_type c) {
-            bool returned_eof = false;
+            bool returned_eof = !forward_pending();
 
-            for (auto it = bufs_.begin(); it != bufs_.end(); ++it) {
-                if ((*it)->sputc(c) == traits_type::eof()) {
-                    returned_eof = true; 
-                }
+            if (c != traits_type::eof()) {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
             }
 
-            return returned_eof ? traits_type::eof() : c;
+            return returned_eof ? traits_type::eof() : traits_type::not_eof(c);
         }
 
-        virtual int sync() {
-            int ret = 0;
-            for (auto it = bufs_.begin(); it != bufs_.end(); ++it) {
-                if ((*it)->pubsync() == -1) {
-                    ret = -1;
-                }
+        virtual std::streamsize xsputn (const char* s, std::streamsize n) {
+            if (n <= epptr() - pptr()) {
+                std::memcpy(pptr(), s, static_cast<size_t>(n));
+                pbump(static_cast<int>(n));
+                return n;
+            }
+
+            if (!forward_pending()) {
+                return 0;
             }
+            if (n < static_cast<std::streamsize>(buffer_size)) {
+                std::memcpy(pptr(), s, static_cast<size_t>(n));
+                pbump(static_cast<int>(n));
+                return n;
+            }
+            return forward(s, n) ? n : 0;
+        }
+
+        virtual int sync() {
+            int ret = sync_blocking() ? 0 : -1;
+            sync_non_blocking();
             return ret;
         }
     };  
@@ -102,9 +1143,72 @@ public:
         std::ostream::rdbuf(&buffer_); 
     }
 
-    void add_stream (std::ostream& os) {
+    /**
+     * Attach os. Only records up to max_verbosity are written to it. A
+     * non-blocking sink is written by a thread of its own and drops
+     * records when its queue is full, so it never stalls the other sinks.
+     */
+    void add_stream (std::ostream& os, 
+                     LogVerbosity max_verbosity = LogVerbosity::debug,
+                     SinkPolicy policy = SinkPolicy::blocking) {
         os.flush();
-        buffer_.add_buffer(os.rdbuf());
+        buffer_.add_buffer(os.rdbuf(), max_verbosity, policy);
+    }
+
+    /**
+     * Flush and detach all streams.
+     */
+    void clear_streams () {
+        buffer_.clear_buffers();
+    }
+
+    /**
+     * @return The highest verbosity accepted by any sink, or -1 if there
+     * are no sinks.
+     */
+    int get_max_verbosity () const {
+        return buffer_.get_max_verbosity();
+    }
+
+    /**
+     * @return Number of records the non-blocking sinks have dropped.
+     */
+    uint64_t get_num_dropped () const {
+        return buffer_.get_num_dropped();
+    }
+
+    /**
+     * Write a record of verbosity v to the sinks that accept it.
+     */
+    void write_record (LogVerbosity v, const std::string& record) {
+        if (!buffer_.write_record(v, record.data(), 
+                                  static_cast<std::streamsize>(record.size()))) {
+            setstate(std::ios_base::badbit);
+        }
+    }
+
+    /**
+     * Flush the blocking sinks without waiting for the non-blocking ones.
+     */
+    void flush_blocking () {
+        if (!buffer_.sync_blocking()) {
+            setstate(std::ios_base::badbit);
+        }
+    }
+
+    /**
+     * Wait until the non-blocking sinks have caught up.
+     */
+    void flush_non_blocking () {
+        buffer_.sync_non_blocking();
+    }
+
+    /**
+     * Drain the non-blocking sinks and stop their workers. From then on,
+     * the committing thread writes to them.
+     */
+    void stop_non_blocking () {
+        buffer_.stop_non_blocking();
     }
 };
 
@@ -115,16 +1219,67 @@ public:
 class LoggerCtrl 
 {
 private:
-    OutStream os_;
     std::string header_;
-    LogVerbosity max_verbosity_;
+    std::atomic<LogVerbosity> max_verbosity_;
+    std::atomic<LogTimestamp> timestamp_;
+    std::atomic<bool> shows_thread_id_;
+    std::atomic<int> recorder_verbosity_;   ///< -1 if the recorder is off.
+    std::atomic<int> sink_verbosity_;       ///< Highest level of any sink, or -1.
+    std::vector<std::unique_ptr<std::streambuf>> owned_bufs_;
+    std::vector<std::unique_ptr<std::ostream>> owned_streams_;
+    std::vector<CompressedFileBuffer*> compressed_bufs_;   ///< In owned_bufs_.
+    OutStream os_;
+    std::unique_ptr<AsyncWriter> async_;
+    std::mutex os_mutex_;           ///< Guards os_ and the owned sinks.
 
-    LoggerCtrl() : os_(), header_(""), max_verbosity_(LogVerbosity::info) {
+    LoggerCtrl() : header_(""), max_verbosity_(LogVerbosity::info),
+                   timestamp_(LogTimestamp::none), shows_thread_id_(false),
+                   recorder_verbosity_(-1), sink_verbosity_(-1), os_() {
         os_.add_stream(std::cout);
+        update_sink_verbosity();
     }
     LoggerCtrl(const LoggerCtrl& lc) = delete;
     LoggerCtrl& operator=(const LoggerCtrl& lc) = delete;
 
+    /**
+     * Stop the background threads while every sink still exists: the
+     * async writer drains into the sinks, then the non-blocking sinks
+     * drain into their streams, and only then do the owned streams go.
+     */
+    ~LoggerCtrl() {
+        async_.reset();
+        os_.stop_non_blocking();
+    }
+
+    void update_sink_verbosity() {
+        sink_verbosity_.store(os_.get_max_verbosity(), std::memory_order_relaxed);
+    }
+
+    /**
+     * Attach a sink owned by LoggerCtrl. The async writer walks the sinks
+     * under os_mutex_, so this is safe after enable_async().
+     */
+    void add_owned(std::unique_ptr<std::streambuf> buf,
+                   std::unique_ptr<std::ostream> os,
+                   LogVerbosity max_verbosity, SinkPolicy policy) {
+        std::lock_guard<std::mutex> lock(os_mutex_);
+        if (buf) {
+            owned_bufs_.push_back(std::move(buf));
+        }
+        owned_streams_.push_back(std::move(os));
+        os_.add_stream(*owned_streams_.back(), max_verbosity, policy);
+        update_sink_verbosity();
+    }
+
+    /**
+     * @return true if a record of verbosity v would reach any sink.
+     */
+    static bool is_written(int v) {
+        LoggerCtrl& lc = LoggerCtrl::get();
+        return v <= static_cast<int>(lc.max_verbosity_.load(std::memory_order_relaxed))
+               && v <= lc.sink_verbosity_.load(std::memory_order_relaxed);
+    }
+
 public:
     static LoggerCtrl& get() {
         static LoggerCtrl lc;
@@ -133,120 +1288,599 @@ public:
 
     static OutStream& get_os()            { return LoggerCtrl::get().os_; }
     static std::string& get_header()      { return LoggerCtrl::get().header_; }
-    static LogVerbosity& get_max_verbosity() { return LoggerCtrl::get().max_verbosity_; }
+    static LogVerbosity get_max_verbosity() { 
+        return LoggerCtrl::get().max_verbosity_.load(std::memory_order_relaxed); 
+    }
+
+    /**
+     * @return true if V is within both the compile-time and the runtime
+     * maximum verbosity, regardless of the sinks.
+     */
+    template <LogVerbosity V>
+    static bool is_within_max_verbosity() {
+        return static_cast<int>(V) <= MY_LOG_MAX_VERBOSITY
+               && static_cast<int>(V) <= static_cast<int>(get_max_verbosity());
+    }
+
+    /**
+     * @return true if statements of verbosity V should be logged, i.e. if
+     * a sink or the flight recorder takes them. The LOG* macros above
+     * MY_LOG_MAX_VERBOSITY do not call this; they are MY_LOG_DISABLED.
+     */
+    template <LogVerbosity V>
+    static bool is_enabled() {
+        return static_cast<int>(V) <= MY_LOG_MAX_VERBOSITY
+               && (is_written(static_cast<int>(V))
+                   || static_cast<int>(V) <= get_recorder_verbosity());
+    }
+
+    static int get_recorder_verbosity() {
+        return LoggerCtrl::get().recorder_verbosity_.load(std::memory_order_relaxed);
+    }
 
     static void set_header(std::string header) { 
         LoggerCtrl::get().header_ = header; 
     }
     static void set_max_verbosity(const LogVerbosity& v) {
-        LoggerCtrl::get().max_verbosity_ = v; 
+        LoggerCtrl::get().max_verbosity_.store(v, std::memory_order_relaxed);
     }
+    static LogTimestamp get_timestamp() {
+        return LoggerCtrl::get().timestamp_.load(std::memory_order_relaxed);
+    }
+    static bool shows_thread_id() {
+        return LoggerCtrl::get().shows_thread_id_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Start each record with a timestamp.
+     */
+    static void set_timestamp(LogTimestamp ts) {
+        LoggerCtrl::get().timestamp_.store(ts, std::memory_order_relaxed);
+    }
+    /**
+     * Start each record with the id of the logging thread.
+     */
+    static void set_thread_id(bool shows) {
+        LoggerCtrl::get().shows_thread_id_.store(shows, std::memory_order_relaxed);
+    }
+
     static void reset_max_verbosity() {
-        LoggerCtrl::get().max_verbosity_ = LogVerbosity::info;
+        LoggerCtrl::get().max_verbosity_.store(LogVerbosity::info,
+                                               std::memory_order_relaxed);
+    }
+
+    /**
+     * Write records up to max_verbosity to os as well. A non-blocking
+     * sink drops records instead of slowing down the others; see
+     * get_num_dropped(). Safe to call while other threads log, and
+     * after enable_async().
+     *
+     * os must outlive the logger, or be detached with clear_streams()
+     * before it goes away. If nothing is logged to it afterwards, flush()
+     * is enough: a sink that has written everything does not touch its
+     * stream again. Sinks added with add_file and the like are owned by
+     * LoggerCtrl and need neither.
+     */
+    static void add_stream(std::ostream& os,
+                           LogVerbosity max_verbosity = LogVerbosity::debug,
+                           SinkPolicy policy = SinkPolicy::blocking) {
+        LoggerCtrl& lc = LoggerCtrl::get();
+        std::lock_guard<std::mutex> lock(lc.os_mutex_);
+        lc.os_.add_stream(os, max_verbosity, policy);
+        lc.update_sink_verbosity();
+    }
+
+    /**
+     * Detach every stream, including std::cout. No other thread may log
+     * during the call.
+     */
+    static void clear_streams() {
+        LoggerCtrl::flush();
+        LoggerCtrl& lc = LoggerCtrl::get();
+        std::lock_guard<std::mutex> lock(lc.os_mutex_);
+        lc.os_.clear_streams();
+        lc.owned_streams_.clear();
+        lc.compressed_bufs_.clear();
+        lc.owned_bufs_.clear();
+        lc.update_sink_verbosity();
+    }
+
+    /**
+     * Log to the file at path, which is truncated. The sink is owned by
+     * LoggerCtrl.
+     * @return false if the file cannot be created.
+     */
+    static bool add_file(const std::string& path,
+                         LogVerbosity max_verbosity = LogVerbosity::debug,
+                         SinkPolicy policy = SinkPolicy::blocking) {
+        std::unique_ptr<std::ofstream> ofs(new std::ofstream(path.c_str()));
+        if (!ofs->is_open()) {
+            return false;
+        }
+
+        LoggerCtrl::get().add_owned(NULL, std::move(ofs), max_verbosity, policy);
+        return true;
+    }
+
+    /**
+     * Log to a file that rotates by size or time. The sink is owned by
+     * LoggerCtrl. See RotatingFileBuffer for the parameters.
+     * @return false if the file cannot be created.
+     */
+    static bool add_rotating_file(const std::string& path, size_t max_size,
+                                  std::chrono::seconds interval = std::chrono::seconds(0),
+                                  size_t num_files = 8,
+                                  LogVerbosity max_verbosity = LogVerbosity::debug,
+                                  SinkPolicy policy = SinkPolicy::blocking) {
+        std::unique_ptr<RotatingFileBuffer> buf(
+            new RotatingFileBuffer(path, max_size, interval, num_files));
+        if (!buf->is_open()) {
+            return false;
+        }
+
+        std::unique_ptr<std::ostream> os(new std::ostream(buf.get()));
+        LoggerCtrl::get().add_owned(std::move(buf), std::move(os),
+                                    max_verbosity, policy);
+        return true;
+    }
+
+    /**
+     * Log to a file that is compressed block by block in the background.
+     * The sink is owned by LoggerCtrl; read it back with log_unpack. See
+     * CompressedFileBuffer for the parameters.
+     * @return false if the file cannot be created.
+     */
+    static bool add_compressed_file(const std::string& path,
+                                    size_t block_size = 1 << 20,
+                                    LogVerbosity max_verbosity = LogVerbosity::debug,
+                                    SinkPolicy policy = SinkPolicy::blocking) {
+        std::unique_ptr<CompressedFileBuffer> buf(
+            new CompressedFileBuffer(path, block_size));
+        if (!buf->is_open()) {
+            return false;
+        }
+
+        LoggerCtrl& lc = LoggerCtrl::get();
+        CompressedFileBuffer* cfb = buf.get();
+        std::unique_ptr<std::ostream> os(new std::ostream(cfb));
+        lc.add_owned(std::move(buf), std::move(os), max_verbosity, policy);
+        std::lock_guard<std::mutex> lock(lc.os_mutex_);
+        lc.compressed_bufs_.push_back(cfb);
+        return true;
+    }
+
+    /**
+     * Write records from a background thread. Call this before other
+     * threads start logging.
+     * @param capacity Maximum number of records in flight.
+     * @param policy   What to do when the queue is full.
+     */
+    static void enable_async(size_t capacity = 8192,
+                             OverflowPolicy policy = OverflowPolicy::block) {
+        LoggerCtrl& lc = LoggerCtrl::get();
+        lc.async_.reset();
+        lc.async_.reset(new AsyncWriter(
+            [&lc](LogVerbosity v, const std::string& record) {
+                std::lock_guard<std::mutex> lock(lc.os_mutex_);
+                lc.os_.write_record(v, record);
+            },
+            [&lc]() {
+                std::lock_guard<std::mutex> lock(lc.os_mutex_);
+                lc.os_.flush_blocking();
+            },
+            capacity, policy));
+    }
+
+    /**
+     * Drain the queue, stop the background thread and go back to writing
+     * on the caller's thread. No other thread may log during the call.
+     */
+    static void shutdown_async() {
+        LoggerCtrl::get().async_.reset();
+    }
+
+    /**
+     * Write the summaries of suppressed rate-limited statements, and wait
+     * until every record logged so far has reached the sinks.
+     * @return false if a blocking sink has failed since the logger started.
+     */
+    static bool flush() {
+        LogLimiter::report_suppressed();
+
+        LoggerCtrl& lc = LoggerCtrl::get();
+        if (lc.async_) {
+            lc.async_->flush();
+        } else {
+            std::lock_guard<std::mutex> lock(lc.os_mutex_);
+            lc.os_.flush_blocking();
+        }
+        std::lock_guard<std::mutex> lock(lc.os_mutex_);
+        lc.os_.flush_non_blocking();
+        return !lc.os_.bad();
+    }
+
+    /**
+     * @return Number of records discarded because the async queue or the
+     * queue of a non-blocking sink was full, or because a compressed file
+     * could not be written.
+     */
+    static uint64_t get_num_dropped() {
+        LoggerCtrl& lc = LoggerCtrl::get();
+        std::lock_guard<std::mutex> lock(lc.os_mutex_);
+        uint64_t n = (lc.async_ ? lc.async_->get_num_dropped() : 0)
+                     + lc.os_.get_num_dropped();
+        for (auto cfb : lc.compressed_bufs_) {
+            n += cfb->get_num_dropped();
+        }
+        return n;
+    }
+
+    /**
+     * Keep records up to verbosity v in a per-thread ring in memory (see
+     * FlightRecorder), whether or not they are written to the sinks. The
+     * rings are dumped to path by dump_flight_recorder() and, if
+     * catches_signals is set, when the process crashes.
+     */
+    static void enable_flight_recorder(LogVerbosity v, const std::string& path,
+                                       size_t bytes_per_thread = 1 << 20,
+                                       bool catches_signals = true) {
+        FlightRecorder::configure(path, bytes_per_thread);
+        if (catches_signals) {
+            FlightRecorder::install_signal_handlers();
+        }
+        LoggerCtrl::get().recorder_verbosity_.store(static_cast<int>(v),
+                                                    std::memory_order_relaxed);
+    }
+
+    static void disable_flight_recorder() {
+        LoggerCtrl::get().recorder_verbosity_.store(-1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Write the flight recorder rings to the configured file.
+     * @return false if the file cannot be written.
+     */
+    static bool dump_flight_recorder() {
+        return FlightRecorder::dump();
+    }
+
+    /**
+     * Send a finished record of verbosity v to the sinks and/or the flight
+     * recorder. Records from different threads never interleave. On
+     * return, record holds a recycled buffer whose contents are
+     * unspecified.
+     */
+    static void commit(LogVerbosity v, std::string& record) {
+        LoggerCtrl& lc = LoggerCtrl::get();
+        if (static_cast<int>(v) <= get_recorder_verbosity()) {
+            FlightRecorder::record(record.data(), record.size());
+        }
+        if (!is_written(static_cast<int>(v))) {
+            return;
+        }
+
+        if (lc.async_) {
+            lc.async_->push(v, record);
+        } else {
+            std::lock_guard<std::mutex> lock(lc.os_mutex_);
+            lc.os_.write_record(v, record);
+            lc.os_.flush_blocking();
+        }
+    }
+};
+
+
+template <LogVerbosity V> class Logger;
+
+/**
+ * A structured record being built with Logger<V>::kv. It is a temporary
+ * of the logging statement; the record is committed as one JSON line when
+ * it goes away at the end of the statement:
+ *
+ *      LOGI.kv("net", net_name).kv("wl", 3.2);
+ *      // {"level":"info","net":"n1234","wl":3.2}
+ */
+template <LogVerbosity V>
+class KvRecord
+{
+private:
+    Logger<V>* logger_;
+
+    KvRecord (const KvRecord& r) = delete;
+    KvRecord& operator= (const KvRecord& r) = delete;
+
+public:
+    explicit KvRecord (Logger<V>& logger) : logger_(&logger) {}
+    KvRecord (KvRecord&& r) : logger_(r.logger_) { r.logger_ = NULL; }
+
+    ~KvRecord () {
+        if (logger_) {
+            logger_->commit_kv();
+        }
     }
-    static void add_stream(std::ostream& os) {
-        LoggerCtrl::get().os_.add_stream(os);
+
+    template <typename T>
+    KvRecord& kv (const char* key, const T& value) {
+        logger_->append_kv(key, value);
+        return *this;
     }
 };
 
 
 /**
- * A simple logging class
+ * A simple logging class.
+ *
+ * Every thread has its own instance of each Logger<V>, so a record is built
+ * without any locking and reaches the sinks as one complete line. The
+ * verbosity is checked by the LOG* macros, not here.
+ *
+ * A record ends at std::endl; a "\n" inside a statement is just part of
+ * the record, and the next statement continues it. A record that is still
+ * pending when its thread exits is committed then, with a newline added.
  */
 template <LogVerbosity V>
 class Logger
 {
 private:
-    OutStream& os_;
+    LineBuffer line_buf_;       ///< The record being built.
+    std::ostream line_os_;      ///< Formats into line_buf_.
     std::string& header_;
     LogVerbosity verbosity_;
     bool starts_new_line_;
 
-    FileString fs_;
+    const CallSite* call_site_;
+    uint64_t num_suppressed_;   ///< Reported at the start of the next record.
+    std::string kv_line_;       ///< The structured record being built.
+
+    friend class KvRecord<V>;
 
     // std::endl is a template function, and this is the signature of 
     // that function (For std::ostream).
     typedef std::ostream&(endl_type)(std::ostream&);
     // using endl_type = std::ostream&(std::ostream&); 
 
-    Logger<V> () : os_(LoggerCtrl::get_os()),
+    Logger<V> () : line_buf_(),
+                   line_os_(&line_buf_),
                    header_(LoggerCtrl::get_header()),
                    verbosity_(V), 
-                   starts_new_line_(true) {}
+                   starts_new_line_(true),
+                   call_site_(NULL),
+                   num_suppressed_(0) {}
     Logger (const Logger& l) = delete;
     Logger& operator= (const Logger& l) = delete;
 
+    ~Logger () {
+        std::string& line = line_buf_.get_line();
+        if (!line.empty()) {
+            if (line.back() != '\n') {
+                line.push_back('\n');
+            }
+            LoggerCtrl::commit(V, line);
+        }
+    }
+
+    /**
+     * @return Name of the verbosity in structured records.
+     */
+    static const char* get_verbosity_name () {
+        switch (V) {
+            case LogVerbosity::message: return "message";
+            case LogVerbosity::error:   return "error";
+            case LogVerbosity::warning: return "warning";
+            case LogVerbosity::info:    return "info";
+            case LogVerbosity::debug:   return "debug";
+            default:                    return "";
+        }
+    }
+
+    /**
+     * @return The tag written after the header of text records.
+     */
+    static const char* get_verbosity_tag () {
+        switch (V) {
+            case LogVerbosity::error:   return "(E) ";
+            case LogVerbosity::warning: return "(W) ";
+            case LogVerbosity::info:    return "(I) ";
+            case LogVerbosity::debug:   return "(D) ";
+            default:                    return "";
+        }
+    }
+
+    /**
+     * Open a JSON object with the fields the text header would carry.
+     */
+    void start_kv () {
+        kv_line_.clear();
+        kv_line_.append("{\"level\":\"");
+        kv_line_.append(get_verbosity_name());
+        kv_line_.push_back('"');
+
+        LogTimestamp ts = LoggerCtrl::get_timestamp();
+        if (ts != LogTimestamp::none) {
+            kv_line_.append(",\"time\":\"");
+            RecordPrefix::append_timestamp(kv_line_, ts);
+            kv_line_.back() = '"';
+        }
+        if (LoggerCtrl::shows_thread_id()) {
+            kv_line_.append(",\"tid\":");
+            RecordPrefix::append_uint(kv_line_, LogUtil::get_cached_thread_id());
+        }
+        if (V == LogVerbosity::debug && call_site_) {
+            kv_line_.append(",\"file\":");
+            JsonWriter::append_value(kv_line_, call_site_->file_name_);
+            kv_line_.append(",\"line\":");
+            RecordPrefix::append_uint(kv_line_, call_site_->line_num_);
+        }
+        if (num_suppressed_ > 0) {
+            kv_line_.append(",\"suppressed\":");
+            RecordPrefix::append_uint(kv_line_, num_suppressed_);
+            num_suppressed_ = 0;
+        }
+    }
+
+    template <typename T>
+    void append_kv (const char* key, const T& value) {
+        kv_line_.push_back(',');
+        JsonWriter::append_value(kv_line_, key);
+        kv_line_.push_back(':');
+        JsonWriter::append_value(kv_line_, value);
+    }
+
+    void commit_kv () {
+        kv_line_.append("}\n");
+        LoggerCtrl::commit(V, kv_line_);
+        kv_line_.clear();
+    }
+
 
 public:
     /**
-     * @return The logger instance.
+     * @return The logger instance of the calling thread.
      */
     static Logger<V>& get() {
-        static Logger<V> l;
+        static thread_local Logger<V> l;
         return l;
     }
 
     /**
-     * Pass the file name and the line number at which this logger is called.
+     * Pass the call site at which this logger is called.
      */
-    Logger<V>& set_file_string (FileString fs) {
-        fs_ = fs;
+    Logger<V>& set_call_site (const CallSite& cs) {
+        call_site_ = &cs;
         return *this;
     }
 
+    /**
+     * Start a structured record with its first key-value pair.
+     */
+    template <typename T>
+    KvRecord<V> kv (const char* key, const T& value) {
+        start_kv();
+        append_kv(key, value);
+        return KvRecord<V>(*this);
+    }
+
+    /**
+     * Commit a record reporting n records suppressed at the rate-limited
+     * statement at file_name:line_num. Builds the record in a buffer of
+     * its own, so it may be called while the calling thread is in the
+     * middle of a statement.
+     */
+    static void commit_suppressed (const char* file_name, uint32_t line_num,
+                                   uint64_t n) {
+        std::string line(LoggerCtrl::get_header());
+        LogTimestamp ts = LoggerCtrl::get_timestamp();
+        if (ts != LogTimestamp::none) {
+            RecordPrefix::append_timestamp(line, ts);
+        }
+        if (LoggerCtrl::shows_thread_id()) {
+            RecordPrefix::append_thread_id(line);
+        }
+        line.append(get_verbosity_tag());
+        line.append(file_name);
+        line.push_back(':');
+        RecordPrefix::append_uint(line, line_num);
+        line.append(" [suppressed ");
+        RecordPrefix::append_uint(line, n);
+        line.append(" messages]\n");
+        LoggerCtrl::commit(V, line);
+    }
+
+    /**
+     * Take the result of LogLimiter::rate.
+     * @return true if the statement should be logged.
+     */
+    bool admit (uint64_t n) {
+        if (n > 1) {
+            num_suppressed_ += n - 1;
+        }
+        return n != 0;
+    }
+
     /**
      * @return LogVerbosity string.
      */
     inline const std::string get_verbosity_string () {
-        switch (verbosity_) {
-            case LogVerbosity::message:
-                return "";
-            case LogVerbosity::error:
-                return "(E) ";
-            case LogVerbosity::warning:
-                return "(W) ";
-            case LogVerbosity::info:
-                return "(I) ";
-            case LogVerbosity::debug:
-                return "(D) ";
-            default:
-                return "";
-        }
+        return get_verbosity_tag();
     }
 
     /**
      * Deal with std::endl.
      */
     Logger<V>& operator<<(endl_type endl) {
-        if (static_cast<int>(V) > static_cast<int>(LoggerCtrl::get_max_verbosity())) {  
-            return *this;
-        }
+        line_os_ << endl;
 
-        starts_new_line_ = true;
-        os_ << endl;
+        // A complete line is handed to the sinks in one piece.
+        std::string& line = line_buf_.get_line();
+        if (!line.empty() && line.back() == '\n') {
+            LoggerCtrl::commit(V, line);
+            line.clear();
+            starts_new_line_ = true;
+        }
         return *this;
     }
 
     // For every other
     template<typename T>
     Logger<V>& operator<< (const T& data) {
-        if (static_cast<int>(V) > static_cast<int>(LoggerCtrl::get_max_verbosity())) {  
-            return *this;
-        }
-
         if( starts_new_line_ ) {
-            os_ << header_ << get_verbosity_string();
-            if (verbosity_ == LogVerbosity::debug) {
-                os_ << fs_ << " ";
+            line_os_ << header_;
+
+            std::string& line = line_buf_.get_line();
+            LogTimestamp ts = LoggerCtrl::get_timestamp();
+            if (ts != LogTimestamp::none) {
+                RecordPrefix::append_timestamp(line, ts);
+            }
+            if (LoggerCtrl::shows_thread_id()) {
+                RecordPrefix::append_thread_id(line);
+            }
+
+            line_os_ << get_verbosity_string();
+            if (verbosity_ == LogVerbosity::debug && call_site_) {
+                line_os_ << *call_site_ << " ";
+            }
+            if (num_suppressed_ > 0) {
+                line_os_ << "[suppressed " << num_suppressed_ << " messages] ";
+                num_suppressed_ = 0;
             }
         }
-        os_ << data;
+        line_os_ << data;
         starts_new_line_ = false;
 
         return *this;
     }
 };
 
+
+/**
+ * Turns a logging statement into a void expression, so that the
+ * MY_LOG_IF_ENABLED conditional has the same type in both branches.
+ * operator& binds looser than << and tighter than ?:.
+ */
+struct LogVoidify
+{
+    template <typename T>
+    void operator& (const T&) {}
+};
+
+
+/**
+ * Stands in for a Logger in statements compiled out by
+ * MY_LOG_MAX_VERBOSITY. It accepts the same operations and does nothing.
+ */
+struct NullLogger
+{
+    typedef std::ostream&(endl_type)(std::ostream&);
+
+    NullLogger& operator<< (endl_type) { return *this; }
+
+    template <typename T>
+    NullLogger& operator<< (const T&) { return *this; }
+
+    template <typename T>
+    NullLogger& kv (const char*, const T&) { return *this; }
+};
+
 }   // End of namespace my_log
 
 #endif 
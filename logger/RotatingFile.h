@@ -0,0 +1,261 @@
+/**
+ * @file    RotatingFile.h
+ * @author  Jinwook Jung (jinwookjungs@gmail.com)
+ * @date    2017-09-23 01:46:19
+ * @brief   A log file that rotates by size or time and writes through mmap.
+ */
+
+#ifndef ROTATING_FILE_H
+#define ROTATING_FILE_H
+
+#include <streambuf>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace my_log
+{
+
+/**
+ * A stream buffer that writes to path through a memory-mapped segment of
+ * the file.
+ *
+ * The file is extended one segment at a time and the segment is mapped, so
+ * a write is a memcpy into the page cache. Dirty pages are written back by
+ * the kernel; nothing here calls fsync. When the file reaches max_size
+ * bytes or interval has passed, it is renamed to path.1 (path.1 to path.2,
+ * and so on, keeping num_files old files) and a new file is started.
+ * Rotation only happens at the end of a line.
+ */
+class RotatingFileBuffer : public std::streambuf
+{
+private:
+    std::string path_;
+    size_t max_size_;
+    std::chrono::seconds interval_;
+    size_t num_files_;
+    size_t segment_size_;
+
+    int fd_;
+    char* segment_;                 ///< Mapped segment, or NULL.
+    size_t segment_offset_;         ///< File offset of the segment.
+    size_t size_;                   ///< Bytes written to the current file.
+    bool at_line_start_;
+    std::chrono::steady_clock::time_point rotate_time_;
+
+    RotatingFileBuffer (const RotatingFileBuffer& rfb) = delete;
+    RotatingFileBuffer& operator= (const RotatingFileBuffer& rfb) = delete;
+
+    void unmap_segment () {
+        if (segment_) {
+            munmap(segment_, segment_size_);
+            segment_ = NULL;
+        }
+        setp(NULL, NULL);
+    }
+
+    /**
+     * Grow the file by one segment at offset and map it. The blocks are
+     * allocated up front: a store into a sparse mapping that the file
+     * system cannot back kills the process with SIGBUS, so when the disk
+     * is full this fails and the record is dropped instead. Only file
+     * systems without fallocate support get a plain ftruncate.
+     */
+    bool map_segment (size_t offset) {
+        unmap_segment();
+
+        off_t end = static_cast<off_t>(offset + segment_size_);
+#if defined(__linux__)
+        int err = posix_fallocate(fd_, 0, end);
+        if (err == EOPNOTSUPP || err == EINVAL) {
+            err = (ftruncate(fd_, end) == 0) ? 0 : errno;
+        }
+        if (err != 0) {
+            return false;
+        }
+#else
+        if (ftruncate(fd_, end) != 0) {
+            return false;
+        }
+#endif
+        void* p = mmap(NULL, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd_, static_cast<off_t>(offset));
+        if (p == MAP_FAILED) {
+            return false;
+        }
+
+        segment_ = static_cast<char*>(p);
+        segment_offset_ = offset;
+        setp(segment_, segment_ + segment_size_);
+        return true;
+    }
+
+    /**
+     * Account for the bytes written to the put area since the last call.
+     */
+    void update_size () {
+        if (segment_) {
+            size_ = segment_offset_ + static_cast<size_t>(pptr() - segment_);
+        }
+    }
+
+    /**
+     * Unmap the segment and cut the preallocated tail off the file.
+     */
+    void close_file () {
+        if (fd_ < 0) {
+            return;
+        }
+        update_size();
+        unmap_segment();
+        if (ftruncate(fd_, static_cast<off_t>(size_)) != 0) {
+            // Nothing sensible to do; the tail stays zero-filled.
+        }
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    std::string get_old_path (size_t i) const {
+        return path_ + "." + std::to_string(i);
+    }
+
+    bool open_file () {
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            return false;
+        }
+        size_ = 0;
+        at_line_start_ = true;
+        rotate_time_ = std::chrono::steady_clock::now() + interval_;
+        return map_segment(0);
+    }
+
+    /**
+     * Shift the old files by one and start a new file.
+     */
+    bool rotate () {
+        close_file();
+
+        if (num_files_ == 0) {
+            std::remove(path_.c_str());
+        } else {
+            for (size_t i = num_files_; i > 1; i--) {
+                std::rename(get_old_path(i - 1).c_str(), get_old_path(i).c_str());
+            }
+            std::rename(path_.c_str(), get_old_path(1).c_str());
+        }
+        return open_file();
+    }
+
+    bool needs_rotation () const {
+        return size_ >= max_size_
+               || (interval_.count() > 0
+                   && std::chrono::steady_clock::now() >= rotate_time_);
+    }
+
+protected:
+    virtual int_type overflow (int_type c) {
+        if (fd_ < 0) {
+            return traits_type::eof();
+        }
+        update_size();
+        if (at_line_start_ && size_ >= max_size_ && !rotate()) {
+            return traits_type::eof();
+        }
+        if (pptr() == epptr() && !map_segment(segment_offset_ + segment_size_)) {
+            return traits_type::eof();
+        }
+        if (c != traits_type::eof()) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+            at_line_start_ = (c == '\n');
+        }
+        return traits_type::not_eof(c);
+    }
+
+    virtual std::streamsize xsputn (const char* s, std::streamsize n) {
+        if (fd_ < 0) {
+            return 0;
+        }
+        update_size();
+        if (at_line_start_ && size_ >= max_size_ && !rotate()) {
+            return 0;
+        }
+
+        std::streamsize written = 0;
+        while (written < n) {
+            if (pptr() == epptr() && !map_segment(segment_offset_ + segment_size_)) {
+                break;
+            }
+            std::streamsize len = std::min(n - written,
+                                           static_cast<std::streamsize>(epptr() - pptr()));
+            std::memcpy(pptr(), s + written, static_cast<size_t>(len));
+            pbump(static_cast<int>(len));
+            written += len;
+        }
+
+        if (written > 0) {
+            at_line_start_ = (s[written - 1] == '\n');
+        }
+        return written;
+    }
+
+    /**
+     * Check for rotation. Data is already in the page cache, so there is
+     * nothing to write.
+     */
+    virtual int sync () {
+        if (fd_ < 0) {
+            return -1;
+        }
+        update_size();
+        if (at_line_start_ && needs_rotation() && !rotate()) {
+            return -1;
+        }
+        return 0;
+    }
+
+public:
+    /**
+     * @param path          File to write to.
+     * @param max_size      Rotate when the file reaches this many bytes.
+     * @param interval      Rotate this often; zero disables time-based rotation.
+     * @param num_files     Number of old files to keep.
+     * @param segment_size  Bytes mapped at a time; a multiple of the page size.
+     */
+    RotatingFileBuffer (const std::string& path, size_t max_size,
+                        std::chrono::seconds interval = std::chrono::seconds(0),
+                        size_t num_files = 8, size_t segment_size = 1 << 22)
+        : path_(path), max_size_(max_size), interval_(interval),
+          num_files_(num_files), segment_size_(segment_size),
+          fd_(-1), segment_(NULL), segment_offset_(0), size_(0),
+          at_line_start_(true) {
+        size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        segment_size_ = (segment_size_ + page_size - 1) / page_size * page_size;
+
+        // Keep the output of a previous run.
+        struct stat st;
+        if (::stat(path_.c_str(), &st) == 0 && st.st_size > 0) {
+            rotate();
+        } else {
+            open_file();
+        }
+    }
+
+    ~RotatingFileBuffer () {
+        close_file();
+    }
+
+    bool is_open () const { return fd_ >= 0; }
+};
+
+}   // End of namespace my_log
+
+#endif
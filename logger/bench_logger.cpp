@@ -0,0 +1,303 @@
+/**
+ * @file    bench_logger.cpp
+ * @author  Jinwook Jung (jinwookjungs@gmail.com)
+ * @date    2017-09-23 01:46:19
+ * @brief   Throughput and latency benchmark for my_log::Logger.
+ *
+ * For every combination of write mode (sync, async), sink (null, file,
+ * non-blocking file, null+file+file, null+file limited to warnings),
+ * verbosity and thread count (1, 2, 4, ... up to the
+ * maximum), each thread logs a fixed number of records and the
+ * benchmark reports records/sec and the p50/p99/p99.9 latency of a single
+ * statement. The runtime max verbosity is info, so debug measures a
+ * disabled statement.
+ *
+ * Usage: bench_logger [-t max threads] [-n records per thread]
+ *                     [-f csv|json] [-d directory for the file sinks]
+ */
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <memory>
+#include <cstdio>
+#include "Logger.h"
+
+using namespace std;
+using my_log::LogVerbosity;
+using my_log::LoggerCtrl;
+
+/**
+ * A sink that discards everything.
+ */
+class NullBuffer : public streambuf
+{
+protected:
+    virtual int_type overflow (int_type c) { return traits_type::not_eof(c); }
+    virtual streamsize xsputn (const char*, streamsize n) { return n; }
+};
+
+
+struct Config
+{
+    size_t max_threads_;
+    size_t num_records_;
+    string format_;
+    string dir_;
+
+    Config () : max_threads_(thread::hardware_concurrency()),
+                num_records_(100000), format_("json"), dir_(".") {
+        if (max_threads_ == 0) {
+            max_threads_ = 1;
+        }
+    }
+};
+
+
+struct Result
+{
+    string mode_;
+    string sink_;
+    string verbosity_;
+    bool enabled_;
+    size_t num_threads_;
+    size_t num_records_;
+    double records_per_sec_;
+    double p50_ns_;
+    double p99_ns_;
+    double p999_ns_;
+};
+
+
+static const char* get_verbosity_name (LogVerbosity v)
+{
+    switch (v) {
+        case LogVerbosity::message: return "message";
+        case LogVerbosity::error:   return "error";
+        case LogVerbosity::warning: return "warning";
+        case LogVerbosity::info:    return "info";
+        case LogVerbosity::debug:   return "debug";
+        default:                    return "";
+    }
+}
+
+
+/**
+ * One statement of a typical shape: a literal, an integer and a double.
+ */
+static inline void log_record (LogVerbosity v, size_t i)
+{
+    switch (v) {
+        case LogVerbosity::message:
+            LOG << "benchmark record " << i << " value " << 0.125 * i << endl;
+            break;
+        case LogVerbosity::error:
+            LOGE << "benchmark record " << i << " value " << 0.125 * i << endl;
+            break;
+        case LogVerbosity::warning:
+            LOGW << "benchmark record " << i << " value " << 0.125 * i << endl;
+            break;
+        case LogVerbosity::info:
+            LOGI << "benchmark record " << i << " value " << 0.125 * i << endl;
+            break;
+        case LogVerbosity::debug:
+            LOGD << "benchmark record " << i << " value " << 0.125 * i << endl;
+            break;
+    }
+}
+
+
+static double get_percentile (const vector<uint32_t>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = static_cast<size_t>(p * (sorted.size() - 1));
+    return sorted[i];
+}
+
+
+/**
+ * Log num_records records from each of num_threads threads.
+ */
+static Result run (LogVerbosity v, size_t num_threads, size_t num_records)
+{
+    typedef chrono::steady_clock Clock;
+    vector<vector<uint32_t>> latencies(num_threads);
+    vector<thread> threads;
+
+    auto start = Clock::now();
+    for (size_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            vector<uint32_t>& lat = latencies[t];
+            lat.resize(num_records);
+            for (size_t i = 0; i < num_records; i++) {
+                auto s = Clock::now();
+                log_record(v, i);
+                auto e = Clock::now();
+                lat[i] = static_cast<uint32_t>(
+                    chrono::duration_cast<chrono::nanoseconds>(e - s).count());
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    LoggerCtrl::flush();
+    auto end = Clock::now();
+
+    vector<uint32_t> all;
+    all.reserve(num_threads * num_records);
+    for (auto& lat : latencies) {
+        all.insert(all.end(), lat.begin(), lat.end());
+    }
+    sort(all.begin(), all.end());
+
+    Result r;
+    r.verbosity_ = get_verbosity_name(v);
+    r.enabled_ = static_cast<int>(v) <= static_cast<int>(LoggerCtrl::get_max_verbosity());
+    r.num_threads_ = num_threads;
+    r.num_records_ = num_threads * num_records;
+    r.records_per_sec_ = r.num_records_ / chrono::duration<double>(end - start).count();
+    r.p50_ns_ = get_percentile(all, 0.5);
+    r.p99_ns_ = get_percentile(all, 0.99);
+    r.p999_ns_ = get_percentile(all, 0.999);
+    return r;
+}
+
+
+static void print_header (const Config& config)
+{
+    if (config.format_ == "csv") {
+        cout << "mode,sink,verbosity,enabled,threads,records,"
+             << "records_per_sec,p50_ns,p99_ns,p999_ns" << endl;
+    }
+}
+
+
+static void print_result (const Config& config, const Result& r)
+{
+    if (config.format_ == "csv") {
+        cout << r.mode_ << "," << r.sink_ << "," << r.verbosity_ << ","
+             << (r.enabled_ ? 1 : 0) << "," << r.num_threads_ << ","
+             << r.num_records_ << "," << r.records_per_sec_ << ","
+             << r.p50_ns_ << "," << r.p99_ns_ << "," << r.p999_ns_ << endl;
+    } else {
+        cout << "{\"mode\":\"" << r.mode_ << "\",\"sink\":\"" << r.sink_
+             << "\",\"verbosity\":\"" << r.verbosity_
+             << "\",\"enabled\":" << (r.enabled_ ? "true" : "false")
+             << ",\"threads\":" << r.num_threads_
+             << ",\"records\":" << r.num_records_
+             << ",\"records_per_sec\":" << r.records_per_sec_
+             << ",\"p50_ns\":" << r.p50_ns_
+             << ",\"p99_ns\":" << r.p99_ns_
+             << ",\"p999_ns\":" << r.p999_ns_ << "}" << endl;
+    }
+}
+
+
+static bool parse_args (int argc, char* argv[], Config& config)
+{
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        if (arg == "-t") {
+            config.max_threads_ = stoul(argv[++i]);
+        } else if (arg == "-n") {
+            config.num_records_ = stoul(argv[++i]);
+        } else if (arg == "-f") {
+            config.format_ = argv[++i];
+        } else if (arg == "-d") {
+            config.dir_ = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    return config.max_threads_ > 0
+           && (config.format_ == "csv" || config.format_ == "json");
+}
+
+
+int main (int argc, char* argv[])
+{
+    Config config;
+    if (!parse_args(argc, argv, config)) {
+        cerr << "Usage: " << argv[0] << " [-t max threads] [-n records per thread]"
+             << " [-f csv|json] [-d directory]" << endl;
+        return 1;
+    }
+
+    const LogVerbosity verbosities[] = {
+        LogVerbosity::message, LogVerbosity::error, LogVerbosity::warning,
+        LogVerbosity::info, LogVerbosity::debug
+    };
+    const string sinks[] = { "null", "file", "file_nb", "multi", "split" };
+    const string modes[] = { "sync", "async" };
+
+    vector<size_t> thread_counts;
+    for (size_t n = 1; n < config.max_threads_; n *= 2) {
+        thread_counts.push_back(n);
+    }
+    thread_counts.push_back(config.max_threads_);
+
+    string file_a = config.dir_ + "/bench_logger_a.txt";
+    string file_b = config.dir_ + "/bench_logger_b.txt";
+
+    LoggerCtrl::set_max_verbosity(LogVerbosity::info);
+    print_header(config);
+
+    for (const string& mode : modes) {
+        for (const string& sink : sinks) {
+            NullBuffer null_buf;
+            ostream null_os(&null_buf);
+            ofstream ofs_a, ofs_b;
+
+            LoggerCtrl::clear_streams();
+            if (sink == "null" || sink == "multi" || sink == "split") {
+                LoggerCtrl::add_stream(null_os);
+            }
+            if (sink == "file" || sink == "multi") {
+                ofs_a.open(file_a);
+                LoggerCtrl::add_stream(ofs_a);
+            }
+            if (sink == "file_nb") {
+                ofs_a.open(file_a);
+                LoggerCtrl::add_stream(ofs_a, LogVerbosity::debug,
+                                       my_log::SinkPolicy::non_blocking);
+            }
+            if (sink == "split") {
+                ofs_a.open(file_a);
+                LoggerCtrl::add_stream(ofs_a, LogVerbosity::warning);
+            }
+            if (sink == "multi") {
+                ofs_b.open(file_b);
+                LoggerCtrl::add_stream(ofs_b);
+            }
+            if (mode == "async") {
+                LoggerCtrl::enable_async();
+            }
+
+            for (LogVerbosity v : verbosities) {
+                for (size_t n : thread_counts) {
+                    Result r = run(v, n, config.num_records_);
+                    r.mode_ = mode;
+                    r.sink_ = sink;
+                    print_result(config, r);
+                }
+            }
+
+            LoggerCtrl::shutdown_async();
+            LoggerCtrl::clear_streams();
+        }
+    }
+
+    remove(file_a.c_str());
+    remove(file_b.c_str());
+    return 0;
+}
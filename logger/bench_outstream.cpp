@@ -0,0 +1,92 @@
+/**
+ * @file    bench_outstream.cpp
+ * @author  Jinwook Jung (jinwookjungs@gmail.com)
+ * @date    2017-09-23 01:46:19
+ * @brief   Measures the fan-out throughput of my_log::OutStream.
+ *
+ * Writes 200-byte records to 1, 2 and 4 sinks that discard the data and
+ * reports bytes/sec along with the number of calls each sink received
+ * per record.
+ */
+
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include "Logger.h"
+
+using namespace std;
+
+/**
+ * A sink that only counts what it receives.
+ */
+class NullBuffer : public streambuf
+{
+public:
+    uint64_t num_calls_;
+    uint64_t num_bytes_;
+
+    NullBuffer () : num_calls_(0), num_bytes_(0) {}
+
+protected:
+    virtual int_type overflow (int_type c) {
+        num_calls_++;
+        num_bytes_++;
+        return traits_type::not_eof(c);
+    }
+
+    virtual streamsize xsputn (const char*, streamsize n) {
+        num_calls_++;
+        num_bytes_ += n;
+        return n;
+    }
+};
+
+
+static void run (size_t num_sinks, size_t num_records, bool flush_each)
+{
+    const string record(199, 'x');
+
+    my_log::OutStream os;
+    vector<unique_ptr<NullBuffer>> bufs;
+    vector<unique_ptr<ostream>> sinks;
+    for (size_t i = 0; i < num_sinks; i++) {
+        bufs.emplace_back(new NullBuffer());
+        sinks.emplace_back(new ostream(bufs.back().get()));
+        os.add_stream(*sinks.back());
+    }
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < num_records; i++) {
+        os.write(record.data(), record.size());
+        os.put('\n');
+        if (flush_each) {
+            os.flush();
+        }
+    }
+    os.flush();
+    auto end = chrono::steady_clock::now();
+
+    double sec = chrono::duration<double>(end - start).count();
+    double bytes = static_cast<double>(num_records) * (record.size() + 1);
+
+    cout << "sinks=" << num_sinks
+         << " flush=" << (flush_each ? "record" : "end")
+         << " bytes/sec=" << bytes / sec
+         << " calls/record/sink="
+         << static_cast<double>(bufs[0]->num_calls_) / num_records
+         << endl;
+}
+
+
+int main (int argc, char* argv[])
+{
+    size_t num_records = (argc > 1) ? stoul(argv[1]) : 1000000;
+
+    for (size_t num_sinks : { 1, 2, 4 }) {
+        run(num_sinks, num_records, true);
+        run(num_sinks, num_records, false);
+    }
+    return 0;
+}
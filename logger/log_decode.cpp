@@ -0,0 +1,259 @@
+/**
+ * @file    log_decode.cpp
+ * @author  Jinwook Jung (jinwookjungs@gmail.com)
+ * @date    2017-09-23 01:46:19
+ * @brief   Turns a binary log written by my_log::BinaryLog into text.
+ *
+ * Usage: log_decode <binary log> [output]
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cstdint>
+#include "BinaryLog.h"
+
+using namespace std;
+
+/**
+ * A call site definition read from the log.
+ */
+struct Site
+{
+    my_log::LogVerbosity verbosity_;
+    uint32_t line_num_;
+    string file_name_;
+    string format_;
+    string tags_;
+};
+
+
+/**
+ * Reads fixed-size values and strings from a binary log. A string longer
+ * than the rest of the log is a read error, so a corrupted length never
+ * turns into a huge allocation.
+ */
+class Reader
+{
+private:
+    istream& is_;
+    streamoff end_;     ///< Size of the log.
+
+public:
+    Reader (istream& is) : is_(is), end_(0) {
+        streampos pos = is_.tellg();
+        is_.seekg(0, ios::end);
+        end_ = is_.tellg();
+        is_.seekg(pos);
+    }
+
+    template <typename T>
+    bool read (T& v) {
+        return static_cast<bool>(is_.read(reinterpret_cast<char*>(&v), sizeof(v)));
+    }
+
+    bool read (string& s, size_t len) {
+        streamoff pos = is_.tellg();
+        if (pos < 0 || static_cast<uint64_t>(end_ - pos) < len) {
+            return false;
+        }
+        s.resize(len);
+        return len == 0 || static_cast<bool>(is_.read(&s[0], len));
+    }
+};
+
+
+static const char* get_verbosity_string (my_log::LogVerbosity v)
+{
+    switch (v) {
+        case my_log::LogVerbosity::error:
+            return "(E) ";
+        case my_log::LogVerbosity::warning:
+            return "(W) ";
+        case my_log::LogVerbosity::info:
+            return "(I) ";
+        case my_log::LogVerbosity::debug:
+            return "(D) ";
+        default:
+            return "";
+    }
+}
+
+
+/**
+ * Read one argument of the given type and print it.
+ */
+static bool decode_arg (Reader& reader, char tag, ostream& os)
+{
+    switch (tag) {
+        case 'i': {
+            int64_t v;
+            if (!reader.read(v)) return false;
+            os << v;
+            return true;
+        }
+        case 'u': {
+            uint64_t v;
+            if (!reader.read(v)) return false;
+            os << v;
+            return true;
+        }
+        case 'd': {
+            double v;
+            if (!reader.read(v)) return false;
+            os << v;
+            return true;
+        }
+        case 'c': {
+            char v;
+            if (!reader.read(v)) return false;
+            os << v;
+            return true;
+        }
+        case 'b': {
+            char v;
+            if (!reader.read(v)) return false;
+            os << (v ? "true" : "false");
+            return true;
+        }
+        case 's': {
+            uint32_t len;
+            string v;
+            if (!reader.read(len) || !reader.read(v, len)) return false;
+            os << v;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+
+/**
+ * Print one record: the format string with each "{}" replaced by the next
+ * argument. Arguments without a placeholder are appended.
+ */
+static bool decode_record (Reader& reader, const string& header,
+                           const Site& site, ostream& os)
+{
+    os << header << get_verbosity_string(site.verbosity_);
+    if (site.verbosity_ == my_log::LogVerbosity::debug) {
+        os << site.file_name_ << ":" << site.line_num_ << " ";
+    }
+
+    size_t arg = 0;
+    const string& format = site.format_;
+    for (size_t i = 0; i < format.size(); i++) {
+        if (format[i] == '{' && i + 1 < format.size() && format[i+1] == '}'
+            && arg < site.tags_.size()) {
+            if (!decode_arg(reader, site.tags_[arg++], os)) {
+                return false;
+            }
+            i++;
+        } else {
+            os << format[i];
+        }
+    }
+    for (; arg < site.tags_.size(); arg++) {
+        os << " ";
+        if (!decode_arg(reader, site.tags_[arg], os)) {
+            return false;
+        }
+    }
+    os << "\n";
+    return true;
+}
+
+
+static bool read_site (Reader& reader, map<uint32_t, Site>& sites)
+{
+    uint32_t id;
+    uint8_t verbosity;
+    uint16_t file_len, format_len;
+    uint8_t num_args;
+    Site site;
+
+    if (!reader.read(id) || !reader.read(verbosity)
+        || !reader.read(site.line_num_)
+        || !reader.read(file_len) || !reader.read(site.file_name_, file_len)
+        || !reader.read(format_len) || !reader.read(site.format_, format_len)
+        || !reader.read(num_args) || !reader.read(site.tags_, num_args)) {
+        return false;
+    }
+    site.verbosity_ = static_cast<my_log::LogVerbosity>(verbosity);
+    sites[id] = site;
+    return true;
+}
+
+
+int main (int argc, char* argv[])
+{
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <binary log> [output]" << endl;
+        return 1;
+    }
+
+    ifstream ifs(argv[1], ios::binary);
+    if (!ifs) {
+        cerr << "Cannot open " << argv[1] << endl;
+        return 1;
+    }
+
+    ofstream ofs;
+    if (argc > 2) {
+        ofs.open(argv[2]);
+        if (!ofs) {
+            cerr << "Cannot open " << argv[2] << endl;
+            return 1;
+        }
+    }
+    ostream& os = (argc > 2) ? ofs : cout;
+
+    Reader reader(ifs);
+    char magic[sizeof(my_log::binary_log_magic)];
+    uint32_t version, header_len;
+    string header;
+
+    if (!reader.read(magic)
+        || memcmp(magic, my_log::binary_log_magic, sizeof(magic)) != 0
+        || !reader.read(version) || version != my_log::binary_log_version
+        || !reader.read(header_len) || !reader.read(header, header_len)) {
+        cerr << argv[1] << " is not a binary log" << endl;
+        return 1;
+    }
+
+    map<uint32_t, Site> sites;
+    char tag;
+
+    while (reader.read(tag)) {
+        if (tag == my_log::binary_log_site_tag) {
+            if (!read_site(reader, sites)) {
+                cerr << "Truncated site definition" << endl;
+                return 1;
+            }
+        } else if (tag == my_log::binary_log_record_tag) {
+            uint32_t id;
+            if (!reader.read(id)) {
+                cerr << "Truncated record" << endl;
+                return 1;
+            }
+            auto it = sites.find(id);
+            if (it == sites.end()) {
+                cerr << "Unknown call site " << id << endl;
+                return 1;
+            }
+            if (!decode_record(reader, header, it->second, os)) {
+                cerr << "Truncated record" << endl;
+                return 1;
+            }
+        } else {
+            cerr << "Corrupted log" << endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
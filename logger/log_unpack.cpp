@@ -0,0 +1,130 @@
+/**
+ * @file    log_unpack.cpp
+ * @author  Jinwook Jung (jinwookjungs@gmail.com)
+ * @date    2017-09-23 01:46:19
+ * @brief   Turns a log written by my_log::CompressedFileBuffer into text.
+ *
+ * Blocks that fail their checksum, have an implausible header or run past
+ * the end of the file are reported and skipped, and the reader resyncs at
+ * the next block magic, so one bad block only loses its own records.
+ *
+ * Usage: log_unpack <compressed log> [output]
+ */
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include "CompressedFile.h"
+
+using namespace std;
+
+static uint32_t read_u32 (const char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+/**
+ * @return Position of the next block magic at or after pos, or npos.
+ */
+static size_t find_block (const string& data, size_t pos)
+{
+    return data.find(string(my_log::compressed_block_magic,
+                            sizeof(my_log::compressed_block_magic)), pos);
+}
+
+
+int main (int argc, char* argv[])
+{
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <compressed log> [output]" << endl;
+        return 1;
+    }
+
+    ifstream ifs(argv[1], ios::binary);
+    if (!ifs) {
+        cerr << "Cannot open " << argv[1] << endl;
+        return 1;
+    }
+    string data((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+
+    ofstream ofs;
+    if (argc > 2) {
+        ofs.open(argv[2], ios::binary);
+        if (!ofs) {
+            cerr << "Cannot open " << argv[2] << endl;
+            return 1;
+        }
+    }
+    ostream& os = (argc > 2) ? ofs : cout;
+
+    const size_t header_size = sizeof(my_log::compressed_log_magic) + 4;
+    if (data.size() < header_size
+        || memcmp(data.data(), my_log::compressed_log_magic,
+                  sizeof(my_log::compressed_log_magic)) != 0
+        || read_u32(&data[sizeof(my_log::compressed_log_magic)])
+           != my_log::compressed_log_version) {
+        cerr << argv[1] << " is not a compressed log" << endl;
+        return 1;
+    }
+
+    size_t pos = header_size;
+    size_t num_bad = 0;
+    vector<char> raw;
+
+    while (pos < data.size()) {
+        const char* h = &data[pos];
+        size_t begin = pos + my_log::compressed_block_header_size;
+        bool truncated = begin > data.size();
+        bool ok = !truncated
+                  && memcmp(h, my_log::compressed_block_magic,
+                            sizeof(my_log::compressed_block_magic)) == 0;
+
+        my_log::BlockCodec codec = my_log::BlockCodec::raw;
+        uint32_t raw_size = 0;
+        uint32_t data_size = 0;
+        uint32_t checksum = 0;
+        if (ok) {
+            codec = static_cast<my_log::BlockCodec>(h[4]);
+            raw_size = read_u32(h + 5);
+            data_size = read_u32(h + 9);
+            checksum = read_u32(h + 13);
+
+            // The writer never makes a block larger than the limit, and
+            // stores it raw when compression does not pay off.
+            ok = raw_size <= my_log::compressed_max_block_size
+                 && data_size <= raw_size;
+        }
+        if (ok && data_size > data.size() - begin) {
+            ok = false;
+            truncated = true;
+        }
+        if (ok) {
+            raw.resize(raw_size);
+            ok = my_log::BlockCompressor::decompress(codec, &data[begin], data_size,
+                                                     raw.data(), raw_size)
+                 && my_log::BlockCompressor::get_checksum(raw.data(), raw_size)
+                    == checksum;
+        }
+
+        if (!ok) {
+            cerr << (truncated ? "Skipping truncated block at offset "
+                               : "Skipping corrupted block at offset ")
+                 << pos << endl;
+            num_bad++;
+            pos = find_block(data, pos + 1);
+            continue;
+        }
+
+        os.write(raw.data(), raw_size);
+        pos = begin + data_size;
+    }
+
+    return num_bad == 0 ? 0 : 1;
+}
@@ -9,6 +9,7 @@
 #include <iostream>
 #include <string>
 #include "Logger.h"
+#include "BinaryLog.h"
 
 using namespace std;
 
@@ -20,6 +21,14 @@ int main (void)
 
     my_log::LoggerCtrl::add_stream(ofs);
 
+    // Errors only, written by a thread of its own. The logger owns the
+    // file, so it is drained and closed at exit.
+    my_log::LoggerCtrl::add_file("Test_err.txt", my_log::LogVerbosity::error,
+                                 my_log::SinkPolicy::non_blocking);
+
+    // Read back with "./log_unpack Test.logz".
+    my_log::LoggerCtrl::add_compressed_file("Test.logz");
+
     LOG << "HAHAHA" << endl;
     LOGE << "HAHAHA" << endl;
     LOGW << "HAHAHA" << endl;
@@ -34,4 +43,20 @@ int main (void)
     LOGW << "HAHAHA" << endl;
     LOGI << "HAHAHA" << endl;
     LOGD << "HAHAHA" << endl;
+
+    // Records are written by a background thread from here on.
+    my_log::LoggerCtrl::enable_async(1024, my_log::OverflowPolicy::block);
+
+    LOGE << "ASYNC" << endl;
+    LOGW << "ASYNC" << endl;
+
+    // ofs goes away at the end of main, so drain the queue first.
+    my_log::LoggerCtrl::shutdown_async();
+
+    // Decode with "./log_decode Test.bin".
+    my_log::BinaryLog::open("Test.bin");
+    LOGBE("HAHAHA {} {}", 1, 2.5);
+    LOGBW("HAHAHA {}", string("BINARY"));
+    LOGBD("HAHAHA {}", "BINARY");
+    my_log::BinaryLog::close();
 }
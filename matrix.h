@@ -11,27 +11,367 @@
 
 #include <vector>
 #include <exception>
+#include <stdexcept>
 #include <memory>
 #include <iostream>
+#include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include "gemm.h"
+#include "allocator.h"
+
+template <typename T, typename Alloc = AlignedAllocator<T>> class Matrix;
+template <typename T> class MatrixView;
+
+namespace matrix_kernel
+{
 
 /**
- * A simple matrix class.
+ * The memory an operand occupies and how it maps elements to it.
+ *
+ * Evaluating an expression into a destination element by element is safe
+ * as long as no operand overlaps the destination with a different mapping,
+ * e.g. a shifted block or the transpose of the destination. Strides are
+ * in elements and must not be negative.
+ */
+struct Extent
+{
+    uintptr_t data;                 ///< Address of element (0, 0).
+    uintptr_t begin;                ///< Lowest address used.
+    uintptr_t end;                  ///< One past the highest address used.
+    ptrdiff_t row_stride;
+    ptrdiff_t col_stride;
+
+    template <typename T>
+    static Extent make (const T* data, size_t num_rows, size_t num_cols,
+                        ptrdiff_t row_stride, ptrdiff_t col_stride) {
+        uintptr_t p = reinterpret_cast<uintptr_t>(data);
+        Extent e = { p, p, p, row_stride, col_stride };
+        if (num_rows > 0 && num_cols > 0) {
+            e.end = reinterpret_cast<uintptr_t>(data + (num_rows - 1)*row_stride
+                                                + (num_cols - 1)*col_stride + 1);
+        }
+        return e;
+    }
+
+    bool conflicts (const Extent& e) const {
+        return begin < e.end && e.begin < end
+               && (data != e.data || row_stride != e.row_stride 
+                   || col_stride != e.col_stride);
+    }
+};
+
+}   // End of namespace matrix_kernel
+
+
+/**
+ * Base of Matrix, MatrixView and the lazy expressions built by the
+ * element-wise free operators (CRTP). An expression E provides:
+ *
+ * - value_type, get_num_rows() and get_num_cols();
+ * - eval(i, row, col), the element at (row, col), which is element i in
+ *   row-major order; each operand uses whichever index suits its storage;
+ * - conflicts(extent), whether an operand overlaps the given destination
+ *   with a different mapping (see matrix_kernel::Extent).
+ *
+ * Nothing is computed until the expression is assigned to a Matrix or a
+ * view; then the whole expression is evaluated in one pass, so
+ * A + B - 2.0*C reads each operand once and allocates nothing but the
+ * result.
+ *
+ * An expression refers to its Matrix and view operands, so it must not
+ * outlive them; a temporary Matrix operand, such as a product, is kept
+ * alive by the expression (see MatrixTemporary), so
+ * auto e = A*B + C; is safe as long as A, B and C are.
+ */
+template <typename E>
+class MatrixExpr
+{
+public:
+    const E& self () const { return static_cast<const E&>(*this); }
+};
+
+
+/**
+ * How an expression holds an operand: matrices by reference, expressions
+ * (which are small) and views by value. The element-wise operators wrap
+ * a temporary Matrix in a MatrixTemporary, which is held by value too.
+ */
+template <typename E> struct MatrixOperand { typedef const E type; };
+template <typename T, typename A> struct MatrixOperand<Matrix<T, A>> { typedef const Matrix<T, A>& type; };
+
+
+/**
+ * A temporary matrix operand of an element-wise expression, moved into
+ * shared storage. Copies of the expression share it, so nesting the
+ * expression into a larger one does not copy the elements.
+ */
+template <typename M>
+class MatrixTemporary : public MatrixExpr<MatrixTemporary<M>>
+{
+public:
+    typedef typename M::value_type value_type;
+
+    explicit MatrixTemporary (M&& m) : matrix_(std::make_shared<const M>(std::move(m))) {}
+
+    size_t get_num_rows () const { return matrix_->get_num_rows(); }
+    size_t get_num_cols () const { return matrix_->get_num_cols(); }
+    value_type eval (size_t i, size_t row, size_t col) const {
+        return matrix_->eval(i, row, col);
+    }
+    bool conflicts (const matrix_kernel::Extent& e) const {
+        return matrix_->conflicts(e);
+    }
+
+private:
+    std::shared_ptr<const M> matrix_;
+};
+
+struct MatrixAssign { template <typename T> static T apply (const T&, const T& b) { return b; } };
+struct MatrixAdd { template <typename T> static T apply (const T& a, const T& b) { return a + b; } };
+struct MatrixSub { template <typename T> static T apply (const T& a, const T& b) { return a - b; } };
+struct MatrixMul { template <typename T> static T apply (const T& a, const T& b) { return a * b; } };
+
+
+/**
+ * Element-wise Op of two expressions of the same shape.
+ */
+template <typename L, typename R, typename Op>
+class MatrixBinaryExpr : public MatrixExpr<MatrixBinaryExpr<L, R, Op>>
+{
+public:
+    typedef typename L::value_type value_type;
+
+    static_assert(std::is_same<typename L::value_type,
+                               typename R::value_type>::value,
+                  "operands of different value types");
+
+    MatrixBinaryExpr (const L& lhs, const R& rhs) : lhs_(lhs), rhs_(rhs) {
+        if (lhs.get_num_rows() != rhs.get_num_rows()
+            || lhs.get_num_cols() != rhs.get_num_cols()) {
+            throw std::logic_error ("different size");
+        }
+    }
+
+    size_t get_num_rows () const { return lhs_.get_num_rows(); }
+    size_t get_num_cols () const { return lhs_.get_num_cols(); }
+    value_type eval (size_t i, size_t row, size_t col) const {
+        return Op::apply(lhs_.eval(i, row, col), rhs_.eval(i, row, col));
+    }
+    bool conflicts (const matrix_kernel::Extent& e) const {
+        return lhs_.conflicts(e) || rhs_.conflicts(e);
+    }
+
+private:
+    typename MatrixOperand<L>::type lhs_;
+    typename MatrixOperand<R>::type rhs_;
+};
+
+
+/**
+ * Op of an expression and a scalar, with the scalar on the left if
+ * ScalarFirst is set.
+ */
+template <typename E, typename Op, bool ScalarFirst>
+class MatrixScalarExpr : public MatrixExpr<MatrixScalarExpr<E, Op, ScalarFirst>>
+{
+public:
+    typedef typename E::value_type value_type;
+
+    MatrixScalarExpr (const E& expr, const value_type& scalar)
+        : expr_(expr), scalar_(scalar) {}
+
+    size_t get_num_rows () const { return expr_.get_num_rows(); }
+    size_t get_num_cols () const { return expr_.get_num_cols(); }
+    value_type eval (size_t i, size_t row, size_t col) const {
+        return ScalarFirst ? Op::apply(scalar_, expr_.eval(i, row, col))
+                           : Op::apply(expr_.eval(i, row, col), scalar_);
+    }
+    bool conflicts (const matrix_kernel::Extent& e) const {
+        return expr_.conflicts(e);
+    }
+
+private:
+    typename MatrixOperand<E>::type expr_;
+    value_type scalar_;
+};
+
+
+/**
+ * A non-owning window on the elements of a matrix: element (row, col) is
+ * data()[row*get_row_stride() + col*get_col_stride()].
+ *
+ * Blocks, row and column ranges and the transpose of a view are views of
+ * the same elements, taken in O(1). Views take part in expressions and
+ * products like matrices, and assigning to a view of non-const elements
+ * (including the copy assignment) writes through to the viewed elements.
+ * A view must not outlive the storage it views.
  */
 template <typename T>
-class Matrix
+class MatrixView : public MatrixExpr<MatrixView<T>>
+{
+public:
+    typedef typename std::remove_const<T>::type value_type;
+
+    MatrixView (T* data, size_t num_rows, size_t num_cols, 
+                ptrdiff_t row_stride, ptrdiff_t col_stride);
+    MatrixView (const MatrixView& v) = default;
+
+    /**
+     * A view of non-const elements converts to a view of const ones.
+     */
+    template <typename U, typename = typename std::enable_if<
+                              std::is_convertible<U*, T*>::value>::type>
+    MatrixView (const MatrixView<U>& v)
+        : data_(v.data()), num_rows_(v.get_num_rows()), num_cols_(v.get_num_cols()),
+          row_stride_(v.get_row_stride()), col_stride_(v.get_col_stride()) {}
+
+    /**
+     * Assign to the viewed elements; the shapes must match.
+     */
+    MatrixView& operator= (const MatrixView& rhs);
+    template <typename E> MatrixView& operator= (const MatrixExpr<E>& expr);
+
+    size_t get_num_rows () const { return num_rows_; }
+    size_t get_num_cols () const { return num_cols_; }
+    ptrdiff_t get_row_stride () const { return row_stride_; }
+    ptrdiff_t get_col_stride () const { return col_stride_; }
+    T* data () const { return data_; }
+    T& operator() (size_t row, size_t col) const { 
+        return data_[row*row_stride_ + col*col_stride_]; 
+    }
+
+    /**
+     * The expression interface.
+     */
+    value_type eval (size_t, size_t row, size_t col) const { return (*this)(row, col); }
+    bool conflicts (const matrix_kernel::Extent& e) const { return get_extent().conflicts(e); }
+
+    /**
+     * num_rows x num_cols elements starting at (row, col). Throws
+     * std::out_of_range if they do not all lie in this view.
+     */
+    MatrixView block (size_t row, size_t col, size_t num_rows, size_t num_cols) const;
+    MatrixView rows (size_t begin, size_t end) const { return block(begin, 0, end - begin, num_cols_); }
+    MatrixView cols (size_t begin, size_t end) const { return block(0, begin, num_rows_, end - begin); }
+    MatrixView transpose () const { 
+        return MatrixView(data_, num_cols_, num_rows_, col_stride_, row_stride_); 
+    }
+    MatrixView<const T> view () const { return *this; }
+
+    template <typename E> MatrixView& operator+= (const MatrixExpr<E>& rhs);
+    template <typename E> MatrixView& operator-= (const MatrixExpr<E>& rhs);
+    MatrixView& operator+= (const value_type& rhs);
+    MatrixView& operator-= (const value_type& rhs);
+    MatrixView& operator*= (const value_type& rhs);
+
+private:
+    /// Elements per thread below which element-wise ops stay on one thread.
+    static const size_t elementwise_grain = 1 << 15;
+
+    T* data_;                       ///< Element (0, 0).
+    size_t num_rows_;               ///< Number of rows.
+    size_t num_cols_;               ///< Number of columns.
+    ptrdiff_t row_stride_;          ///< Elements between rows.
+    ptrdiff_t col_stride_;          ///< Elements between columns.
+
+    matrix_kernel::Extent get_extent () const {
+        return matrix_kernel::Extent::make(data_, num_rows_, num_cols_, 
+                                           row_stride_, col_stride_);
+    }
+
+    /**
+     * Call f(element, i, row, col) for every element, i being its
+     * row-major index.
+     */
+    template <typename F> void for_each (F f) const;
+
+    /**
+     * x = Op::apply(x, expr.eval(...)) for every element x. An expression
+     * that conflicts with this view is evaluated into a temporary first.
+     */
+    template <typename Op, typename E> void apply (const E& expr) const;
+};
+
+
+/**
+ * A simple matrix class.
+ *
+ * Products and element-wise operations run on the threads of
+ * matrix_kernel::ThreadPool; see matrix_kernel::set_num_threads(). Results
+ * do not depend on the number of threads.
+ *
+ * Alloc provides the element storage: AlignedAllocator (the default),
+ * HugePageAllocator for large matrices, or PoolAllocator to recycle the
+ * buffers of temporaries. See allocator.h.
+ */
+template <typename T, typename Alloc>
+class Matrix : public MatrixExpr<Matrix<T, Alloc>>
 {
 public:
+    typedef T value_type;
+    typedef Alloc allocator_type;
+
     Matrix (size_t num_rows, size_t num_cols, const T value=0);
-    Matrix (const Matrix& m) = default;
+    Matrix (const Matrix& m);
     Matrix& operator= (const Matrix& rhs) = default;
     Matrix (Matrix&& m);
     Matrix& operator= (Matrix&& rhs);
 
+    /**
+     * Evaluate an element-wise expression of the same value type in one
+     * pass.
+     */
+    template <typename E, typename = typename std::enable_if<
+                              std::is_same<typename E::value_type, T>::value>::type>
+    Matrix (const MatrixExpr<E>& expr);
+    template <typename E> Matrix& operator= (const MatrixExpr<E>& expr);
+
+    /**
+     * A matrix whose elements are left uninitialized (for allocators that
+     * default-initialize, as the ones in allocator.h do), to be overwritten.
+     */
+    static Matrix uninitialized (size_t num_rows, size_t num_cols);
+
     size_t get_num_rows () const;
     size_t get_num_cols () const;
     const T operator () (size_t row, size_t col) const;
     T& operator() (size_t row, size_t col);
 
+    /**
+     * Elements in row-major order.
+     */
+    T* data ();
+    const T* data () const;
+
+    /**
+     * The expression interface.
+     */
+    T eval (size_t i, size_t, size_t) const { return values_[i]; }
+    bool conflicts (const matrix_kernel::Extent& e) const { return get_extent().conflicts(e); }
+
+    /**
+     * Views of the elements; see MatrixView. They are invalidated by
+     * anything that reallocates this matrix, such as assigning a matrix
+     * of another shape.
+     */
+    MatrixView<T> view () { return MatrixView<T>(data(), num_rows_, num_cols_, num_cols_, 1); }
+    MatrixView<const T> view () const { 
+        return MatrixView<const T>(data(), num_rows_, num_cols_, num_cols_, 1); 
+    }
+    MatrixView<T> block (size_t row, size_t col, size_t num_rows, size_t num_cols) {
+        return view().block(row, col, num_rows, num_cols);
+    }
+    MatrixView<const T> block (size_t row, size_t col, size_t num_rows, size_t num_cols) const {
+        return view().block(row, col, num_rows, num_cols);
+    }
+    MatrixView<T> rows (size_t begin, size_t end) { return view().rows(begin, end); }
+    MatrixView<const T> rows (size_t begin, size_t end) const { return view().rows(begin, end); }
+    MatrixView<T> cols (size_t begin, size_t end) { return view().cols(begin, end); }
+    MatrixView<const T> cols (size_t begin, size_t end) const { return view().cols(begin, end); }
+    MatrixView<T> transpose () { return view().transpose(); }
+    MatrixView<const T> transpose () const { return view().transpose(); }
+
     Matrix& operator+= (const T& rhs);
     Matrix& operator-= (const T& rhs);
     Matrix& operator*= (const T& rhs);
@@ -40,47 +380,118 @@ public:
     Matrix& operator-= (const Matrix& rhs);
     Matrix& operator*= (const Matrix& rhs);
 
+    template <typename E> Matrix& operator+= (const MatrixExpr<E>& rhs);
+    template <typename E> Matrix& operator-= (const MatrixExpr<E>& rhs);
+
 private:
-    size_t num_rows_;           ///< Number of rows.
-    size_t num_cols_;           ///< Number of columns.
-    std::vector<T> values_;     ///< Element values.
-};
+    /// Elements per thread below which element-wise ops stay on one thread.
+    static const size_t elementwise_grain = 1 << 15;
 
-template <typename T> bool operator== (const Matrix<T>& lhs, 
-                                       const Matrix<T>& rhs);
-template <typename T> bool operator!= (const Matrix<T>& lhs, 
-                                       const Matrix<T>& rhs);
+    size_t num_rows_;               ///< Number of rows.
+    size_t num_cols_;               ///< Number of columns.
+    std::vector<T, Alloc> values_;  ///< Element values.
 
-template <typename T> Matrix<T> operator+ (const T& lhs, const Matrix<T>& rhs);
-template <typename T> Matrix<T> operator- (const T& lhs, const Matrix<T>& rhs);
-template <typename T> Matrix<T> operator* (const T& lhs, const Matrix<T>& rhs);
-template <typename T> Matrix<T> operator+ (const Matrix<T>& lhs, const T& rhs);
-template <typename T> Matrix<T> operator- (const Matrix<T>& lhs, const T& rhs);
-template <typename T> Matrix<T> operator* (const Matrix<T>& lhs, const T& rhs);
+    matrix_kernel::Extent get_extent () const {
+        return matrix_kernel::Extent::make(data(), num_rows_, num_cols_, num_cols_, 1);
+    }
 
-template <typename T> Matrix<T> operator+ (const Matrix<T>& lhs, 
-                                           const Matrix<T>& rhs);
-template <typename T> Matrix<T> operator- (const Matrix<T>& lhs, 
-                                           const Matrix<T>& rhs);
-template <typename T> Matrix<T> operator* (const Matrix<T>& lhs, 
-                                           const Matrix<T>& rhs);
+    /**
+     * values_[i] = Op::apply(values_[i], expr.eval(i, row, col)) for every
+     * element. The expression must not conflict with this matrix.
+     */
+    template <typename Op, typename E> void apply (const E& expr);
+};
 
-template <typename T> std::ostream& operator<< (std::ostream& os, 
-                                                const Matrix<T>& matrix);
+template <typename T, typename A> bool operator== (const Matrix<T, A>& lhs, 
+                                                   const Matrix<T, A>& rhs);
+template <typename T, typename A> bool operator!= (const Matrix<T, A>& lhs, 
+                                                   const Matrix<T, A>& rhs);
+
+template <typename L, typename R> MatrixBinaryExpr<L, R, MatrixAdd> 
+operator+ (const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs);
+template <typename L, typename R> MatrixBinaryExpr<L, R, MatrixSub> 
+operator- (const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs);
+
+// The scalar type is taken from the matrix, so 2*A works for Matrix<double>.
+template <typename E> MatrixScalarExpr<E, MatrixAdd, true> 
+operator+ (const typename E::value_type& lhs, const MatrixExpr<E>& rhs);
+template <typename E> MatrixScalarExpr<E, MatrixSub, true> 
+operator- (const typename E::value_type& lhs, const MatrixExpr<E>& rhs);
+template <typename E> MatrixScalarExpr<E, MatrixMul, true> 
+operator* (const typename E::value_type& lhs, const MatrixExpr<E>& rhs);
+template <typename E> MatrixScalarExpr<E, MatrixAdd, false> 
+operator+ (const MatrixExpr<E>& lhs, const typename E::value_type& rhs);
+template <typename E> MatrixScalarExpr<E, MatrixSub, false> 
+operator- (const MatrixExpr<E>& lhs, const typename E::value_type& rhs);
+template <typename E> MatrixScalarExpr<E, MatrixMul, false> 
+operator* (const MatrixExpr<E>& lhs, const typename E::value_type& rhs);
+
+// A temporary Matrix operand, e.g. the product in A*B + C, is moved into
+// the expression so that the expression can outlive the statement.
+template <typename T, typename A, typename R> 
+MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, R, MatrixAdd> 
+operator+ (Matrix<T, A>&& lhs, const MatrixExpr<R>& rhs);
+template <typename L, typename T, typename A> 
+MatrixBinaryExpr<L, MatrixTemporary<Matrix<T, A>>, MatrixAdd> 
+operator+ (const MatrixExpr<L>& lhs, Matrix<T, A>&& rhs);
+template <typename T, typename A, typename B> 
+MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, MatrixTemporary<Matrix<T, B>>, MatrixAdd> 
+operator+ (Matrix<T, A>&& lhs, Matrix<T, B>&& rhs);
+template <typename T, typename A, typename R> 
+MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, R, MatrixSub> 
+operator- (Matrix<T, A>&& lhs, const MatrixExpr<R>& rhs);
+template <typename L, typename T, typename A> 
+MatrixBinaryExpr<L, MatrixTemporary<Matrix<T, A>>, MatrixSub> 
+operator- (const MatrixExpr<L>& lhs, Matrix<T, A>&& rhs);
+template <typename T, typename A, typename B> 
+MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, MatrixTemporary<Matrix<T, B>>, MatrixSub> 
+operator- (Matrix<T, A>&& lhs, Matrix<T, B>&& rhs);
+
+template <typename T, typename A> MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixAdd, true> 
+operator+ (const typename Matrix<T, A>::value_type& lhs, Matrix<T, A>&& rhs);
+template <typename T, typename A> MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixSub, true> 
+operator- (const typename Matrix<T, A>::value_type& lhs, Matrix<T, A>&& rhs);
+template <typename T, typename A> MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixMul, true> 
+operator* (const typename Matrix<T, A>::value_type& lhs, Matrix<T, A>&& rhs);
+template <typename T, typename A> MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixAdd, false> 
+operator+ (Matrix<T, A>&& lhs, const typename Matrix<T, A>::value_type& rhs);
+template <typename T, typename A> MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixSub, false> 
+operator- (Matrix<T, A>&& lhs, const typename Matrix<T, A>::value_type& rhs);
+template <typename T, typename A> MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixMul, false> 
+operator* (Matrix<T, A>&& lhs, const typename Matrix<T, A>::value_type& rhs);
+
+template <typename T, typename A, typename B> 
+Matrix<T, A> operator* (const Matrix<T, A>& lhs, const Matrix<T, B>& rhs);
+template <typename L, typename R> Matrix<typename L::value_type> 
+operator* (const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs);
+
+template <typename T, typename A> std::ostream& operator<< (std::ostream& os, 
+                                                            const Matrix<T, A>& matrix);
+template <typename E> std::ostream& operator<< (std::ostream& os, 
+                                                const MatrixExpr<E>& expr);
 
 //-----------------------------------------------------------------------------
 // Implementation of Matrix
 //-----------------------------------------------------------------------------
-template <typename T>
-Matrix<T>::Matrix (size_t num_rows, size_t num_cols, const T value)
+template <typename T, typename A>
+Matrix<T, A>::Matrix (size_t num_rows, size_t num_cols, const T value)
     : num_rows_(num_rows), num_cols_(num_cols), 
       values_(num_rows*num_cols, value)
 {
     //
 }
 
-template <typename T>
-Matrix<T>::Matrix(Matrix<T>&& m)
+template <typename T, typename A>
+Matrix<T, A>::Matrix (const Matrix<T, A>& m)
+    : num_rows_(m.num_rows_), num_cols_(m.num_cols_), values_(m.values_.size())
+{
+    // A vector with a custom allocator copies element by element; copying
+    // into default-initialized storage lets std::copy use memmove.
+    std::copy(m.values_.begin(), m.values_.end(), values_.begin());
+}
+
+template <typename T, typename A>
+Matrix<T, A>::Matrix(Matrix<T, A>&& m)
     : num_rows_(m.num_rows_), num_cols_(m.num_cols_),
       values_(std::move(m.values_))
 {
@@ -90,8 +501,8 @@ Matrix<T>::Matrix(Matrix<T>&& m)
     m.num_cols_ = 0;
 }
 
-template <typename T>
-Matrix<T>& Matrix<T>::operator= (Matrix<T>&& rhs)
+template <typename T, typename A>
+Matrix<T, A>& Matrix<T, A>::operator= (Matrix<T, A>&& rhs)
 {
     if (this != &rhs) {
         num_rows_ = rhs.num_rows_;
@@ -104,227 +515,1133 @@ Matrix<T>& Matrix<T>::operator= (Matrix<T>&& rhs)
     return *this;
 }
 
-template <typename T>
-size_t Matrix<T>::get_num_rows () const
+template <typename T, typename A>
+Matrix<T, A> Matrix<T, A>::uninitialized (size_t num_rows, size_t num_cols)
+{
+    Matrix<T, A> ret(0, 0);
+    ret.num_rows_ = num_rows;
+    ret.num_cols_ = num_cols;
+    ret.values_.resize(num_rows*num_cols);
+    return ret;
+}
+
+
+template <typename T, typename A>
+template <typename E, typename>
+Matrix<T, A>::Matrix (const MatrixExpr<E>& expr)
+    : num_rows_(expr.self().get_num_rows()), num_cols_(expr.self().get_num_cols()),
+      values_(num_rows_*num_cols_)
+{
+    apply<MatrixAssign>(expr.self());
+}
+
+
+template <typename T, typename A>
+template <typename E>
+Matrix<T, A>& Matrix<T, A>::operator= (const MatrixExpr<E>& expr)
+{
+    const E& e = expr.self();
+    if (e.get_num_rows() != num_rows_ || e.get_num_cols() != num_cols_
+        || e.conflicts(get_extent())) {
+        // The expression may refer to this matrix; build the result aside.
+        Matrix<T, A> ret(e);
+        return *this = std::move(ret);
+    }
+
+    // Each element only depends on the same element of the operands, so
+    // evaluating in place is safe even if this matrix is one of them.
+    apply<MatrixAssign>(e);
+    return *this;
+}
+
+
+template <typename T, typename A>
+template <typename Op, typename E>
+void Matrix<T, A>::apply (const E& expr)
+{
+    static_assert(std::is_same<typename E::value_type, T>::value,
+                  "expression of a different value type");
+
+    T* values = values_.data();
+    size_t num_cols = num_cols_;
+    matrix_kernel::parallel_for(0, values_.size(), elementwise_grain,
+                                [=, &expr](size_t begin, size_t end) {
+        // Operands that index by i leave row and col dead.
+        size_t row = begin / num_cols, col = begin % num_cols;
+        for (size_t i = begin; i < end; i++) {
+            values[i] = Op::apply(values[i], expr.eval(i, row, col));
+            if (++col == num_cols) {
+                col = 0;
+                row++;
+            }
+        }
+    });
+}
+
+
+template <typename T, typename A>
+template <typename E>
+Matrix<T, A>& Matrix<T, A>::operator+= (const MatrixExpr<E>& rhs)
+{
+    const E& e = rhs.self();
+    if (num_rows_ != e.get_num_rows() || num_cols_ != e.get_num_cols()) {
+        throw std::logic_error ("different size");
+    }
+
+    if (e.conflicts(get_extent())) {
+        apply<MatrixAdd>(Matrix<T, A>(e));
+    } else {
+        apply<MatrixAdd>(e);
+    }
+    return *this;
+}
+
+
+template <typename T, typename A>
+template <typename E>
+Matrix<T, A>& Matrix<T, A>::operator-= (const MatrixExpr<E>& rhs)
+{
+    const E& e = rhs.self();
+    if (num_rows_ != e.get_num_rows() || num_cols_ != e.get_num_cols()) {
+        throw std::logic_error ("different size");
+    }
+
+    if (e.conflicts(get_extent())) {
+        apply<MatrixSub>(Matrix<T, A>(e));
+    } else {
+        apply<MatrixSub>(e);
+    }
+    return *this;
+}
+
+
+template <typename T, typename A>
+size_t Matrix<T, A>::get_num_rows () const
 {
     return num_rows_;
 }
 
 
-template <typename T>
-size_t Matrix<T>::get_num_cols () const
+template <typename T, typename A>
+size_t Matrix<T, A>::get_num_cols () const
 {
     return num_cols_;
 }
 
 
-template <typename T>
-T& Matrix<T>::operator() (size_t row, size_t col)
+template <typename T, typename A>
+T& Matrix<T, A>::operator() (size_t row, size_t col)
 {
     return values_[row*num_cols_ + col];
 }
 
 
-template <typename T>
-const T Matrix<T>::operator() (size_t row, size_t col) const
+template <typename T, typename A>
+const T Matrix<T, A>::operator() (size_t row, size_t col) const
 {
     return values_[row*num_cols_ + col];
 }
 
 
-template <typename T>
-Matrix<T>& Matrix<T>::operator+= (const T& rhs)
+template <typename T, typename A>
+T* Matrix<T, A>::data ()
+{
+    return values_.data();
+}
+
+
+template <typename T, typename A>
+const T* Matrix<T, A>::data () const
 {
-    for (auto& val : values_) {
-        val += rhs;
+    return values_.data();
+}
+
+
+template <typename T, typename A>
+Matrix<T, A>& Matrix<T, A>::operator+= (const T& rhs)
+{
+    T* values = values_.data();
+    matrix_kernel::parallel_for(0, values_.size(), elementwise_grain,
+                                [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            values[i] += rhs;
+        }
+    });
+    return *this;
+}
+
+
+template <typename T, typename A>
+Matrix<T, A>& Matrix<T, A>::operator-= (const T& rhs)
+{
+    T* values = values_.data();
+    matrix_kernel::parallel_for(0, values_.size(), elementwise_grain,
+                                [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            values[i] -= rhs;
+        }
+    });
+    return *this;
+}
+
+
+template <typename T, typename A>
+Matrix<T, A>& Matrix<T, A>::operator*= (const T& rhs)
+{
+    T* values = values_.data();
+    matrix_kernel::parallel_for(0, values_.size(), elementwise_grain,
+                                [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            values[i] *= rhs;
+        }
+    });
+    return *this;
+}
+
+
+template <typename T, typename A>
+Matrix<T, A>& Matrix<T, A>::operator+= (const Matrix<T, A>& rhs)
+{
+    if (num_rows_ != rhs.num_rows_ || num_cols_ != rhs.num_cols_) {
+        throw std::logic_error ("different size");
     }
+
+    T* values = values_.data();
+    const T* rhs_values = rhs.values_.data();
+    matrix_kernel::parallel_for(0, values_.size(), elementwise_grain,
+                                [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            values[i] += rhs_values[i];
+        }
+    });
+
+    return *this;
 }
 
 
-template <typename T>
-Matrix<T>& Matrix<T>::operator-= (const T& rhs)
+template <typename T, typename A>
+Matrix<T, A>& Matrix<T, A>::operator-= (const Matrix<T, A>& rhs)
+{
+    if (num_rows_ != rhs.num_rows_ || num_cols_ != rhs.num_cols_) {
+        throw std::logic_error ("different size");
+    }
+
+    T* values = values_.data();
+    const T* rhs_values = rhs.values_.data();
+    matrix_kernel::parallel_for(0, values_.size(), elementwise_grain,
+                                [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            values[i] -= rhs_values[i];
+        }
+    });
+
+    return *this;
+}
+
+
+template <typename T, typename A>
+Matrix<T, A>& Matrix<T, A>::operator*= (const Matrix<T, A>& rhs)
 {
-    for (auto& val : values_) {
-        val -= rhs;
+    if (num_cols_ != rhs.num_rows_) {
+        throw std::logic_error ("num_cols_ != rhs.num_rows_");
     }
+
+    Matrix<T, A> ret = uninitialized(num_rows_, rhs.num_cols_);
+    matrix_kernel::gemm(num_rows_, rhs.num_cols_, num_cols_, T(1),
+                        data(), num_cols_, 1, rhs.data(), rhs.num_cols_, 1,
+                        T(0), ret.data(), ret.num_cols_, 1);
+
+    std::swap(values_, ret.values_);
+    num_rows_ = ret.num_rows_;
+    num_cols_ = ret.num_cols_;
+
+    return *this;
 }
 
 
+//-----------------------------------------------------------------------------
+// MatrixView
+//-----------------------------------------------------------------------------
 template <typename T>
-Matrix<T>& Matrix<T>::operator*= (const T& rhs)
+MatrixView<T>::MatrixView (T* data, size_t num_rows, size_t num_cols, 
+                           ptrdiff_t row_stride, ptrdiff_t col_stride)
+    : data_(data), num_rows_(num_rows), num_cols_(num_cols), 
+      row_stride_(row_stride), col_stride_(col_stride)
 {
-    for (auto& val : values_) {
-        val *= rhs;
+    if (row_stride < 0 || col_stride < 0) {
+        throw std::logic_error ("negative stride");
     }
 }
 
 
 template <typename T>
-Matrix<T>& Matrix<T>::operator+= (const Matrix<T>& rhs)
+MatrixView<T>& MatrixView<T>::operator= (const MatrixView& rhs)
 {
-    if (num_rows_ != rhs.num_rows_ || num_cols_ != rhs.num_cols_) {
+    return *this = static_cast<const MatrixExpr<MatrixView>&>(rhs);
+}
+
+
+template <typename T>
+template <typename E>
+MatrixView<T>& MatrixView<T>::operator= (const MatrixExpr<E>& expr)
+{
+    const E& e = expr.self();
+    if (num_rows_ != e.get_num_rows() || num_cols_ != e.get_num_cols()) {
         throw std::logic_error ("different size");
     }
 
-    for (size_t i = 0; i < num_rows_*num_cols_; i++) {
-        values_[i] += rhs.values_[i];
+    apply<MatrixAssign>(e);
+    return *this;
+}
+
+
+template <typename T>
+template <typename E>
+MatrixView<T>& MatrixView<T>::operator+= (const MatrixExpr<E>& rhs)
+{
+    const E& e = rhs.self();
+    if (num_rows_ != e.get_num_rows() || num_cols_ != e.get_num_cols()) {
+        throw std::logic_error ("different size");
     }
 
+    apply<MatrixAdd>(e);
     return *this;
 }
 
 
 template <typename T>
-Matrix<T>& Matrix<T>::operator-= (const Matrix<T>& rhs)
+template <typename E>
+MatrixView<T>& MatrixView<T>::operator-= (const MatrixExpr<E>& rhs)
 {
-    if (num_rows_ != rhs.num_rows_ || num_cols_ != rhs.num_cols_) {
+    const E& e = rhs.self();
+    if (num_rows_ != e.get_num_rows() || num_cols_ != e.get_num_cols()) {
         throw std::logic_error ("different size");
     }
 
-    for (size_t i = 0; i < num_rows_*num_cols_; i++) {
-        values_[i] -= rhs.values_[i];
-    }
+    apply<MatrixSub>(e);
+    return *this;
+}
+
+
+template <typename T>
+MatrixView<T>& MatrixView<T>::operator+= (const value_type& rhs)
+{
+    for_each([=](T& x, size_t, size_t, size_t) { x += rhs; });
+    return *this;
+}
+
 
+template <typename T>
+MatrixView<T>& MatrixView<T>::operator-= (const value_type& rhs)
+{
+    for_each([=](T& x, size_t, size_t, size_t) { x -= rhs; });
     return *this;
 }
 
 
 template <typename T>
-Matrix<T>& Matrix<T>::operator*= (const Matrix<T>& rhs)
+MatrixView<T>& MatrixView<T>::operator*= (const value_type& rhs)
 {
-    if (num_rows_ != rhs.num_cols_) {
-        throw std::logic_error ("num_rows_ != rhs.num_cols");
+    for_each([=](T& x, size_t, size_t, size_t) { x *= rhs; });
+    return *this;
+}
+
+
+template <typename T>
+MatrixView<T> MatrixView<T>::block (size_t row, size_t col, 
+                                    size_t num_rows, size_t num_cols) const
+{
+    if (row > num_rows_ || num_rows > num_rows_ - row 
+        || col > num_cols_ || num_cols > num_cols_ - col) {
+        throw std::out_of_range ("block out of range");
     }
+    return MatrixView(data_ + row*row_stride_ + col*col_stride_, num_rows, num_cols,
+                      row_stride_, col_stride_);
+}
+
 
-    Matrix<T> ret(num_rows_, rhs.num_cols_, 0);
+template <typename T>
+template <typename F>
+void MatrixView<T>::for_each (F f) const
+{
+    if (num_rows_ == 0 || num_cols_ == 0) {
+        return;
+    }
 
-    for (size_t i = 0; i < ret.num_rows_; i++) {
-        for (size_t j = 0; j < ret.num_cols_; j++) {
-            for (size_t k = 0; k < num_cols_; k++) {
-                ret(i,j) += (*this)(i,k) * rhs(k,j);
+    // Whole rows per task; a row of a transposed view is a strided walk,
+    // but each task still touches its own elements only.
+    size_t grain = std::max<size_t>(1, elementwise_grain / num_cols_);
+    T* data = data_;
+    size_t num_cols = num_cols_;
+    ptrdiff_t row_stride = row_stride_, col_stride = col_stride_;
+    matrix_kernel::parallel_for(0, num_rows_, grain, 
+                                [=, &f](size_t begin, size_t end) {
+        for (size_t row = begin; row < end; row++) {
+            T* p = data + row*row_stride;
+            size_t i = row*num_cols;
+            if (col_stride == 1) {
+                for (size_t col = 0; col < num_cols; col++) {
+                    f(p[col], i + col, row, col);
+                }
+            } else {
+                for (size_t col = 0; col < num_cols; col++) {
+                    f(p[col*col_stride], i + col, row, col);
+                }
             }
         }
+    });
+}
+
+
+template <typename T>
+template <typename Op, typename E>
+void MatrixView<T>::apply (const E& e) const
+{
+    static_assert(std::is_same<typename E::value_type, value_type>::value,
+                  "expression of a different value type");
+
+    if (e.conflicts(get_extent())) {
+        Matrix<value_type> tmp(e);
+        apply<Op>(tmp);
+        return;
     }
+    for_each([&e](T& x, size_t i, size_t row, size_t col) {
+        x = Op::apply(x, e.eval(i, row, col));
+    });
+}
 
-    std::swap(values_, ret.values_);
-    num_rows_ = ret.num_rows_;
-    num_cols_ = ret.num_cols_;
 
-    return *this;
+//-----------------------------------------------------------------------------
+// Element-wise expressions
+//-----------------------------------------------------------------------------
+template <typename L, typename R> 
+MatrixBinaryExpr<L, R, MatrixAdd> 
+operator+ (const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs)
+{
+    return MatrixBinaryExpr<L, R, MatrixAdd>(lhs.self(), rhs.self());
 }
 
+template <typename L, typename R> 
+MatrixBinaryExpr<L, R, MatrixSub> 
+operator- (const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs)
+{
+    return MatrixBinaryExpr<L, R, MatrixSub>(lhs.self(), rhs.self());
+}
 
-template <typename T> 
-Matrix<T> operator+(const T& lhs, const Matrix<T>& rhs)
+template <typename E> 
+MatrixScalarExpr<E, MatrixAdd, true> 
+operator+ (const typename E::value_type& lhs, const MatrixExpr<E>& rhs)
 {
-    Matrix<T> ret(rhs);
-    ret += lhs;
-    return ret;
+    return MatrixScalarExpr<E, MatrixAdd, true>(rhs.self(), lhs);
 }
 
-template <typename T> 
-Matrix<T> operator-(const T& lhs, const Matrix<T>& rhs)
+template <typename E> 
+MatrixScalarExpr<E, MatrixSub, true> 
+operator- (const typename E::value_type& lhs, const MatrixExpr<E>& rhs)
 {
-    Matrix<T> ret(rhs);
-    ret -= lhs;
-    return ret;
+    return MatrixScalarExpr<E, MatrixSub, true>(rhs.self(), lhs);
 }
 
-template <typename T> 
-Matrix<T> operator*(const T& lhs, const Matrix<T>& rhs)
+template <typename E> 
+MatrixScalarExpr<E, MatrixMul, true> 
+operator* (const typename E::value_type& lhs, const MatrixExpr<E>& rhs)
 {
-    Matrix<T> ret(rhs);
-    ret *= lhs;
-    return ret;
+    return MatrixScalarExpr<E, MatrixMul, true>(rhs.self(), lhs);
 }
 
-template <typename T> 
-Matrix<T> operator+(const Matrix<T>& lhs, const T& rhs)
+template <typename E> 
+MatrixScalarExpr<E, MatrixAdd, false> 
+operator+ (const MatrixExpr<E>& lhs, const typename E::value_type& rhs)
 {
-    Matrix<T> ret(lhs);
-    ret += rhs;
-    return ret;
+    return MatrixScalarExpr<E, MatrixAdd, false>(lhs.self(), rhs);
 }
 
-template <typename T> 
-Matrix<T> operator-(const Matrix<T>& lhs, const T& rhs)
+template <typename E> 
+MatrixScalarExpr<E, MatrixSub, false> 
+operator- (const MatrixExpr<E>& lhs, const typename E::value_type& rhs)
 {
-    Matrix<T> ret(lhs);
-    ret -= rhs;
-    return ret;
+    return MatrixScalarExpr<E, MatrixSub, false>(lhs.self(), rhs);
 }
-template <typename T> 
-Matrix<T> operator*(const Matrix<T>& lhs, const T& rhs)
+
+template <typename E> 
+MatrixScalarExpr<E, MatrixMul, false> 
+operator* (const MatrixExpr<E>& lhs, const typename E::value_type& rhs)
 {
-    Matrix<T> ret(lhs);
-    ret *= rhs;
-    return ret;
+    return MatrixScalarExpr<E, MatrixMul, false>(lhs.self(), rhs);
+}
+
+template <typename T, typename A, typename R> 
+MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, R, MatrixAdd> 
+operator+ (Matrix<T, A>&& lhs, const MatrixExpr<R>& rhs)
+{
+    return MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, R, MatrixAdd>(
+        MatrixTemporary<Matrix<T, A>>(std::move(lhs)), rhs.self());
+}
+
+template <typename L, typename T, typename A> 
+MatrixBinaryExpr<L, MatrixTemporary<Matrix<T, A>>, MatrixAdd> 
+operator+ (const MatrixExpr<L>& lhs, Matrix<T, A>&& rhs)
+{
+    return MatrixBinaryExpr<L, MatrixTemporary<Matrix<T, A>>, MatrixAdd>(
+        lhs.self(), MatrixTemporary<Matrix<T, A>>(std::move(rhs)));
+}
+
+template <typename T, typename A, typename B> 
+MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, MatrixTemporary<Matrix<T, B>>, MatrixAdd> 
+operator+ (Matrix<T, A>&& lhs, Matrix<T, B>&& rhs)
+{
+    return MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, 
+                            MatrixTemporary<Matrix<T, B>>, MatrixAdd>(
+        MatrixTemporary<Matrix<T, A>>(std::move(lhs)),
+        MatrixTemporary<Matrix<T, B>>(std::move(rhs)));
 }
 
+template <typename T, typename A, typename R> 
+MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, R, MatrixSub> 
+operator- (Matrix<T, A>&& lhs, const MatrixExpr<R>& rhs)
+{
+    return MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, R, MatrixSub>(
+        MatrixTemporary<Matrix<T, A>>(std::move(lhs)), rhs.self());
+}
+
+template <typename L, typename T, typename A> 
+MatrixBinaryExpr<L, MatrixTemporary<Matrix<T, A>>, MatrixSub> 
+operator- (const MatrixExpr<L>& lhs, Matrix<T, A>&& rhs)
+{
+    return MatrixBinaryExpr<L, MatrixTemporary<Matrix<T, A>>, MatrixSub>(
+        lhs.self(), MatrixTemporary<Matrix<T, A>>(std::move(rhs)));
+}
+
+template <typename T, typename A, typename B> 
+MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, MatrixTemporary<Matrix<T, B>>, MatrixSub> 
+operator- (Matrix<T, A>&& lhs, Matrix<T, B>&& rhs)
+{
+    return MatrixBinaryExpr<MatrixTemporary<Matrix<T, A>>, 
+                            MatrixTemporary<Matrix<T, B>>, MatrixSub>(
+        MatrixTemporary<Matrix<T, A>>(std::move(lhs)),
+        MatrixTemporary<Matrix<T, B>>(std::move(rhs)));
+}
 
-template <typename T> 
-Matrix<T> operator+ (const Matrix<T>& lhs, const Matrix<T>& rhs)
+template <typename T, typename A> 
+MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixAdd, true> 
+operator+ (const typename Matrix<T, A>::value_type& lhs, Matrix<T, A>&& rhs)
 {
-    if (lhs.get_num_rows() != rhs.get_num_rows() 
-        || lhs.get_num_cols() != rhs.get_num_cols()) {
+    return MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixAdd, true>(
+        MatrixTemporary<Matrix<T, A>>(std::move(rhs)), lhs);
+}
+
+template <typename T, typename A> 
+MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixSub, true> 
+operator- (const typename Matrix<T, A>::value_type& lhs, Matrix<T, A>&& rhs)
+{
+    return MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixSub, true>(
+        MatrixTemporary<Matrix<T, A>>(std::move(rhs)), lhs);
+}
+
+template <typename T, typename A> 
+MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixMul, true> 
+operator* (const typename Matrix<T, A>::value_type& lhs, Matrix<T, A>&& rhs)
+{
+    return MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixMul, true>(
+        MatrixTemporary<Matrix<T, A>>(std::move(rhs)), lhs);
+}
+
+template <typename T, typename A> 
+MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixAdd, false> 
+operator+ (Matrix<T, A>&& lhs, const typename Matrix<T, A>::value_type& rhs)
+{
+    return MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixAdd, false>(
+        MatrixTemporary<Matrix<T, A>>(std::move(lhs)), rhs);
+}
+
+template <typename T, typename A> 
+MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixSub, false> 
+operator- (Matrix<T, A>&& lhs, const typename Matrix<T, A>::value_type& rhs)
+{
+    return MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixSub, false>(
+        MatrixTemporary<Matrix<T, A>>(std::move(lhs)), rhs);
+}
+
+template <typename T, typename A> 
+MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixMul, false> 
+operator* (Matrix<T, A>&& lhs, const typename Matrix<T, A>::value_type& rhs)
+{
+    return MatrixScalarExpr<MatrixTemporary<Matrix<T, A>>, MatrixMul, false>(
+        MatrixTemporary<Matrix<T, A>>(std::move(lhs)), rhs);
+}
+
+
+namespace matrix_kernel
+{
+
+/**
+ * c = alpha*a*b + beta*c on views, for blocked algorithms that update
+ * parts of a matrix in place. c must not overlap a or b.
+ */
+template <typename T>
+void gemm (T alpha, const MatrixView<const typename std::remove_const<T>::type>& a,
+           const MatrixView<const typename std::remove_const<T>::type>& b, 
+           T beta, const MatrixView<T>& c)
+{
+    if (a.get_num_cols() != b.get_num_rows()) {
+        throw std::logic_error ("lhs.num_cols_ != rhs.num_rows_");
+    }
+    if (c.get_num_rows() != a.get_num_rows() || c.get_num_cols() != b.get_num_cols()) {
         throw std::logic_error ("different size");
     }
+    gemm(c.get_num_rows(), c.get_num_cols(), a.get_num_cols(), alpha,
+         a.data(), a.get_row_stride(), a.get_col_stride(),
+         b.data(), b.get_row_stride(), b.get_col_stride(),
+         beta, c.data(), c.get_row_stride(), c.get_col_stride());
+}
+
+/**
+ * Whether E keeps its elements at fixed strides, so that a product can
+ * read it in place through E::view(). Specialized for each such leaf.
+ */
+template <typename E> struct IsStrided : std::false_type {};
+template <typename T, typename A> struct IsStrided<Matrix<T, A>> : std::true_type {};
+template <typename T> struct IsStrided<MatrixView<T>> : std::true_type {};
+
+/**
+ * An operand of a product as a view. A product needs every element of
+ * its operands several times, so other expressions are evaluated first.
+ */
+template <typename E, bool = IsStrided<E>::value>
+struct ProductOperand
+{
+    Matrix<typename E::value_type> matrix_;
+    MatrixView<const typename E::value_type> view_;
+
+    explicit ProductOperand (const E& e) : matrix_(e), view_(matrix_.view()) {}
+};
+
+template <typename E>
+struct ProductOperand<E, true>
+{
+    MatrixView<const typename E::value_type> view_;
+
+    explicit ProductOperand (const E& e) : view_(e.view()) {}
+};
+
+/**
+ * lhs*rhs into a new M; the views may have any strides, so transposes
+ * and blocks are multiplied without being copied.
+ */
+template <typename M, typename T>
+M multiply (const MatrixView<const T>& lhs, const MatrixView<const T>& rhs)
+{
+    if (lhs.get_num_cols() != rhs.get_num_rows()) {
+        throw std::logic_error ("lhs.num_cols_ != rhs.num_rows_");
+    }
 
-    Matrix<T> ret(lhs);
-    ret += rhs;
+    // gemm does not read C when beta is zero.
+    M ret = M::uninitialized(lhs.get_num_rows(), rhs.get_num_cols());
+    gemm(T(1), lhs, rhs, T(0), ret.view());
     return ret;
 }
 
+}   // End of namespace matrix_kernel
+
 
-template <typename T> 
-Matrix<T> operator- (const Matrix<T>& lhs, const Matrix<T>& rhs)
+template <typename T, typename A, typename B> 
+Matrix<T, A> operator* (const Matrix<T, A>& lhs, const Matrix<T, B>& rhs)
 {
-    if (lhs.get_num_rows() != rhs.get_num_rows() 
-        || lhs.get_num_cols() != rhs.get_num_cols()) {
-        throw std::logic_error ("different size");
+    return matrix_kernel::multiply<Matrix<T, A>>(lhs.view(), rhs.view());
+}
+
+template <typename L, typename R> 
+Matrix<typename L::value_type> 
+operator* (const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs)
+{
+    matrix_kernel::ProductOperand<L> l(lhs.self());
+    matrix_kernel::ProductOperand<R> r(rhs.self());
+    return matrix_kernel::multiply<Matrix<typename L::value_type>>(l.view_, r.view_);
+}
+
+
+template <typename T, typename A>
+bool operator== (const Matrix<T, A>& lhs, const Matrix<T, A>& rhs)
+{
+    return lhs.get_num_rows() == rhs.get_num_rows()
+           && lhs.get_num_cols() == rhs.get_num_cols()
+           && std::equal(lhs.data(), lhs.data() + lhs.get_num_rows()*lhs.get_num_cols(),
+                         rhs.data());
+}
+
+template <typename T, typename A>
+bool operator!= (const Matrix<T, A>& lhs, const Matrix<T, A>& rhs)
+{
+    return !(lhs == rhs);
+}
+
+
+template <typename T, typename A>
+std::ostream& operator<< (std::ostream& os, const Matrix<T, A>& matrix)
+{
+    for (size_t i = 0; i < matrix.get_num_rows(); i++) {
+        for (size_t j = 0; j < matrix.get_num_cols(); j++) {
+            os << matrix(i,j) << " ";
+        }
+        os << "\n";
     }
+    return os;
+}
 
-    Matrix<T> ret(lhs);
-    ret -= rhs;
-    return ret;
+
+template <typename E>
+std::ostream& operator<< (std::ostream& os, const MatrixExpr<E>& expr)
+{
+    return os << Matrix<typename E::value_type>(expr);
+}
+
+
+//-----------------------------------------------------------------------------
+// Sparse matrices
+//-----------------------------------------------------------------------------
+
+/**
+ * Storage order of a SparseMatrix: compressed rows or compressed columns.
+ */
+enum class SparseFormat { csr, csc };
+
+/**
+ * One nonzero element, for building a SparseMatrix.
+ */
+template <typename T>
+struct Triplet
+{
+    size_t row;
+    size_t col;
+    T value;
+};
+
+
+/**
+ * A sparse matrix in compressed sparse row (CSR) or column (CSC) form.
+ *
+ * Only the nonzeros are stored: for each outer index (a row for CSR, a
+ * column for CSC), offsets()[i] ... offsets()[i + 1] delimit its inner
+ * indices, in increasing order, and the matching values. Memory and the
+ * cost of products grow with the number of nonzeros.
+ *
+ * Products with dense operands run on matrix_kernel::ThreadPool. Every
+ * element of the result is summed by one thread in a fixed order, so the
+ * results do not depend on the number of threads.
+ */
+template <typename T, SparseFormat F = SparseFormat::csr>
+class SparseMatrix
+{
+public:
+    typedef T value_type;
+    static const SparseFormat other_format 
+        = (F == SparseFormat::csr) ? SparseFormat::csc : SparseFormat::csr;
+
+    SparseMatrix (size_t num_rows, size_t num_cols);
+
+    /**
+     * Build from nonzeros in any order; duplicates are summed.
+     */
+    SparseMatrix (size_t num_rows, size_t num_cols, 
+                  const std::vector<Triplet<T>>& triplets);
+
+    /**
+     * Keep the nonzero elements of a dense matrix.
+     */
+    template <typename A> explicit SparseMatrix (const Matrix<T, A>& dense);
+
+    /**
+     * Convert between CSR and CSC.
+     */
+    explicit SparseMatrix (const SparseMatrix<T, other_format>& m);
+
+    size_t get_num_rows () const;
+    size_t get_num_cols () const;
+    size_t get_num_nonzeros () const;
+
+    /**
+     * Element (row, col), zero if it is not stored. Takes a binary search.
+     */
+    const T operator() (size_t row, size_t col) const;
+
+    const std::vector<size_t>& offsets () const;
+    const std::vector<size_t>& indices () const;
+    const std::vector<T>& values () const;
+
+    Matrix<T> to_dense () const;
+
+    /**
+     * The transpose, which has the same arrays in the other format.
+     */
+    SparseMatrix<T, other_format> transpose () const;
+
+    /**
+     * c = this*b, where b is get_num_cols() x n and c is get_num_rows() x n,
+     * both dense and row-major. c is overwritten.
+     */
+    void multiply (const T* b, size_t n, T* c) const;
+
+private:
+    template <typename U, SparseFormat G> friend class SparseMatrix;
+
+    /// Multiply-adds per thread below which products stay on one thread.
+    static const size_t product_grain = 1 << 15;
+
+    size_t num_rows_;               ///< Number of rows.
+    size_t num_cols_;               ///< Number of columns.
+    std::vector<size_t> offsets_;   ///< Start of each outer index, plus the end.
+    std::vector<size_t> indices_;   ///< Inner index of each nonzero.
+    std::vector<T> values_;         ///< Value of each nonzero.
+
+    size_t get_num_outer () const { return F == SparseFormat::csr ? num_rows_ : num_cols_; }
+    size_t get_num_inner () const { return F == SparseFormat::csr ? num_cols_ : num_rows_; }
+
+    /**
+     * Fill offsets_, indices_ and values_ from entries given as
+     * (outer, inner, value) triples of any order, summing duplicates.
+     */
+    template <typename Outer, typename Inner, typename Value>
+    void build (size_t num_entries, Outer outer, Inner inner, Value value);
+
+    /**
+     * Rows [row_begin, row_end) of c = this*b.
+     */
+    void multiply_rows (size_t row_begin, size_t row_end, 
+                        const T* b, size_t n, T* c) const;
+};
+
+template <typename T> using CsrMatrix = SparseMatrix<T, SparseFormat::csr>;
+template <typename T> using CscMatrix = SparseMatrix<T, SparseFormat::csc>;
+
+template <typename T, SparseFormat F> 
+std::vector<T> operator* (const SparseMatrix<T, F>& lhs, const std::vector<T>& rhs);
+template <typename T, SparseFormat F, typename A> 
+Matrix<T, A> operator* (const SparseMatrix<T, F>& lhs, const Matrix<T, A>& rhs);
+
+
+//-----------------------------------------------------------------------------
+// Implementation of SparseMatrix
+//-----------------------------------------------------------------------------
+template <typename T, SparseFormat F>
+const SparseFormat SparseMatrix<T, F>::other_format;
+
+template <typename T, SparseFormat F>
+SparseMatrix<T, F>::SparseMatrix (size_t num_rows, size_t num_cols)
+    : num_rows_(num_rows), num_cols_(num_cols), offsets_(get_num_outer() + 1, 0)
+{
+    //
 }
 
 
-template <typename T> 
-Matrix<T> operator* (const Matrix<T>& lhs, const Matrix<T>& rhs)
+template <typename T, SparseFormat F>
+SparseMatrix<T, F>::SparseMatrix (size_t num_rows, size_t num_cols,
+                                  const std::vector<Triplet<T>>& triplets)
+    : num_rows_(num_rows), num_cols_(num_cols)
 {
-    auto lhs_num_rows = lhs.get_num_rows();
-    auto lhs_num_cols = lhs.get_num_cols();
-    auto rhs_num_cols = rhs.get_num_cols();
+    for (const auto& t : triplets) {
+        if (t.row >= num_rows || t.col >= num_cols) {
+            throw std::out_of_range ("triplet out of range");
+        }
+    }
 
-    if (lhs_num_rows != rhs_num_cols) {
-        throw std::logic_error ("lhs.num_rows_ != rhs.num_cols");
+    bool csr = (F == SparseFormat::csr);
+    build(triplets.size(),
+          [&](size_t i) { return csr ? triplets[i].row : triplets[i].col; },
+          [&](size_t i) { return csr ? triplets[i].col : triplets[i].row; },
+          [&](size_t i) { return triplets[i].value; });
+}
+
+
+template <typename T, SparseFormat F>
+template <typename A>
+SparseMatrix<T, F>::SparseMatrix (const Matrix<T, A>& dense)
+    : num_rows_(dense.get_num_rows()), num_cols_(dense.get_num_cols()),
+      offsets_(get_num_outer() + 1, 0)
+{
+    const T* d = dense.data();
+    size_t num_nonzeros = 0;
+    for (size_t i = 0; i < num_rows_*num_cols_; i++) {
+        num_nonzeros += (d[i] != T(0));
+    }
+    indices_.reserve(num_nonzeros);
+    values_.reserve(num_nonzeros);
+
+    for (size_t o = 0; o < get_num_outer(); o++) {
+        for (size_t i = 0; i < get_num_inner(); i++) {
+            const T& v = (F == SparseFormat::csr) ? d[o*num_cols_ + i] 
+                                                  : d[i*num_cols_ + o];
+            if (v != T(0)) {
+                indices_.push_back(i);
+                values_.push_back(v);
+            }
+        }
+        offsets_[o + 1] = indices_.size();
     }
+}
+
+
+template <typename T, SparseFormat F>
+SparseMatrix<T, F>::SparseMatrix (const SparseMatrix<T, other_format>& m)
+    : num_rows_(m.num_rows_), num_cols_(m.num_cols_), 
+      offsets_(get_num_outer() + 1, 0), indices_(m.indices_.size()), 
+      values_(m.values_.size())
+{
+    // Counting sort by the inner index of m. Walking m in order leaves
+    // the new inner indices sorted.
+    for (size_t i : m.indices_) {
+        offsets_[i + 1]++;
+    }
+    for (size_t o = 0; o < get_num_outer(); o++) {
+        offsets_[o + 1] += offsets_[o];
+    }
+
+    std::vector<size_t> next(offsets_.begin(), offsets_.end() - 1);
+    for (size_t o = 0; o < m.get_num_outer(); o++) {
+        for (size_t p = m.offsets_[o]; p < m.offsets_[o + 1]; p++) {
+            size_t q = next[m.indices_[p]]++;
+            indices_[q] = o;
+            values_[q] = m.values_[p];
+        }
+    }
+}
+
+
+template <typename T, SparseFormat F>
+template <typename Outer, typename Inner, typename Value>
+void SparseMatrix<T, F>::build (size_t num_entries, Outer outer, Inner inner, 
+                                Value value)
+{
+    // Bucket the entries by outer index, keeping their order.
+    size_t num_outer = get_num_outer();
+    offsets_.assign(num_outer + 1, 0);
+    for (size_t e = 0; e < num_entries; e++) {
+        offsets_[outer(e) + 1]++;
+    }
+    for (size_t o = 0; o < num_outer; o++) {
+        offsets_[o + 1] += offsets_[o];
+    }
+
+    std::vector<std::pair<size_t, T>> entries(num_entries);
+    std::vector<size_t> next(offsets_.begin(), offsets_.end() - 1);
+    for (size_t e = 0; e < num_entries; e++) {
+        entries[next[outer(e)]++] = std::make_pair(inner(e), value(e));
+    }
+
+    // Sort each bucket by inner index and sum duplicates in input order.
+    indices_.clear();
+    values_.clear();
+    indices_.reserve(num_entries);
+    values_.reserve(num_entries);
+    auto by_index = [](const std::pair<size_t, T>& a, const std::pair<size_t, T>& b) {
+        return a.first < b.first;
+    };
+    for (size_t o = 0; o < num_outer; o++) {
+        auto begin = entries.begin() + offsets_[o];
+        auto end = entries.begin() + offsets_[o + 1];
+        std::stable_sort(begin, end, by_index);
+
+        offsets_[o] = indices_.size();
+        for (auto it = begin; it != end; ++it) {
+            if (indices_.size() > offsets_[o] && indices_.back() == it->first) {
+                values_.back() += it->second;
+            } else {
+                indices_.push_back(it->first);
+                values_.push_back(it->second);
+            }
+        }
+    }
+    offsets_[num_outer] = indices_.size();
+}
+
+
+template <typename T, SparseFormat F>
+size_t SparseMatrix<T, F>::get_num_rows () const
+{
+    return num_rows_;
+}
+
+
+template <typename T, SparseFormat F>
+size_t SparseMatrix<T, F>::get_num_cols () const
+{
+    return num_cols_;
+}
+
+
+template <typename T, SparseFormat F>
+size_t SparseMatrix<T, F>::get_num_nonzeros () const
+{
+    return values_.size();
+}
+
+
+template <typename T, SparseFormat F>
+const T SparseMatrix<T, F>::operator() (size_t row, size_t col) const
+{
+    size_t o = (F == SparseFormat::csr) ? row : col;
+    size_t i = (F == SparseFormat::csr) ? col : row;
+    auto begin = indices_.begin() + offsets_[o];
+    auto end = indices_.begin() + offsets_[o + 1];
+    auto it = std::lower_bound(begin, end, i);
+    return (it != end && *it == i) ? values_[it - indices_.begin()] : T(0);
+}
+
+
+template <typename T, SparseFormat F>
+const std::vector<size_t>& SparseMatrix<T, F>::offsets () const
+{
+    return offsets_;
+}
+
+
+template <typename T, SparseFormat F>
+const std::vector<size_t>& SparseMatrix<T, F>::indices () const
+{
+    return indices_;
+}
+
+
+template <typename T, SparseFormat F>
+const std::vector<T>& SparseMatrix<T, F>::values () const
+{
+    return values_;
+}
 
-    Matrix<T> ret(lhs_num_rows, rhs_num_cols, 0);
 
-    for (size_t i = 0; i < lhs_num_rows; i++) {
-        for (size_t j = 0; j < rhs_num_cols; j++) {
-            for (size_t k = 0; k < lhs_num_cols; k++) {
-                ret(i,j) += lhs(i,k) * rhs(k,j);
+template <typename T, SparseFormat F>
+Matrix<T> SparseMatrix<T, F>::to_dense () const
+{
+    Matrix<T> ret(num_rows_, num_cols_, 0);
+    T* d = ret.data();
+    for (size_t o = 0; o < get_num_outer(); o++) {
+        for (size_t p = offsets_[o]; p < offsets_[o + 1]; p++) {
+            if (F == SparseFormat::csr) {
+                d[o*num_cols_ + indices_[p]] = values_[p];
+            } else {
+                d[indices_[p]*num_cols_ + o] = values_[p];
             }
         }
     }
+    return ret;
+}
 
+
+template <typename T, SparseFormat F>
+SparseMatrix<T, SparseMatrix<T, F>::other_format> SparseMatrix<T, F>::transpose () const
+{
+    SparseMatrix<T, other_format> ret(num_cols_, num_rows_);
+    ret.offsets_ = offsets_;
+    ret.indices_ = indices_;
+    ret.values_ = values_;
     return ret;
 }
 
 
-template <typename T>
-std::ostream& operator<< (std::ostream& os, const Matrix<T>& matrix)
+template <typename T, SparseFormat F>
+void SparseMatrix<T, F>::multiply_rows (size_t row_begin, size_t row_end,
+                                        const T* b, size_t n, T* c) const
 {
-    for (size_t i = 0; i < matrix.get_num_rows(); i++) {
-        for (size_t j = 0; j < matrix.get_num_cols(); j++) {
-            os << matrix(i,j) << " ";
+    std::fill(c + row_begin*n, c + row_end*n, T(0));
+
+    if (F == SparseFormat::csr) {
+        for (size_t i = row_begin; i < row_end; i++) {
+            if (n == 1) {
+                T sum = T(0);
+                for (size_t p = offsets_[i]; p < offsets_[i + 1]; p++) {
+                    sum += values_[p] * b[indices_[p]];
+                }
+                c[i] = sum;
+                continue;
+            }
+
+            T* ci = c + i*n;
+            for (size_t p = offsets_[i]; p < offsets_[i + 1]; p++) {
+                const T a = values_[p];
+                const T* bk = b + indices_[p]*n;
+                for (size_t j = 0; j < n; j++) {
+                    ci[j] += a * bk[j];
+                }
+            }
         }
-        os << "\n";
+        return;
     }
-    return os;
+
+    // CSC: scatter column k of this times row k of b into the rows in
+    // range. Row indices are sorted, so the range is contiguous in each
+    // column.
+    for (size_t k = 0; k < num_cols_; k++) {
+        auto begin = indices_.begin() + offsets_[k];
+        auto end = indices_.begin() + offsets_[k + 1];
+        size_t p = (row_begin == 0) ? offsets_[k] 
+                   : std::lower_bound(begin, end, row_begin) - indices_.begin();
+        const T* bk = b + k*n;
+        for (; p < offsets_[k + 1] && indices_[p] < row_end; p++) {
+            const T a = values_[p];
+            T* ci = c + indices_[p]*n;
+            for (size_t j = 0; j < n; j++) {
+                ci[j] += a * bk[j];
+            }
+        }
+    }
+}
+
+
+template <typename T, SparseFormat F>
+void SparseMatrix<T, F>::multiply (const T* b, size_t n, T* c) const
+{
+    size_t work = std::max<size_t>(get_num_nonzeros()*n, 1);
+    size_t num_chunks = std::min(matrix_kernel::get_num_threads(), 
+                                 (work + product_grain - 1) / product_grain);
+    if (num_chunks <= 1 || num_rows_ < 2) {
+        multiply_rows(0, num_rows_, b, n, c);
+        return;
+    }
+
+    // Split the rows so each chunk gets about the same number of nonzeros
+    // (CSR), or the same number of rows (CSC).
+    std::vector<size_t> bounds(num_chunks + 1, num_rows_);
+    for (size_t t = 0; t < num_chunks; t++) {
+        if (F == SparseFormat::csr) {
+            size_t target = get_num_nonzeros() * t / num_chunks;
+            bounds[t] = std::upper_bound(offsets_.begin(), offsets_.end(), target) 
+                        - offsets_.begin() - 1;
+        } else {
+            bounds[t] = num_rows_ * t / num_chunks;
+        }
+    }
+    bounds[0] = 0;
+
+    matrix_kernel::ThreadPool::get().run(num_chunks, [&](size_t t) {
+        if (bounds[t] < bounds[t + 1]) {
+            multiply_rows(bounds[t], bounds[t + 1], b, n, c);
+        }
+    });
+}
+
+
+template <typename T, SparseFormat F> 
+std::vector<T> operator* (const SparseMatrix<T, F>& lhs, const std::vector<T>& rhs)
+{
+    if (lhs.get_num_cols() != rhs.size()) {
+        throw std::logic_error ("lhs.num_cols_ != rhs.size()");
+    }
+
+    std::vector<T> ret(lhs.get_num_rows());
+    lhs.multiply(rhs.data(), 1, ret.data());
+    return ret;
+}
+
+
+template <typename T, SparseFormat F, typename A> 
+Matrix<T, A> operator* (const SparseMatrix<T, F>& lhs, const Matrix<T, A>& rhs)
+{
+    if (lhs.get_num_cols() != rhs.get_num_rows()) {
+        throw std::logic_error ("lhs.num_cols_ != rhs.num_rows_");
+    }
+
+    Matrix<T, A> ret = Matrix<T, A>::uninitialized(lhs.get_num_rows(), rhs.get_num_cols());
+    lhs.multiply(rhs.data(), rhs.get_num_cols(), ret.data());
+    return ret;
 }
 
 
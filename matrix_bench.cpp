@@ -0,0 +1,404 @@
+/**
+ * @file    matrix_bench.cpp
+ * @author  Jinwook Jung (jinwookjung@kaist.ac.kr)
+ * @date    2017-10-18 17:05:12
+ * @brief   Throughput benchmark for the Matrix kernels.
+ *
+ * For every element type (float, double, int) and thread count (1, 2, 4,
+ * ... up to the maximum), the benchmark times
+ *
+ * - products of square, tall-skinny (m >> k, n) and inner-product shaped
+ *   (k >> m, n) operands, and batches of small 4x4 to 16x16 products,
+ *   reporting GFLOPS (2*m*n*k per product);
+ * - element-wise A + B, A + B - 2*C, A *= -1 and a transposed copy,
+ *   reporting GB/s of operand and result traffic.
+ *
+ * Each result is checked against a naive reference on a sample of rows,
+ * and the benchmark exits with 1 if any check fails. Times are the best
+ * of several repetitions.
+ *
+ * Build: g++ -std=c++11 -O2 -pthread matrix_bench.cpp -o matrix_bench
+ *
+ * Usage: matrix_bench [-t max threads] [-n size of the square matrices]
+ *                     [-m minimum seconds per case] [-f csv|json]
+ */
+
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <random>
+#include <limits>
+#include <cmath>
+#include "matrix.h"
+
+using namespace std;
+
+
+struct Config
+{
+    size_t max_threads_;
+    size_t size_;
+    double min_seconds_;
+    string format_;
+
+    Config () : max_threads_(thread::hardware_concurrency()), size_(1024),
+                min_seconds_(0.2), format_("json") {
+        if (max_threads_ == 0) {
+            max_threads_ = 1;
+        }
+    }
+};
+
+
+struct Result
+{
+    string op_;
+    string shape_;
+    string type_;
+    size_t num_threads_;
+    size_t m_;
+    size_t n_;
+    size_t k_;
+    size_t batch_;
+    double seconds_;                ///< Per repetition.
+    double gflops_;
+    double gb_per_sec_;
+    double error_;                  ///< Max error relative to the bound.
+    bool ok_;
+};
+
+
+template <typename T> const char* get_type_name ();
+template <> const char* get_type_name<float> () { return "float"; }
+template <> const char* get_type_name<double> () { return "double"; }
+template <> const char* get_type_name<int> () { return "int"; }
+
+
+/**
+ * Elements in [-1, 1] for floating point, small integers for int, so
+ * that int products cannot overflow.
+ */
+template <typename T>
+static Matrix<T> make_random (size_t num_rows, size_t num_cols, mt19937& gen)
+{
+    Matrix<T> m = Matrix<T>::uninitialized(num_rows, num_cols);
+    uniform_real_distribution<double> dist(-1, 1);
+    for (size_t i = 0; i < num_rows*num_cols; i++) {
+        double v = dist(gen);
+        m.data()[i] = numeric_limits<T>::is_integer ? static_cast<T>(v*8)
+                                                    : static_cast<T>(v);
+    }
+    return m;
+}
+
+
+/**
+ * The error of a value against its reference, relative to what rounding
+ * alone can cause in a sum of k terms of magnitude up to scale. An exact
+ * type must match exactly.
+ */
+template <typename T>
+static double get_error (T value, double ref, size_t k, double scale)
+{
+    double diff = fabs(static_cast<double>(value) - ref);
+    if (numeric_limits<T>::is_integer) {
+        return diff;
+    }
+    return diff / (max<size_t>(k, 1) * scale * numeric_limits<T>::epsilon());
+}
+
+
+/**
+ * Best time of one call of f over five samples of at least
+ * min_seconds/5 each.
+ */
+template <typename F>
+static double time_best (F f, double min_seconds)
+{
+    typedef chrono::steady_clock Clock;
+    f();    // Warm up caches, the thread pool and the buffer allocations.
+
+    double best = numeric_limits<double>::max();
+    size_t num_calls = 1;
+    for (int sample = 0; sample < 5; sample++) {
+        double seconds;
+        for (;;) {
+            auto start = Clock::now();
+            for (size_t i = 0; i < num_calls; i++) {
+                f();
+            }
+            seconds = chrono::duration<double>(Clock::now() - start).count();
+            if (seconds >= min_seconds / 5) {
+                break;
+            }
+            num_calls *= 2;
+        }
+        best = min(best, seconds / num_calls);
+    }
+    return best;
+}
+
+
+/**
+ * c == a*b, checked on up to 16 rows spread over c.
+ */
+template <typename T>
+static double check_product (const Matrix<T>& a, const Matrix<T>& b, const Matrix<T>& c)
+{
+    size_t m = a.get_num_rows(), k = a.get_num_cols(), n = b.get_num_cols();
+    size_t step = max<size_t>(1, m / 16);
+    double error = 0;
+    for (size_t i = 0; i < m; i += step) {
+        for (size_t j = 0; j < n; j++) {
+            double ref = 0;
+            for (size_t p = 0; p < k; p++) {
+                ref += static_cast<double>(a(i, p)) * b(p, j);
+            }
+            error = max(error, get_error(c(i, j), ref, k, 1.0));
+        }
+    }
+    return error;
+}
+
+
+template <typename T>
+static Result run_product (const string& shape, size_t m, size_t n, size_t k,
+                           const Config& config, mt19937& gen)
+{
+    Matrix<T> a = make_random<T>(m, k, gen);
+    Matrix<T> b = make_random<T>(k, n, gen);
+    Matrix<T> c(m, n);
+
+    Result r;
+    r.op_ = "multiply";
+    r.shape_ = shape;
+    r.m_ = m;
+    r.n_ = n;
+    r.k_ = k;
+    r.batch_ = 1;
+    r.seconds_ = time_best([&]() { c = a*b; }, config.min_seconds_);
+    r.error_ = check_product(a, b, c);
+    return r;
+}
+
+
+/**
+ * batch independent products of small matrices, each its own Matrix.
+ */
+template <typename T>
+static Result run_small_products (size_t size, size_t batch,
+                                  const Config& config, mt19937& gen)
+{
+    vector<Matrix<T>> a, b, c;
+    for (size_t i = 0; i < batch; i++) {
+        a.push_back(make_random<T>(size, size, gen));
+        b.push_back(make_random<T>(size, size, gen));
+        c.push_back(Matrix<T>(size, size));
+    }
+
+    Result r;
+    r.op_ = "multiply";
+    r.shape_ = "small";
+    r.m_ = r.n_ = r.k_ = size;
+    r.batch_ = batch;
+    r.seconds_ = time_best([&]() {
+        for (size_t i = 0; i < batch; i++) {
+            c[i] = a[i]*b[i];
+        }
+    }, config.min_seconds_);
+
+    r.error_ = 0;
+    for (size_t i = 0; i < batch; i += max<size_t>(1, batch / 16)) {
+        r.error_ = max(r.error_, check_product(a[i], b[i], c[i]));
+    }
+    return r;
+}
+
+
+/**
+ * An element-wise operation on size x size matrices. f runs the
+ * operation; ref(i, j) is the expected element of the result; num_arrays
+ * is the number of matrices read or written.
+ */
+template <typename T, typename F, typename G>
+static Result run_elementwise (const string& op, size_t size, size_t num_arrays,
+                               const Matrix<T>& result, F f, G ref, const Config& config)
+{
+    Result r;
+    r.op_ = op;
+    r.shape_ = "square";
+    r.m_ = r.n_ = size;
+    r.k_ = 0;
+    r.batch_ = 1;
+    r.seconds_ = time_best(f, config.min_seconds_);
+
+    r.error_ = 0;
+    for (size_t i = 0; i < size; i += max<size_t>(1, size / 16)) {
+        for (size_t j = 0; j < size; j++) {
+            r.error_ = max(r.error_, get_error(result(i, j), ref(i, j), 1, 4.0));
+        }
+    }
+    r.gflops_ = 0;
+    r.gb_per_sec_ = num_arrays * size * size * sizeof(T) / r.seconds_ / 1e9;
+    return r;
+}
+
+
+static void print_header (const Config& config)
+{
+    if (config.format_ == "csv") {
+        cout << "op,shape,type,threads,m,n,k,batch,seconds,gflops,gb_per_sec,"
+             << "error,ok" << endl;
+    }
+}
+
+
+static void print_result (const Config& config, const Result& r)
+{
+    if (config.format_ == "csv") {
+        cout << r.op_ << "," << r.shape_ << "," << r.type_ << ","
+             << r.num_threads_ << "," << r.m_ << "," << r.n_ << "," << r.k_ << ","
+             << r.batch_ << "," << r.seconds_ << "," << r.gflops_ << ","
+             << r.gb_per_sec_ << "," << r.error_ << "," << (r.ok_ ? 1 : 0) << endl;
+    } else {
+        cout << "{\"op\":\"" << r.op_ << "\",\"shape\":\"" << r.shape_
+             << "\",\"type\":\"" << r.type_
+             << "\",\"threads\":" << r.num_threads_
+             << ",\"m\":" << r.m_ << ",\"n\":" << r.n_ << ",\"k\":" << r.k_
+             << ",\"batch\":" << r.batch_
+             << ",\"seconds\":" << r.seconds_
+             << ",\"gflops\":" << r.gflops_
+             << ",\"gb_per_sec\":" << r.gb_per_sec_
+             << ",\"error\":" << r.error_
+             << ",\"ok\":" << (r.ok_ ? "true" : "false") << "}" << endl;
+    }
+}
+
+
+/**
+ * Run every case for element type T on num_threads threads. Returns false
+ * if any result is wrong.
+ */
+template <typename T>
+static bool run_all (const Config& config, size_t num_threads)
+{
+    mt19937 gen(1);
+    size_t n = config.size_;
+    vector<Result> results;
+
+    // Products. Flops and the minimum traffic, every operand once.
+    vector<size_t> squares;
+    for (size_t s : { size_t(64), size_t(256), n }) {
+        if (s <= n && (s == n || s < n / 2)
+            && find(squares.begin(), squares.end(), s) == squares.end()) {
+            squares.push_back(s);
+        }
+    }
+    for (size_t s : squares) {
+        results.push_back(run_product<T>("square", s, s, s, config, gen));
+    }
+    results.push_back(run_product<T>("tall_skinny", 16*n, 64, 64, config, gen));
+    results.push_back(run_product<T>("inner", 64, 64, 16*n, config, gen));
+    for (size_t s : { 4, 8, 16 }) {
+        results.push_back(run_small_products<T>(s, 10000, config, gen));
+    }
+    for (Result& r : results) {
+        r.gflops_ = 2.0*r.m_*r.n_*r.k_*r.batch_ / r.seconds_ / 1e9;
+        r.gb_per_sec_ = double(r.m_*r.k_ + r.k_*r.n_ + r.m_*r.n_) * r.batch_
+                        * sizeof(T) / r.seconds_ / 1e9;
+    }
+
+    // Element-wise, on operands well beyond the last level cache.
+    size_t e = 2*n;
+    Matrix<T> a = make_random<T>(e, e, gen);
+    Matrix<T> b = make_random<T>(e, e, gen);
+    Matrix<T> c = make_random<T>(e, e, gen);
+    Matrix<T> d(e, e);
+    results.push_back(run_elementwise<T>("add", e, 3, d, [&]() { d = a + b; },
+        [&](size_t i, size_t j) { return double(a(i, j)) + b(i, j); }, config));
+    results.push_back(run_elementwise<T>("add_sub_scale", e, 4, d,
+        [&]() { d = a + b - T(2)*c; },
+        [&](size_t i, size_t j) { return double(a(i, j)) + b(i, j) - 2.0*c(i, j); },
+        config));
+    // Flipping the sign is exact for every type and cannot be folded away;
+    // the number of runs tells the expected sign.
+    d = c;
+    size_t num_scales = 0;
+    results.push_back(run_elementwise<T>("scale", e, 2, d,
+        [&]() { d *= T(-1); num_scales++; },
+        [&](size_t i, size_t j) { return (num_scales % 2 ? -1.0 : 1.0)*c(i, j); },
+        config));
+    results.push_back(run_elementwise<T>("transpose", e, 2, d,
+        [&]() { d = a.transpose(); },
+        [&](size_t i, size_t j) { return double(a(j, i)); }, config));
+
+    bool ok = true;
+    for (Result& r : results) {
+        r.type_ = get_type_name<T>();
+        r.num_threads_ = num_threads;
+        r.ok_ = numeric_limits<T>::is_integer ? r.error_ == 0 : r.error_ <= 1;
+        ok = ok && r.ok_;
+        print_result(config, r);
+    }
+    return ok;
+}
+
+
+static bool parse_args (int argc, char* argv[], Config& config)
+{
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        if (arg == "-t") {
+            config.max_threads_ = stoul(argv[++i]);
+        } else if (arg == "-n") {
+            config.size_ = stoul(argv[++i]);
+        } else if (arg == "-m") {
+            config.min_seconds_ = stod(argv[++i]);
+        } else if (arg == "-f") {
+            config.format_ = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    return config.max_threads_ > 0 && config.size_ > 0
+           && (config.format_ == "csv" || config.format_ == "json");
+}
+
+
+int main (int argc, char* argv[])
+{
+    Config config;
+    if (!parse_args(argc, argv, config)) {
+        cerr << "Usage: " << argv[0] << " [-t max threads] [-n size]"
+             << " [-m min seconds per case] [-f csv|json]" << endl;
+        return 1;
+    }
+
+    vector<size_t> thread_counts;
+    for (size_t t = 1; t < config.max_threads_; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(config.max_threads_);
+
+    print_header(config);
+
+    bool ok = true;
+    for (size_t t : thread_counts) {
+        matrix_kernel::set_num_threads(t);
+        ok = run_all<float>(config, t) && ok;
+        ok = run_all<double>(config, t) && ok;
+        ok = run_all<int>(config, t) && ok;
+    }
+
+    if (!ok) {
+        cerr << "Some results do not match the reference." << endl;
+        return 1;
+    }
+    return 0;
+}
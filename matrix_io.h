@@ -0,0 +1,541 @@
+/**
+ * @file    matrix_io.h
+ * @author  Jinwook Jung (jinwookjung@kaist.ac.kr)
+ * @date    2017-10-18 17:05:12
+ *
+ * Binary matrix files, written by MatrixWriter and mapped by MappedMatrix.
+ *
+ * File layout (native byte order; the byte order mark rejects files from
+ * a host of the other endianness):
+ *
+ *      offset  0  "MYMATRIX"
+ *              8  version:u32  byte_order_mark:u32
+ *             16  element:u32  element_size:u32  layout:u32  reserved:u32
+ *             32  num_rows:u64  num_cols:u64
+ *             48  checksum:u64  reserved:u64
+ *             64  num_rows*num_cols elements in layout order
+ *
+ * The magic is written last, by MatrixWriter::close(), so a file that was
+ * never closed is rejected even if all of its data made it to disk.
+ *
+ * The data starts 64 bytes into the file, so a mapped file gives a
+ * cache-line aligned matrix. The checksum is that of
+ * matrix_kernel::Checksum over the data.
+ */
+
+#ifndef MATRIX_IO_H
+#define MATRIX_IO_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "matrix.h"
+
+const char matrix_file_magic[8] = { 'M', 'Y', 'M', 'A', 'T', 'R', 'I', 'X' };
+const uint32_t matrix_file_version = 1;
+const uint32_t matrix_file_byte_order_mark = 0x01020304;
+const size_t matrix_file_header_size = 64;
+
+/**
+ * Element type of a matrix file.
+ */
+enum class MatrixElement : uint32_t {
+    int8 = 1, uint8, int16, uint16, int32, uint32, int64, uint64,
+    float32, float64
+};
+
+/**
+ * Order of the elements in a matrix file.
+ */
+enum class MatrixLayout : uint32_t { row_major, col_major };
+
+template <typename T> struct MatrixElementOf;
+template <> struct MatrixElementOf<int8_t> { static const MatrixElement value = MatrixElement::int8; };
+template <> struct MatrixElementOf<uint8_t> { static const MatrixElement value = MatrixElement::uint8; };
+template <> struct MatrixElementOf<int16_t> { static const MatrixElement value = MatrixElement::int16; };
+template <> struct MatrixElementOf<uint16_t> { static const MatrixElement value = MatrixElement::uint16; };
+template <> struct MatrixElementOf<int32_t> { static const MatrixElement value = MatrixElement::int32; };
+template <> struct MatrixElementOf<uint32_t> { static const MatrixElement value = MatrixElement::uint32; };
+template <> struct MatrixElementOf<int64_t> { static const MatrixElement value = MatrixElement::int64; };
+template <> struct MatrixElementOf<uint64_t> { static const MatrixElement value = MatrixElement::uint64; };
+template <> struct MatrixElementOf<float> { static const MatrixElement value = MatrixElement::float32; };
+template <> struct MatrixElementOf<double> { static const MatrixElement value = MatrixElement::float64; };
+
+
+namespace matrix_kernel
+{
+
+/**
+ * A 64-bit FNV-1a checksum that takes 8 bytes at a time in four
+ * interleaved lanes, so hashing a multi-GB file runs near memory speed
+ * rather than at one multiply per byte. Data may be fed in pieces of any
+ * size.
+ */
+class Checksum
+{
+private:
+    static const uint64_t prime = 1099511628211ull;
+
+    uint64_t lanes_[4];
+    unsigned char pending_[32];         ///< Bytes short of a 32-byte stripe.
+    size_t num_pending_;
+    uint64_t size_;                     ///< Bytes fed so far.
+
+    void update_stripes (const unsigned char* p, size_t num_stripes) {
+        uint64_t h0 = lanes_[0], h1 = lanes_[1], h2 = lanes_[2], h3 = lanes_[3];
+        for (size_t s = 0; s < num_stripes; s++, p += 32) {
+            uint64_t w[4];
+            std::memcpy(w, p, 32);
+            h0 = (h0 ^ w[0]) * prime;
+            h1 = (h1 ^ w[1]) * prime;
+            h2 = (h2 ^ w[2]) * prime;
+            h3 = (h3 ^ w[3]) * prime;
+        }
+        lanes_[0] = h0; lanes_[1] = h1; lanes_[2] = h2; lanes_[3] = h3;
+    }
+
+public:
+    Checksum () : num_pending_(0), size_(0) {
+        for (int i = 0; i < 4; i++) {
+            lanes_[i] = 14695981039346656037ull + i;
+        }
+    }
+
+    void update (const void* data, size_t n) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        size_ += n;
+        if (num_pending_ > 0) {
+            size_t m = std::min(n, sizeof(pending_) - num_pending_);
+            std::memcpy(pending_ + num_pending_, p, m);
+            num_pending_ += m;
+            p += m;
+            n -= m;
+            if (num_pending_ < sizeof(pending_)) {
+                return;
+            }
+            update_stripes(pending_, 1);
+            num_pending_ = 0;
+        }
+        update_stripes(p, n / 32);
+        num_pending_ = n % 32;
+        std::memcpy(pending_, p + n - num_pending_, num_pending_);
+    }
+
+    uint64_t get () const {
+        uint64_t h = 14695981039346656037ull;
+        for (size_t i = 0; i < num_pending_; i++) {
+            h = (h ^ pending_[i]) * prime;
+        }
+        for (int i = 0; i < 4; i++) {
+            h = (h ^ lanes_[i]) * prime;
+        }
+        return (h ^ size_) * prime;
+    }
+};
+
+inline void write_all (int fd, const char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error ("cannot write matrix file");
+        }
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+}
+
+}   // End of namespace matrix_kernel
+
+
+/**
+ * Writes a matrix file row by row, so results can be stored without
+ * holding the whole matrix in memory. Rows are buffered; close() writes
+ * the checksum into the header.
+ *
+ * Errors throw std::runtime_error. A writer destroyed without close()
+ * leaves a file that MappedMatrix rejects, however much of it was written.
+ */
+template <typename T>
+class MatrixWriter
+{
+public:
+    MatrixWriter (const std::string& path, size_t num_rows, size_t num_cols);
+    ~MatrixWriter ();
+    MatrixWriter (const MatrixWriter& w) = delete;
+    MatrixWriter& operator= (const MatrixWriter& w) = delete;
+
+    /**
+     * Append n elements, continuing the rows written so far.
+     */
+    void write (const T* values, size_t n);
+
+    /**
+     * Append the rows of a matrix with num_cols columns.
+     */
+    template <typename A> void write (const Matrix<T, A>& rows);
+
+    /**
+     * Write out the buffer and the checksum, and close the file. Throws if
+     * fewer than num_rows*num_cols elements were written.
+     */
+    void close ();
+
+private:
+    static const size_t buffer_size = 1 << 20;
+
+    int fd_;
+    size_t num_rows_;
+    size_t num_cols_;
+    size_t num_written_;                ///< Elements written so far.
+    std::vector<char> buf_;
+    matrix_kernel::Checksum checksum_;
+
+    void flush_buffer ();
+    void write_header (uint64_t checksum, bool is_complete);
+};
+
+
+/**
+ * A read-only matrix backed by a mapped matrix file.
+ *
+ * Nothing is read at construction beyond the header; pages are loaded on
+ * first touch, so opening a multi-GB matrix is immediate. The matrix is a
+ * MatrixExpr, so it takes part in element-wise expressions and converts
+ * to Matrix, and products with it run gemm on the mapped data directly.
+ *
+ * Errors (missing file, bad header, wrong element type, truncated file,
+ * checksum mismatch) throw std::runtime_error.
+ */
+template <typename T>
+class MappedMatrix : public MatrixExpr<MappedMatrix<T>>
+{
+public:
+    typedef T value_type;
+
+    /**
+     * Map path. If verify is set, read the whole file once to check the
+     * checksum.
+     */
+    explicit MappedMatrix (const std::string& path, bool verify = false);
+    ~MappedMatrix ();
+    MappedMatrix (MappedMatrix&& m);
+    MappedMatrix (const MappedMatrix& m) = delete;
+    MappedMatrix& operator= (const MappedMatrix& m) = delete;
+
+    size_t get_num_rows () const { return num_rows_; }
+    size_t get_num_cols () const { return num_cols_; }
+    MatrixLayout get_layout () const { return layout_; }
+    const T operator() (size_t row, size_t col) const { return data_[row*row_stride_ + col*col_stride_]; }
+
+    /**
+     * Elements in file order; see get_layout().
+     */
+    const T* data () const { return data_; }
+    ptrdiff_t get_row_stride () const { return row_stride_; }
+    ptrdiff_t get_col_stride () const { return col_stride_; }
+
+    /**
+     * The whole matrix as a view, e.g. for its blocks or its transpose.
+     */
+    MatrixView<const T> view () const {
+        return MatrixView<const T>(data_, num_rows_, num_cols_, row_stride_, col_stride_);
+    }
+
+    /**
+     * The expression interface. The mapping is read-only, so it never
+     * conflicts with a destination.
+     */
+    T eval (size_t i, size_t row, size_t col) const {
+        return (layout_ == MatrixLayout::row_major) ? data_[i] : (*this)(row, col);
+    }
+    bool conflicts (const matrix_kernel::Extent&) const { return false; }
+
+    /**
+     * Whether the data matches the checksum in the header.
+     */
+    bool verify () const;
+
+private:
+    void* map_;
+    size_t map_size_;
+    const T* data_;
+    size_t num_rows_;
+    size_t num_cols_;
+    MatrixLayout layout_;
+    ptrdiff_t row_stride_;
+    ptrdiff_t col_stride_;
+    uint64_t checksum_;
+};
+
+// Held by reference in expressions, and multiplied in place, like Matrix.
+template <typename T> struct MatrixOperand<MappedMatrix<T>> { typedef const MappedMatrix<T>& type; };
+namespace matrix_kernel
+{
+template <typename T> struct IsStrided<MappedMatrix<T>> : std::true_type {};
+}
+
+
+/**
+ * Write a matrix to a file in one go.
+ */
+template <typename T, typename A>
+void save_matrix (const std::string& path, const Matrix<T, A>& matrix);
+
+
+//-----------------------------------------------------------------------------
+// Implementation of MatrixWriter
+//-----------------------------------------------------------------------------
+template <typename T>
+MatrixWriter<T>::MatrixWriter (const std::string& path, size_t num_rows,
+                               size_t num_cols)
+    : fd_(-1), num_rows_(num_rows), num_cols_(num_cols), num_written_(0)
+{
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+        throw std::runtime_error ("cannot open " + path);
+    }
+    buf_.reserve(buffer_size);
+    write_header(0, false);
+}
+
+
+template <typename T>
+MatrixWriter<T>::~MatrixWriter ()
+{
+    if (fd_ >= 0) {
+        try {
+            flush_buffer();
+        } catch (const std::exception&) {
+            // Nothing to report to from a destructor.
+        }
+        ::close(fd_);
+    }
+}
+
+
+/**
+ * The magic is left zero until the file is complete.
+ */
+template <typename T>
+void MatrixWriter<T>::write_header (uint64_t checksum, bool is_complete)
+{
+    char header[matrix_file_header_size] = {};
+    uint32_t element = static_cast<uint32_t>(MatrixElementOf<T>::value);
+    uint32_t element_size = sizeof(T);
+    uint32_t layout = static_cast<uint32_t>(MatrixLayout::row_major);
+    uint64_t num_rows = num_rows_, num_cols = num_cols_;
+
+    if (is_complete) {
+        std::memcpy(header, matrix_file_magic, 8);
+    }
+    std::memcpy(header + 8, &matrix_file_version, 4);
+    std::memcpy(header + 12, &matrix_file_byte_order_mark, 4);
+    std::memcpy(header + 16, &element, 4);
+    std::memcpy(header + 20, &element_size, 4);
+    std::memcpy(header + 24, &layout, 4);
+    std::memcpy(header + 32, &num_rows, 8);
+    std::memcpy(header + 40, &num_cols, 8);
+    std::memcpy(header + 48, &checksum, 8);
+
+    if (::lseek(fd_, 0, SEEK_SET) != 0) {
+        throw std::runtime_error ("cannot write matrix file");
+    }
+    matrix_kernel::write_all(fd_, header, sizeof(header));
+}
+
+
+template <typename T>
+void MatrixWriter<T>::flush_buffer ()
+{
+    matrix_kernel::write_all(fd_, buf_.data(), buf_.size());
+    buf_.clear();
+}
+
+
+template <typename T>
+void MatrixWriter<T>::write (const T* values, size_t n)
+{
+    if (fd_ < 0) {
+        throw std::logic_error ("matrix file is closed");
+    }
+    if (n > num_rows_*num_cols_ - num_written_) {
+        throw std::logic_error ("too many elements");
+    }
+
+    const char* p = reinterpret_cast<const char*>(values);
+    size_t bytes = n*sizeof(T);
+    checksum_.update(p, bytes);
+    num_written_ += n;
+
+    if (buf_.size() + bytes > buffer_size) {
+        flush_buffer();
+    }
+    if (bytes >= buffer_size) {
+        matrix_kernel::write_all(fd_, p, bytes);
+    } else {
+        buf_.insert(buf_.end(), p, p + bytes);
+    }
+}
+
+
+template <typename T>
+template <typename A>
+void MatrixWriter<T>::write (const Matrix<T, A>& rows)
+{
+    if (rows.get_num_cols() != num_cols_) {
+        throw std::logic_error ("different number of columns");
+    }
+    write(rows.data(), rows.get_num_rows()*rows.get_num_cols());
+}
+
+
+template <typename T>
+void MatrixWriter<T>::close ()
+{
+    if (fd_ < 0) {
+        return;
+    }
+    if (num_written_ != num_rows_*num_cols_) {
+        throw std::logic_error ("matrix file is incomplete");
+    }
+
+    flush_buffer();
+    write_header(checksum_.get(), true);
+    int fd = fd_;
+    fd_ = -1;
+    if (::close(fd) != 0) {
+        throw std::runtime_error ("cannot write matrix file");
+    }
+}
+
+
+template <typename T, typename A>
+void save_matrix (const std::string& path, const Matrix<T, A>& matrix)
+{
+    MatrixWriter<T> writer(path, matrix.get_num_rows(), matrix.get_num_cols());
+    writer.write(matrix);
+    writer.close();
+}
+
+
+//-----------------------------------------------------------------------------
+// Implementation of MappedMatrix
+//-----------------------------------------------------------------------------
+template <typename T>
+MappedMatrix<T>::MappedMatrix (const std::string& path, bool verify)
+    : map_(MAP_FAILED), map_size_(0), data_(NULL), num_rows_(0), num_cols_(0),
+      layout_(MatrixLayout::row_major), row_stride_(0), col_stride_(0),
+      checksum_(0)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error ("cannot open " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(matrix_file_header_size)) {
+        ::close(fd);
+        throw std::runtime_error (path + ": not a matrix file");
+    }
+    map_size_ = static_cast<size_t>(st.st_size);
+    map_ = ::mmap(NULL, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map_ == MAP_FAILED) {
+        throw std::runtime_error ("cannot map " + path);
+    }
+
+    const char* header = static_cast<const char*>(map_);
+    uint32_t version, byte_order_mark, element, element_size, layout;
+    uint64_t num_rows, num_cols;
+    std::memcpy(&version, header + 8, 4);
+    std::memcpy(&byte_order_mark, header + 12, 4);
+    std::memcpy(&element, header + 16, 4);
+    std::memcpy(&element_size, header + 20, 4);
+    std::memcpy(&layout, header + 24, 4);
+    std::memcpy(&num_rows, header + 32, 8);
+    std::memcpy(&num_cols, header + 40, 8);
+    std::memcpy(&checksum_, header + 48, 8);
+
+    static const char no_magic[8] = {};
+    const char* error = NULL;
+    if (std::memcmp(header, no_magic, 8) == 0) {
+        error = "file was not closed";
+    } else if (std::memcmp(header, matrix_file_magic, 8) != 0) {
+        error = "not a matrix file";
+    } else if (version != matrix_file_version) {
+        error = "unsupported version";
+    } else if (byte_order_mark != matrix_file_byte_order_mark) {
+        error = "written with the other byte order";
+    } else if (element != static_cast<uint32_t>(MatrixElementOf<T>::value)
+               || element_size != sizeof(T)) {
+        error = "different element type";
+    } else if (layout > static_cast<uint32_t>(MatrixLayout::col_major)) {
+        error = "unknown layout";
+    } else if (num_cols != 0 && num_rows > (map_size_ / sizeof(T)) / num_cols) {
+        error = "file is truncated";
+    } else if (map_size_ - matrix_file_header_size < num_rows*num_cols*sizeof(T)) {
+        error = "file is truncated";
+    }
+    if (error) {
+        ::munmap(map_, map_size_);
+        throw std::runtime_error (path + ": " + error);
+    }
+
+    data_ = reinterpret_cast<const T*>(header + matrix_file_header_size);
+    num_rows_ = num_rows;
+    num_cols_ = num_cols;
+    layout_ = static_cast<MatrixLayout>(layout);
+    row_stride_ = (layout_ == MatrixLayout::row_major) ? num_cols_ : 1;
+    col_stride_ = (layout_ == MatrixLayout::row_major) ? 1 : num_rows_;
+
+    if (verify && !this->verify()) {
+        ::munmap(map_, map_size_);
+        throw std::runtime_error (path + ": checksum mismatch");
+    }
+}
+
+
+template <typename T>
+MappedMatrix<T>::~MappedMatrix ()
+{
+    if (map_ != MAP_FAILED) {
+        ::munmap(map_, map_size_);
+    }
+}
+
+
+template <typename T>
+MappedMatrix<T>::MappedMatrix (MappedMatrix<T>&& m)
+    : map_(m.map_), map_size_(m.map_size_), data_(m.data_),
+      num_rows_(m.num_rows_), num_cols_(m.num_cols_), layout_(m.layout_),
+      row_stride_(m.row_stride_), col_stride_(m.col_stride_),
+      checksum_(m.checksum_)
+{
+    m.map_ = MAP_FAILED;
+    m.data_ = NULL;
+    m.num_rows_ = m.num_cols_ = 0;
+}
+
+
+template <typename T>
+bool MappedMatrix<T>::verify () const
+{
+    ::madvise(map_, map_size_, MADV_SEQUENTIAL);
+    matrix_kernel::Checksum checksum;
+    checksum.update(data_, num_rows_*num_cols_*sizeof(T));
+    return checksum.get() == checksum_;
+}
+
+
+#endif
@@ -0,0 +1,471 @@
+/**
+ * @file    matrix_solve.h
+ * @author  Jinwook Jung (jinwookjung@kaist.ac.kr)
+ * @date    2017-10-18 17:05:12
+ *
+ * Dense linear solvers: LU with partial pivoting, Cholesky and triangular
+ * solves.
+ *
+ * The factorizations are blocked so that all but a thin slice of the work
+ * is a gemm update of the trailing matrix, which runs at multiplication
+ * speed and on every thread of the pool. Blocks and transposes are
+ * MatrixViews, so nothing is copied along the way.
+ */
+
+#ifndef MATRIX_SOLVE_H
+#define MATRIX_SOLVE_H
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <cmath>
+#include "matrix.h"
+
+enum class Triangle { lower, upper };
+
+/**
+ * Solve t*x = b for x, overwriting b. t is square and triangular; the
+ * elements outside the given triangle are not read, nor is the diagonal if
+ * unit_diagonal is set. Pass the transpose of a view to solve with t^T.
+ */
+template <typename T>
+void solve_triangular (const MatrixView<const typename std::remove_const<T>::type>& t,
+                       const MatrixView<T>& b, Triangle triangle,
+                       bool unit_diagonal = false);
+
+
+/**
+ * A = P*L*U of a square matrix, L unit lower triangular and U upper
+ * triangular, by blocked right-looking elimination with partial pivoting.
+ * Throws std::runtime_error if A is singular.
+ */
+template <typename T>
+class LuDecomposition
+{
+    static_assert(std::is_floating_point<T>::value, "LU of a non-floating-point matrix");
+
+public:
+    template <typename E> explicit LuDecomposition (const MatrixExpr<E>& a);
+    explicit LuDecomposition (Matrix<T>&& a);
+
+    /**
+     * L below the diagonal, U on and above it.
+     */
+    const Matrix<T>& get_lu () const { return lu_; }
+
+    /**
+     * Row i was swapped with row get_pivots()[i], for i in order.
+     */
+    const std::vector<size_t>& get_pivots () const { return pivots_; }
+
+    T determinant () const;
+
+    /**
+     * x with A*x = b, for any number of columns of b.
+     */
+    template <typename E> Matrix<T> solve (const MatrixExpr<E>& b) const;
+    void solve_in_place (const MatrixView<T>& b) const;
+
+private:
+    Matrix<T> lu_;
+    std::vector<size_t> pivots_;
+
+    void factor ();
+    void factor_panel (size_t diag, size_t num_cols);
+};
+
+
+/**
+ * A = L*L^T of a symmetric positive definite matrix, by blocked
+ * right-looking elimination. Only the lower triangle of A is read. Throws
+ * std::runtime_error if A is not positive definite.
+ */
+template <typename T>
+class CholeskyDecomposition
+{
+    static_assert(std::is_floating_point<T>::value, "Cholesky of a non-floating-point matrix");
+
+public:
+    template <typename E> explicit CholeskyDecomposition (const MatrixExpr<E>& a);
+    explicit CholeskyDecomposition (Matrix<T>&& a);
+
+    /**
+     * L, with zeros above the diagonal.
+     */
+    const Matrix<T>& get_l () const { return l_; }
+
+    template <typename E> Matrix<T> solve (const MatrixExpr<E>& b) const;
+    void solve_in_place (const MatrixView<T>& b) const;
+
+private:
+    Matrix<T> l_;
+
+    void factor ();
+};
+
+
+/**
+ * x with a*x = b, by LU decomposition of a.
+ */
+template <typename L, typename R> Matrix<typename L::value_type>
+solve (const MatrixExpr<L>& a, const MatrixExpr<R>& b);
+
+
+//-----------------------------------------------------------------------------
+// Triangular solves
+//-----------------------------------------------------------------------------
+namespace matrix_kernel
+{
+
+/// Columns factored per step; the trailing update is a gemm of this depth.
+const size_t solve_block_size = 192;
+
+/// Rows of a triangle solved by substitution per step of solve_triangular().
+/// Substitution runs far below gemm speed, so the steps are kept short.
+const size_t solve_substitute_size = 16;
+
+/// Panels this narrow are factored column by column.
+const size_t solve_panel_leaf = 8;
+
+/// Columns of the right-hand side per task.
+const size_t solve_grain = 32;
+
+/**
+ * solve_triangular() on a diagonal block, by substitution. The columns of
+ * b are independent and split across threads.
+ */
+template <typename T>
+void substitute (const MatrixView<const T>& t, const MatrixView<T>& b,
+                 bool lower, bool unit_diagonal)
+{
+    size_t n = t.get_num_rows();
+    parallel_for(0, b.get_num_cols(), solve_grain, [&](size_t begin, size_t end) {
+        MatrixView<T> x = b.cols(begin, end);
+        size_t m = x.get_num_cols();
+        if (x.get_col_stride() == 1) {
+            // Rows of x are contiguous: subtract whole rows.
+            for (size_t s = 0; s < n; s++) {
+                size_t r = lower ? s : n - 1 - s;
+                T* xr = &x(r, 0);
+                size_t first = lower ? 0 : r + 1, last = lower ? r : n;
+                for (size_t c = first; c < last; c++) {
+                    T f = t(r, c);
+                    const T* xc = &x(c, 0);
+                    for (size_t j = 0; j < m; j++) {
+                        xr[j] -= f*xc[j];
+                    }
+                }
+                if (!unit_diagonal) {
+                    T inv = T(1) / t(r, r);
+                    for (size_t j = 0; j < m; j++) {
+                        xr[j] *= inv;
+                    }
+                }
+            }
+        } else {
+            // E.g. the transpose of a row-major block: one column at a time.
+            for (size_t j = 0; j < m; j++) {
+                for (size_t s = 0; s < n; s++) {
+                    size_t r = lower ? s : n - 1 - s;
+                    size_t first = lower ? 0 : r + 1, last = lower ? r : n;
+                    T sum = x(r, j);
+                    for (size_t c = first; c < last; c++) {
+                        sum -= t(r, c)*x(c, j);
+                    }
+                    x(r, j) = unit_diagonal ? sum : sum / t(r, r);
+                }
+            }
+        }
+    });
+}
+
+}   // End of namespace matrix_kernel
+
+
+template <typename T>
+void solve_triangular (const MatrixView<const typename std::remove_const<T>::type>& t,
+                       const MatrixView<T>& b, Triangle triangle, bool unit_diagonal)
+{
+    using namespace matrix_kernel;
+
+    size_t n = t.get_num_rows();
+    if (t.get_num_cols() != n) {
+        throw std::logic_error ("not a square matrix");
+    }
+    if (b.get_num_rows() != n) {
+        throw std::logic_error ("different size");
+    }
+
+    // Substitute on one diagonal block, then remove the solved rows from
+    // the rest of b with gemm.
+    if (triangle == Triangle::lower) {
+        for (size_t k = 0; k < n; k += solve_substitute_size) {
+            size_t kb = std::min(solve_substitute_size, n - k);
+            substitute(t.block(k, k, kb, kb), b.rows(k, k + kb), true, unit_diagonal);
+            if (k + kb < n) {
+                gemm(T(-1), t.block(k + kb, k, n - k - kb, kb), b.rows(k, k + kb),
+                     T(1), b.rows(k + kb, n));
+            }
+        }
+    } else {
+        for (size_t e = n; e > 0; ) {
+            size_t k = (e > solve_substitute_size) ? e - solve_substitute_size : 0;
+            substitute(t.block(k, k, e - k, e - k), b.rows(k, e), false, unit_diagonal);
+            if (k > 0) {
+                gemm(T(-1), t.block(0, k, k, e - k), b.rows(k, e), T(1), b.rows(0, k));
+            }
+            e = k;
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// LuDecomposition
+//-----------------------------------------------------------------------------
+template <typename T>
+template <typename E>
+LuDecomposition<T>::LuDecomposition (const MatrixExpr<E>& a)
+    : lu_(a)
+{
+    factor();
+}
+
+
+template <typename T>
+LuDecomposition<T>::LuDecomposition (Matrix<T>&& a)
+    : lu_(std::move(a))
+{
+    factor();
+}
+
+
+template <typename T>
+void LuDecomposition<T>::factor ()
+{
+    using namespace matrix_kernel;
+
+    size_t n = lu_.get_num_rows();
+    if (lu_.get_num_cols() != n) {
+        throw std::logic_error ("not a square matrix");
+    }
+    pivots_.resize(n);
+
+    MatrixView<T> a = lu_.view();
+    for (size_t k = 0; k < n; k += solve_block_size) {
+        size_t kb = std::min(solve_block_size, n - k);
+        factor_panel(k, kb);
+        if (k + kb < n) {
+            // U12 = L11^-1 A12, A22 -= L21 U12.
+            size_t m = n - k - kb;
+            solve_triangular(a.block(k, k, kb, kb), a.block(k, k + kb, kb, m),
+                             Triangle::lower, true);
+            gemm(T(-1), a.block(k + kb, k, m, kb), a.block(k, k + kb, kb, m),
+                 T(1), a.block(k + kb, k + kb, m, m));
+        }
+    }
+}
+
+
+/**
+ * Factor the columns [diag, diag + num_cols) on and below the diagonal.
+ *
+ * A panel is tall and narrow, so it is split in halves recursively: the
+ * right half is updated from the left one with gemm, and only leaves of
+ * solve_panel_leaf columns are eliminated column by column. Pivoting swaps
+ * whole rows, which keeps L and the trailing matrix consistent.
+ */
+template <typename T>
+void LuDecomposition<T>::factor_panel (size_t diag, size_t num_cols)
+{
+    using namespace matrix_kernel;
+
+    size_t n = lu_.get_num_rows();
+    MatrixView<T> a = lu_.view();
+
+    if (num_cols > solve_panel_leaf) {
+        size_t w = num_cols / 2;
+        factor_panel(diag, w);
+        solve_triangular(a.block(diag, diag, w, w), a.block(diag, diag + w, w, num_cols - w),
+                         Triangle::lower, true);
+        gemm(T(-1), a.block(diag + w, diag, n - diag - w, w),
+             a.block(diag, diag + w, w, num_cols - w),
+             T(1), a.block(diag + w, diag + w, n - diag - w, num_cols - w));
+        factor_panel(diag + w, num_cols - w);
+        return;
+    }
+
+    size_t end = diag + num_cols;
+    for (size_t j = diag; j < end; j++) {
+        size_t p = j;
+        for (size_t i = j + 1; i < n; i++) {
+            if (std::abs(a(i, j)) > std::abs(a(p, j))) {
+                p = i;
+            }
+        }
+        if (a(p, j) == T(0)) {
+            throw std::runtime_error ("singular matrix");
+        }
+        pivots_[j] = p;
+        if (p != j) {
+            std::swap_ranges(&a(j, 0), &a(j, 0) + n, &a(p, 0));
+        }
+
+        T inv = T(1) / a(j, j);
+        const T* u = &a(j, 0);
+        for (size_t i = j + 1; i < n; i++) {
+            T* row = &a(i, 0);
+            T l = (row[j] *= inv);
+            for (size_t c = j + 1; c < end; c++) {
+                row[c] -= l*u[c];
+            }
+        }
+    }
+}
+
+
+template <typename T>
+T LuDecomposition<T>::determinant () const
+{
+    T det = T(1);
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        det *= (pivots_[i] == i) ? lu_(i, i) : -lu_(i, i);
+    }
+    return det;
+}
+
+
+template <typename T>
+template <typename E>
+Matrix<T> LuDecomposition<T>::solve (const MatrixExpr<E>& b) const
+{
+    Matrix<T> x(b);
+    solve_in_place(x.view());
+    return x;
+}
+
+
+template <typename T>
+void LuDecomposition<T>::solve_in_place (const MatrixView<T>& b) const
+{
+    size_t n = lu_.get_num_rows();
+    if (b.get_num_rows() != n) {
+        throw std::logic_error ("different size");
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (pivots_[i] != i) {
+            for (size_t j = 0; j < b.get_num_cols(); j++) {
+                std::swap(b(i, j), b(pivots_[i], j));
+            }
+        }
+    }
+    solve_triangular(lu_.view(), b, Triangle::lower, true);
+    solve_triangular(lu_.view(), b, Triangle::upper);
+}
+
+
+//-----------------------------------------------------------------------------
+// CholeskyDecomposition
+//-----------------------------------------------------------------------------
+template <typename T>
+template <typename E>
+CholeskyDecomposition<T>::CholeskyDecomposition (const MatrixExpr<E>& a)
+    : l_(a)
+{
+    factor();
+}
+
+
+template <typename T>
+CholeskyDecomposition<T>::CholeskyDecomposition (Matrix<T>&& a)
+    : l_(std::move(a))
+{
+    factor();
+}
+
+
+template <typename T>
+void CholeskyDecomposition<T>::factor ()
+{
+    using namespace matrix_kernel;
+
+    size_t n = l_.get_num_rows();
+    if (l_.get_num_cols() != n) {
+        throw std::logic_error ("not a square matrix");
+    }
+
+    MatrixView<T> a = l_.view();
+    for (size_t k = 0; k < n; k += solve_block_size) {
+        size_t kb = std::min(solve_block_size, n - k);
+
+        // L11 by the textbook algorithm.
+        for (size_t j = k; j < k + kb; j++) {
+            T d = a(j, j);
+            for (size_t c = k; c < j; c++) {
+                d -= a(j, c)*a(j, c);
+            }
+            if (!(d > T(0))) {
+                throw std::runtime_error ("matrix is not positive definite");
+            }
+            T l = std::sqrt(d);
+            a(j, j) = l;
+            for (size_t i = j + 1; i < k + kb; i++) {
+                T sum = a(i, j);
+                for (size_t c = k; c < j; c++) {
+                    sum -= a(i, c)*a(j, c);
+                }
+                a(i, j) = sum / l;
+            }
+        }
+        if (k + kb == n) {
+            break;
+        }
+
+        // L21 = A21 L11^-T, i.e. L11 L21^T = A21^T.
+        size_t m = n - k - kb;
+        MatrixView<T> l21 = a.block(k + kb, k, m, kb);
+        solve_triangular(a.block(k, k, kb, kb), l21.transpose(), Triangle::lower);
+
+        // A22 -= L21 L21^T, on and below the diagonal only: one block row
+        // at a time, each up to its diagonal.
+        for (size_t i = 0; i < m; i += solve_block_size) {
+            size_t ib = std::min(solve_block_size, m - i);
+            gemm(T(-1), l21.rows(i, i + ib), l21.rows(0, i + ib).transpose(),
+                 T(1), a.block(k + kb + i, k + kb, ib, i + ib));
+        }
+    }
+
+    for (size_t i = 0; i + 1 < n; i++) {
+        std::fill(&a(i, i + 1), &a(i, 0) + n, T(0));
+    }
+}
+
+
+template <typename T>
+template <typename E>
+Matrix<T> CholeskyDecomposition<T>::solve (const MatrixExpr<E>& b) const
+{
+    Matrix<T> x(b);
+    solve_in_place(x.view());
+    return x;
+}
+
+
+template <typename T>
+void CholeskyDecomposition<T>::solve_in_place (const MatrixView<T>& b) const
+{
+    solve_triangular(l_.view(), b, Triangle::lower);
+    solve_triangular(l_.transpose(), b, Triangle::upper);
+}
+
+
+template <typename L, typename R>
+Matrix<typename L::value_type>
+solve (const MatrixExpr<L>& a, const MatrixExpr<R>& b)
+{
+    return LuDecomposition<typename L::value_type>(a).solve(b);
+}
+
+#endif
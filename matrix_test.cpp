@@ -0,0 +1,361 @@
+/**
+ * @file    matrix_test.cpp
+ * @author  Jinwook Jung (jinwookjung@kaist.ac.kr)
+ * @date    2017-10-18 17:05:12
+ * @brief   Checks of the Matrix extensions that matrix_bench does not run.
+ *
+ * Instantiates MatrixView, SparseMatrix, MatrixWriter/MappedMatrix, the
+ * solvers of matrix_solve.h and SmallMatrixBatch, and compares each
+ * against a plain dense computation: residuals of the solves, sparse
+ * against dense products, a file round trip and the batch against
+ * SmallMatrix products. Prints every failed check and exits with 1 if
+ * there is any.
+ *
+ * Build: g++ -std=c++11 -O2 -pthread matrix_test.cpp -o matrix_test
+ *
+ * Usage: matrix_test [directory for temporary files]
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <stdexcept>
+#include <cmath>
+#include <cstdio>
+#include <unistd.h>
+#include "matrix.h"
+#include "matrix_io.h"
+#include "matrix_solve.h"
+#include "small_matrix.h"
+
+using namespace std;
+
+static size_t num_failed = 0;
+
+static void check (bool ok, const string& what)
+{
+    if (!ok) {
+        cerr << "FAILED: " << what << endl;
+        num_failed++;
+    }
+}
+
+
+/**
+ * A num_rows x num_cols matrix of small integers, so that sums and
+ * products are exact in any order; density is the chance of a nonzero.
+ */
+template <typename T>
+static Matrix<T> random_matrix (size_t num_rows, size_t num_cols,
+                                mt19937& rng, double density = 1.0)
+{
+    uniform_int_distribution<int> value(-4, 4);
+    bernoulli_distribution nonzero(density);
+    Matrix<T> m(num_rows, num_cols);
+    for (size_t i = 0; i < num_rows; i++) {
+        for (size_t j = 0; j < num_cols; j++) {
+            m(i, j) = nonzero(rng) ? static_cast<T>(value(rng)) : T(0);
+        }
+    }
+    return m;
+}
+
+/**
+ * The largest |a(i, j) - b(i, j)|.
+ */
+template <typename L, typename R>
+static double max_difference (const L& a, const R& b)
+{
+    double d = 0;
+    for (size_t i = 0; i < a.get_num_rows(); i++) {
+        for (size_t j = 0; j < a.get_num_cols(); j++) {
+            d = max(d, fabs(static_cast<double>(a(i, j)) - static_cast<double>(b(i, j))));
+        }
+    }
+    return d;
+}
+
+/**
+ * max |a*x - b| relative to the size of a*x.
+ */
+static double residual (const Matrix<double>& a, const Matrix<double>& x,
+                        const Matrix<double>& b)
+{
+    Matrix<double> ax = a*x;
+    double scale = 1;
+    for (size_t i = 0; i < ax.get_num_rows(); i++) {
+        for (size_t j = 0; j < ax.get_num_cols(); j++) {
+            scale = max(scale, fabs(ax(i, j)));
+        }
+    }
+    return max_difference(ax, b) / scale;
+}
+
+
+static void test_view (mt19937& rng)
+{
+    Matrix<double> a = random_matrix<double>(37, 53, rng);
+    Matrix<double> b = random_matrix<double>(37, 29, rng);
+
+    Matrix<double> at(53, 37);
+    for (size_t i = 0; i < 37; i++) {
+        for (size_t j = 0; j < 53; j++) {
+            at(j, i) = a(i, j);
+        }
+    }
+    check(Matrix<double>(a.transpose()) == at, "view: transpose");
+    check(a.transpose()*b == at*b, "view: product with a transposed view");
+
+    MatrixView<const double> blk = a.block(3, 5, 10, 20);
+    check(blk(2, 7) == a(5, 12) && blk.transpose()(7, 2) == a(5, 12), "view: block");
+    check(Matrix<double>(blk.rows(1, 4).cols(2, 6))(0, 0) == a(4, 7), "view: rows and cols");
+
+    Matrix<double> c = a;
+    c.block(1, 1, 4, 4) = 2.0*a.block(0, 0, 4, 4);
+    check(c(1, 1) == 2*a(0, 0) && c(4, 4) == 2*a(3, 3) && c(0, 0) == a(0, 0),
+          "view: assignment writes through");
+
+    bool threw = false;
+    try {
+        a.block(30, 0, 10, 1);
+    } catch (const out_of_range&) {
+        threw = true;
+    }
+    check(threw, "view: out-of-range block throws");
+}
+
+
+template <SparseFormat F>
+static void test_sparse_format (mt19937& rng, const string& name)
+{
+    Matrix<double> dense = random_matrix<double>(200, 150, rng, 0.05);
+    SparseMatrix<double, F> s(dense);
+    check(s.to_dense() == dense, name + ": dense round trip");
+    check(s(17, 23) == dense(17, 23), name + ": element");
+
+    vector<double> x(150);
+    for (size_t j = 0; j < x.size(); j++) {
+        x[j] = static_cast<double>(j % 7) - 3;
+    }
+    vector<double> y = s*x;
+    bool ok = y.size() == 200;
+    for (size_t i = 0; ok && i < 200; i++) {
+        double yi = 0;
+        for (size_t j = 0; j < 150; j++) {
+            yi += dense(i, j)*x[j];
+        }
+        ok = (y[i] == yi);
+    }
+    check(ok, name + ": SpMV");
+
+    Matrix<double> b = random_matrix<double>(150, 40, rng);
+    check(s*b == dense*b, name + ": SpMM");
+    check(s.transpose().to_dense() == Matrix<double>(dense.transpose()),
+          name + ": transpose");
+
+    SparseMatrix<double, SparseMatrix<double, F>::other_format> other(s);
+    check(other.to_dense() == dense, name + ": format conversion");
+}
+
+static void test_sparse (mt19937& rng)
+{
+    test_sparse_format<SparseFormat::csr>(rng, "csr");
+    test_sparse_format<SparseFormat::csc>(rng, "csc");
+
+    vector<Triplet<double>> triplets = { {2, 1, 1.0}, {0, 3, 2.0}, {2, 1, 3.0} };
+    CsrMatrix<double> s(3, 4, triplets);
+    check(s.get_num_nonzeros() == 2 && s(2, 1) == 4.0 && s(0, 3) == 2.0 && s(1, 1) == 0.0,
+          "sparse: duplicate triplets are summed");
+}
+
+
+static void test_io (mt19937& rng, const string& dir)
+{
+    const string path = dir + "/matrix_test.mat";
+    Matrix<float> a = random_matrix<float>(123, 45, rng);
+
+    save_matrix(path, a);
+    {
+        MappedMatrix<float> m(path, true);
+        check(m.verify(), "io: checksum");
+        check(Matrix<float>(m) == a, "io: round trip");
+        check(Matrix<float>(m.view().transpose()) == Matrix<float>(a.transpose()),
+              "io: mapped view");
+    }
+
+    // Row by row, as a result that does not fit in memory would be.
+    {
+        MatrixWriter<float> w(path, a.get_num_rows(), a.get_num_cols());
+        for (size_t i = 0; i < a.get_num_rows(); i++) {
+            w.write(&a(i, 0), a.get_num_cols());
+        }
+        w.close();
+    }
+    check(Matrix<float>(MappedMatrix<float>(path, true)) == a, "io: row by row");
+
+    bool threw = false;
+    try {
+        MappedMatrix<double> m(path);
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    check(threw, "io: wrong element type throws");
+
+    // A writer that goes away early leaves a truncated file.
+    {
+        MatrixWriter<float> w(path, a.get_num_rows(), a.get_num_cols());
+        w.write(a.data(), a.get_num_cols());
+    }
+    threw = false;
+    try {
+        MappedMatrix<float> m(path);
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    check(threw, "io: truncated file throws");
+
+    // All the data, but no close(): the header is not final.
+    {
+        MatrixWriter<float> w(path, a.get_num_rows(), a.get_num_cols());
+        w.write(a);
+    }
+    threw = false;
+    try {
+        MappedMatrix<float> m(path);
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    check(threw, "io: unclosed file throws");
+
+    // Flip one element; the header still describes a valid file.
+    save_matrix(path, a);
+    FILE* f = fopen(path.c_str(), "r+b");
+    if (f) {
+        float x = a(0, 0) + 1;
+        fseek(f, 64, SEEK_SET);
+        fwrite(&x, sizeof(x), 1, f);
+        fclose(f);
+    }
+    check(f && !MappedMatrix<float>(path).verify(), "io: checksum mismatch");
+
+    unlink(path.c_str());
+}
+
+
+static void test_solve (mt19937& rng)
+{
+    // Larger than matrix_kernel::solve_block_size, so the blocked paths run.
+    const size_t n = 300;
+    uniform_real_distribution<double> value(-1, 1);
+    Matrix<double> a(n, n), b(n, 7);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            a(i, j) = value(rng);
+        }
+        for (size_t j = 0; j < 7; j++) {
+            b(i, j) = value(rng);
+        }
+    }
+
+    LuDecomposition<double> lu(a);
+    check(residual(a, lu.solve(b), b) < 1e-10, "lu: residual");
+    check(residual(a, solve(a, b), b) < 1e-10, "solve: residual");
+
+    Matrix<double> d(3, 3);
+    d(0, 0) = 0; d(0, 1) = 2; d(0, 2) = 1;
+    d(1, 0) = 1; d(1, 1) = 1; d(1, 2) = 1;
+    d(2, 0) = 2; d(2, 1) = 1; d(2, 2) = 3;
+    check(fabs(LuDecomposition<double>(d).determinant() + 3) < 1e-12, "lu: determinant");
+
+    bool threw = false;
+    try {
+        LuDecomposition<double> singular(Matrix<double>(4, 4, 1.0));
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    check(threw, "lu: singular matrix throws");
+
+    // a*a^T + n*I is symmetric positive definite.
+    Matrix<double> spd = a*a.transpose();
+    for (size_t i = 0; i < n; i++) {
+        spd(i, i) += n;
+    }
+    CholeskyDecomposition<double> chol(spd);
+    check(residual(spd, chol.solve(b), b) < 1e-10, "cholesky: residual");
+    check(max_difference(chol.get_l()*chol.get_l().transpose(), spd) < 1e-9*n,
+          "cholesky: l*l^T");
+
+    // The lower triangle of lu is a unit lower triangular matrix, and its
+    // transpose an upper one.
+    Matrix<double> l(n, n);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < i; j++) {
+            l(i, j) = lu.get_lu()(i, j);
+        }
+        l(i, i) = 1;
+    }
+    Matrix<double> x = b;
+    solve_triangular(lu.get_lu().view(), x.view(), Triangle::lower, true);
+    check(residual(l, x, b) < 1e-10, "solve_triangular: lower");
+    x = b;
+    solve_triangular(lu.get_lu().transpose(), x.view(), Triangle::upper, true);
+    check(residual(Matrix<double>(l.transpose()), x, b) < 1e-10, "solve_triangular: upper");
+}
+
+
+static void test_batch (mt19937& rng)
+{
+    // Not a multiple of the lanes, so the last block is padded.
+    const size_t size = 37;
+    vector<Matrix<double>> as, bs;
+    for (size_t i = 0; i < size; i++) {
+        as.push_back(random_matrix<double>(3, 4, rng));
+        bs.push_back(random_matrix<double>(4, 2, rng));
+    }
+    SmallMatrixBatch<double, 3, 4> a(as);
+    SmallMatrixBatch<double, 4, 2> b(bs);
+
+    SmallMatrixBatch<double, 3, 2> c = a*b;
+    SmallMatrixBatch<double, 4, 3> at = a.transpose();
+    SmallMatrixBatch<double, 3, 4> s = a + a;
+    s -= a;
+    s *= 2.0;
+
+    bool product_ok = c.size() == size, transpose_ok = true, sum_ok = true;
+    for (size_t i = 0; i < size; i++) {
+        SmallMatrix<double, 3, 4> ai = a.get(i);
+        product_ok = product_ok && (Matrix<double>(c.get(i)) == Matrix<double>(ai*b.get(i)));
+        transpose_ok = transpose_ok && (Matrix<double>(at.get(i)) == Matrix<double>(ai.transpose()));
+        sum_ok = sum_ok && (Matrix<double>(s.get(i)) == Matrix<double>(2.0*as[i]));
+    }
+    check(Matrix<double>(a.get(5)) == as[5], "batch: get");
+    check(product_ok, "batch: product");
+    check(transpose_ok, "batch: transpose");
+    check(sum_ok, "batch: element-wise");
+    check(c.to_matrices().size() == size, "batch: to_matrices");
+}
+
+
+int main (int argc, char* argv[])
+{
+    string dir = (argc > 1) ? argv[1] : ".";
+    mt19937 rng(1);
+
+    // Results must not depend on the number of threads.
+    for (size_t t : { size_t(1), size_t(4) }) {
+        matrix_kernel::set_num_threads(t);
+        test_view(rng);
+        test_sparse(rng);
+        test_io(rng, dir);
+        test_solve(rng);
+        test_batch(rng);
+    }
+
+    if (num_failed > 0) {
+        cerr << num_failed << " checks failed." << endl;
+        return 1;
+    }
+    cout << "All checks passed." << endl;
+    return 0;
+}
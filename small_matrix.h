@@ -0,0 +1,678 @@
+/**
+ * @file    small_matrix.h
+ * @author  Jinwook Jung (jinwookjung@kaist.ac.kr)
+ * @date    2017-10-18 17:05:12
+ *
+ * Matrices whose dimensions are known at compile time.
+ */
+
+#ifndef SMALL_MATRIX_H
+#define SMALL_MATRIX_H
+
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <stdexcept>
+#include <iostream>
+#include "matrix.h"
+
+#if defined(__GNUC__)
+#define MATRIX_FORCE_INLINE __attribute__((always_inline))
+#else
+#define MATRIX_FORCE_INLINE
+#endif
+
+namespace matrix_kernel
+{
+
+/**
+ * Call f(0), ..., f(N - 1), unrolled at compile time. GCC does not unroll
+ * even 4x4 loop nests at -O2, nor inline a chain of calls this deep, so
+ * run() and the lambdas passed to it are marked MATRIX_FORCE_INLINE.
+ */
+template <size_t N>
+struct Unroll
+{
+    template <typename F>
+    static inline MATRIX_FORCE_INLINE void run (F& f) {
+        Unroll<N - 1>::run(f);
+        f(N - 1);
+    }
+};
+
+template <>
+struct Unroll<0>
+{
+    template <typename F>
+    static inline MATRIX_FORCE_INLINE void run (F&) {}
+};
+
+}   // End of namespace matrix_kernel
+
+
+/**
+ * An R x C matrix stored in place, for the 2x2 to 4x4 transforms that
+ * would otherwise each allocate a Matrix.
+ *
+ * Every operation is unrolled, and operands of mismatched dimensions do
+ * not compile. A SmallMatrix is a MatrixExpr, so it converts to Matrix<T>
+ * and mixes with Matrix<T> in element-wise expressions; going the other
+ * way checks the dimensions at run time.
+ */
+template <typename T, size_t R, size_t C>
+class SmallMatrix : public MatrixExpr<SmallMatrix<T, R, C>>
+{
+public:
+    typedef T value_type;
+
+    /**
+     * A matrix of zeros, or of value.
+     */
+    SmallMatrix () : values_() {}
+    explicit SmallMatrix (const T& value) { values_.fill(value); }
+
+    /**
+     * All R*C elements in row-major order, e.g.
+     * SmallMatrix<double, 2, 2> m(1, 2, 3, 4).
+     */
+    template <typename... Args>
+    SmallMatrix (const T& v0, const T& v1, const Args&... vs)
+        : values_{{v0, v1, static_cast<T>(vs)...}} {
+        static_assert(sizeof...(Args) + 2 == R*C, "wrong number of elements");
+    }
+
+    /**
+     * Copy a Matrix<T> or evaluate an expression of size R x C.
+     */
+    template <typename E>
+    explicit SmallMatrix (const MatrixExpr<E>& expr) {
+        const E& e = expr.self();
+        if (e.get_num_rows() != R || e.get_num_cols() != C) {
+            throw std::logic_error ("different size");
+        }
+        auto f = [&](size_t i) MATRIX_FORCE_INLINE { values_[i] = e.eval(i, i / C, i % C); };
+        matrix_kernel::Unroll<R*C>::run(f);
+    }
+
+    static SmallMatrix identity () {
+        static_assert(R == C, "identity of a non-square matrix");
+        SmallMatrix ret;
+        auto f = [&](size_t i) MATRIX_FORCE_INLINE { ret.values_[i*C + i] = T(1); };
+        matrix_kernel::Unroll<R>::run(f);
+        return ret;
+    }
+
+    constexpr size_t get_num_rows () const { return R; }
+    constexpr size_t get_num_cols () const { return C; }
+    const T operator() (size_t row, size_t col) const { return values_[row*C + col]; }
+    T& operator() (size_t row, size_t col) { return values_[row*C + col]; }
+
+    /**
+     * Elements in row-major order.
+     */
+    T* data () { return values_.data(); }
+    const T* data () const { return values_.data(); }
+
+    /**
+     * The expression interface. A SmallMatrix cannot be the destination
+     * of a Matrix expression, so it never conflicts with one.
+     */
+    T eval (size_t i, size_t, size_t) const { return values_[i]; }
+    bool conflicts (const matrix_kernel::Extent&) const { return false; }
+
+    SmallMatrix<T, C, R> transpose () const {
+        SmallMatrix<T, C, R> ret;
+        auto f = [&](size_t i) MATRIX_FORCE_INLINE { ret(i % C, i / C) = values_[i]; };
+        matrix_kernel::Unroll<R*C>::run(f);
+        return ret;
+    }
+
+    SmallMatrix& operator+= (const T& rhs) {
+        auto f = [&](size_t i) MATRIX_FORCE_INLINE { values_[i] += rhs; };
+        matrix_kernel::Unroll<R*C>::run(f);
+        return *this;
+    }
+    SmallMatrix& operator-= (const T& rhs) {
+        auto f = [&](size_t i) MATRIX_FORCE_INLINE { values_[i] -= rhs; };
+        matrix_kernel::Unroll<R*C>::run(f);
+        return *this;
+    }
+    SmallMatrix& operator*= (const T& rhs) {
+        auto f = [&](size_t i) MATRIX_FORCE_INLINE { values_[i] *= rhs; };
+        matrix_kernel::Unroll<R*C>::run(f);
+        return *this;
+    }
+
+    SmallMatrix& operator+= (const SmallMatrix& rhs) {
+        auto f = [&](size_t i) MATRIX_FORCE_INLINE { values_[i] += rhs.values_[i]; };
+        matrix_kernel::Unroll<R*C>::run(f);
+        return *this;
+    }
+    SmallMatrix& operator-= (const SmallMatrix& rhs) {
+        auto f = [&](size_t i) MATRIX_FORCE_INLINE { values_[i] -= rhs.values_[i]; };
+        matrix_kernel::Unroll<R*C>::run(f);
+        return *this;
+    }
+    SmallMatrix& operator*= (const SmallMatrix<T, C, C>& rhs);
+
+private:
+    std::array<T, R*C> values_;     ///< Element values, row-major.
+};
+
+
+//-----------------------------------------------------------------------------
+// Operators
+//
+// The operators on two SmallMatrix operands take any dimensions and check
+// them with static_assert, so a mismatch is a compile error rather than a
+// fallback to the run-time checked Matrix expressions.
+//-----------------------------------------------------------------------------
+template <typename T, size_t R, size_t C, size_t R2, size_t C2>
+SmallMatrix<T, R, C> operator+ (const SmallMatrix<T, R, C>& lhs,
+                                const SmallMatrix<T, R2, C2>& rhs)
+{
+    static_assert(R == R2 && C == C2, "different size");
+    SmallMatrix<T, R, C> ret(lhs);
+    ret += rhs;
+    return ret;
+}
+
+template <typename T, size_t R, size_t C, size_t R2, size_t C2>
+SmallMatrix<T, R, C> operator- (const SmallMatrix<T, R, C>& lhs,
+                                const SmallMatrix<T, R2, C2>& rhs)
+{
+    static_assert(R == R2 && C == C2, "different size");
+    SmallMatrix<T, R, C> ret(lhs);
+    ret -= rhs;
+    return ret;
+}
+
+template <typename T, size_t R, size_t K, size_t K2, size_t C>
+SmallMatrix<T, R, C> operator* (const SmallMatrix<T, R, K>& lhs,
+                                const SmallMatrix<T, K2, C>& rhs)
+{
+    static_assert(K == K2, "lhs.num_cols != rhs.num_rows");
+    SmallMatrix<T, R, C> ret;
+    auto f = [&](size_t i) MATRIX_FORCE_INLINE {
+        size_t row = i / C, col = i % C;
+        T sum = T(0);
+        auto g = [&](size_t k) MATRIX_FORCE_INLINE { sum += lhs(row, k) * rhs(k, col); };
+        matrix_kernel::Unroll<K>::run(g);
+        ret(row, col) = sum;
+    };
+    matrix_kernel::Unroll<R*C>::run(f);
+    return ret;
+}
+
+template <typename T, size_t R, size_t C>
+SmallMatrix<T, R, C>& SmallMatrix<T, R, C>::operator*= (const SmallMatrix<T, C, C>& rhs)
+{
+    return *this = *this * rhs;
+}
+
+// The scalar type is taken from the matrix, as for Matrix.
+template <typename T, size_t R, size_t C>
+SmallMatrix<T, R, C> operator+ (const typename SmallMatrix<T, R, C>::value_type& lhs,
+                                const SmallMatrix<T, R, C>& rhs)
+{
+    SmallMatrix<T, R, C> ret(rhs);
+    ret += lhs;
+    return ret;
+}
+
+template <typename T, size_t R, size_t C>
+SmallMatrix<T, R, C> operator- (const typename SmallMatrix<T, R, C>::value_type& lhs,
+                                const SmallMatrix<T, R, C>& rhs)
+{
+    SmallMatrix<T, R, C> ret(lhs);
+    ret -= rhs;
+    return ret;
+}
+
+template <typename T, size_t R, size_t C>
+SmallMatrix<T, R, C> operator* (const typename SmallMatrix<T, R, C>::value_type& lhs,
+                                const SmallMatrix<T, R, C>& rhs)
+{
+    SmallMatrix<T, R, C> ret(rhs);
+    ret *= lhs;
+    return ret;
+}
+
+template <typename T, size_t R, size_t C>
+SmallMatrix<T, R, C> operator+ (const SmallMatrix<T, R, C>& lhs,
+                                const typename SmallMatrix<T, R, C>::value_type& rhs)
+{
+    SmallMatrix<T, R, C> ret(lhs);
+    ret += rhs;
+    return ret;
+}
+
+template <typename T, size_t R, size_t C>
+SmallMatrix<T, R, C> operator- (const SmallMatrix<T, R, C>& lhs,
+                                const typename SmallMatrix<T, R, C>::value_type& rhs)
+{
+    SmallMatrix<T, R, C> ret(lhs);
+    ret -= rhs;
+    return ret;
+}
+
+template <typename T, size_t R, size_t C>
+SmallMatrix<T, R, C> operator* (const SmallMatrix<T, R, C>& lhs,
+                                const typename SmallMatrix<T, R, C>::value_type& rhs)
+{
+    SmallMatrix<T, R, C> ret(lhs);
+    ret *= rhs;
+    return ret;
+}
+
+
+template <typename T, size_t R, size_t C>
+bool operator== (const SmallMatrix<T, R, C>& lhs, const SmallMatrix<T, R, C>& rhs)
+{
+    bool equal = true;
+    auto f = [&](size_t i) MATRIX_FORCE_INLINE { equal = equal && lhs.data()[i] == rhs.data()[i]; };
+    matrix_kernel::Unroll<R*C>::run(f);
+    return equal;
+}
+
+template <typename T, size_t R, size_t C>
+bool operator!= (const SmallMatrix<T, R, C>& lhs, const SmallMatrix<T, R, C>& rhs)
+{
+    return !(lhs == rhs);
+}
+
+
+template <typename T, size_t R, size_t C>
+std::ostream& operator<< (std::ostream& os, const SmallMatrix<T, R, C>& matrix)
+{
+    for (size_t i = 0; i < R; i++) {
+        for (size_t j = 0; j < C; j++) {
+            os << matrix(i,j) << " ";
+        }
+        os << "\n";
+    }
+    return os;
+}
+
+
+/**
+ * size SmallMatrix<T, R, C>s stored interleaved, for running the same
+ * operation on millions of small matrices.
+ *
+ * The matrices are grouped in blocks of `lanes` (a cache line of T each);
+ * a block holds element (0, 0) of all its matrices, then element (0, 1),
+ * and so on. An operation on a block is then a sequence of operations on
+ * whole cache lines, one SIMD lane per matrix, and blocks are split
+ * across threads. The last block is padded with zero matrices.
+ *
+ * Alloc must give cache-line aligned storage, as all the allocators of
+ * allocator.h do. For batches built over and over, PoolAllocator saves
+ * faulting in fresh pages for every result.
+ */
+template <typename T, size_t R, size_t C, typename Alloc = AlignedAllocator<T>>
+class SmallMatrixBatch
+{
+public:
+    typedef T value_type;
+    typedef Alloc allocator_type;
+
+    static const size_t lanes = (sizeof(T) < 64) ? 64 / sizeof(T) : 1;
+    static const size_t block_size = R*C*lanes;     ///< Elements per block.
+
+    /**
+     * size matrices of zeros.
+     */
+    explicit SmallMatrixBatch (size_t size = 0)
+        : size_(size), values_(get_num_blocks(size)*block_size, T(0)) {}
+
+    /**
+     * Copies of matrices, which must all be R x C.
+     */
+    template <typename B>
+    explicit SmallMatrixBatch (const std::vector<Matrix<T, B>>& matrices);
+
+    SmallMatrixBatch (const SmallMatrixBatch& b);
+    SmallMatrixBatch (SmallMatrixBatch&& b) = default;
+    SmallMatrixBatch& operator= (const SmallMatrixBatch& b) = default;
+    SmallMatrixBatch& operator= (SmallMatrixBatch&& b) = default;
+
+    /**
+     * A batch whose elements, padding included, are left for the caller
+     * to write.
+     */
+    static SmallMatrixBatch uninitialized (size_t size);
+
+    size_t size () const { return size_; }
+    size_t get_num_blocks () const { return get_num_blocks(size_); }
+
+    /**
+     * Element (row, col) of matrix i.
+     */
+    T& operator() (size_t i, size_t row, size_t col) { 
+        return values_[get_index(i, row, col)]; 
+    }
+    const T operator() (size_t i, size_t row, size_t col) const { 
+        return values_[get_index(i, row, col)]; 
+    }
+
+    SmallMatrix<T, R, C> get (size_t i) const;
+    void set (size_t i, const SmallMatrix<T, R, C>& matrix);
+    std::vector<Matrix<T>> to_matrices () const;
+
+    /**
+     * The elements of block b, see above. Blocks are cache-line aligned.
+     */
+    T* get_block (size_t b) { return values_.data() + b*block_size; }
+    const T* get_block (size_t b) const { return values_.data() + b*block_size; }
+
+    SmallMatrixBatch<T, C, R, Alloc> transpose () const;
+
+    SmallMatrixBatch& operator+= (const SmallMatrixBatch& rhs);
+    SmallMatrixBatch& operator-= (const SmallMatrixBatch& rhs);
+    SmallMatrixBatch& operator*= (const T& rhs);
+
+private:
+    size_t size_;
+    std::vector<T, Alloc> values_;
+
+    struct Uninitialized {};
+    SmallMatrixBatch (size_t size, Uninitialized)
+        : size_(size), values_(get_num_blocks(size)*block_size) {}
+
+    static size_t get_num_blocks (size_t size) { return (size + lanes - 1) / lanes; }
+    static size_t get_index (size_t i, size_t row, size_t col) {
+        return (i / lanes)*block_size + (row*C + col)*lanes + i % lanes;
+    }
+};
+
+template <typename T, size_t R, size_t C, typename A>
+const size_t SmallMatrixBatch<T, R, C, A>::lanes;
+template <typename T, size_t R, size_t C, typename A>
+const size_t SmallMatrixBatch<T, R, C, A>::block_size;
+
+
+namespace matrix_kernel
+{
+
+/**
+ * f(b) for each of num_blocks blocks of block_size elements, in parallel.
+ */
+template <typename F>
+void for_each_block (size_t num_blocks, size_t block_size, F f)
+{
+    size_t grain = std::max<size_t>(1, (size_t(1) << 14) / block_size);
+    parallel_for(0, num_blocks, grain, [&](size_t begin, size_t end) {
+        for (size_t b = begin; b < end; b++) {
+            f(b);
+        }
+    });
+}
+
+/**
+ * Products of the matrices of a SmallMatrixBatch block: z = x*y, x being
+ * R x K and y K x C, each element a row of `Lanes` values.
+ */
+template <typename T, size_t Lanes, 
+          bool = std::is_arithmetic<T>::value && sizeof(T) <= 8 && Lanes*sizeof(T) == 64>
+struct BatchKernel
+{
+    template <size_t R, size_t K, size_t C>
+    static void multiply (const T* x, const T* y, T* z) {
+        for (size_t row = 0; row < R; row++) {
+            for (size_t col = 0; col < C; col++) {
+                T* zc = z + (row*C + col)*Lanes;
+                std::fill(zc, zc + Lanes, T(0));
+                for (size_t k = 0; k < K; k++) {
+                    const T* xk = x + (row*K + k)*Lanes;
+                    const T* yk = y + (k*C + col)*Lanes;
+                    for (size_t l = 0; l < Lanes; l++) {
+                        zc[l] += xk[l]*yk[l];
+                    }
+                }
+            }
+        }
+    }
+};
+
+#if defined(__GNUC__)
+/**
+ * With GCC vector extensions, an element row is one vector, which GCC
+ * keeps in registers across the sum; a scalar loop over the lanes is
+ * stored back on every term, which halves the throughput.
+ */
+template <typename T, size_t Lanes>
+struct BatchKernel<T, Lanes, true>
+{
+    typedef T Vector __attribute__((vector_size(64)));
+
+    template <size_t R, size_t K, size_t C>
+    static void multiply (const T* x, const T* y, T* z) {
+        const Vector* xv = reinterpret_cast<const Vector*>(x);
+        const Vector* yv = reinterpret_cast<const Vector*>(y);
+        Vector* zv = reinterpret_cast<Vector*>(z);
+        for (size_t row = 0; row < R; row++) {
+            for (size_t col = 0; col < C; col++) {
+                Vector sum = xv[row*K]*yv[col];
+                auto f = [&](size_t k) MATRIX_FORCE_INLINE {
+                    sum += xv[row*K + k + 1]*yv[(k + 1)*C + col];
+                };
+                Unroll<K - 1>::run(f);
+                zv[row*C + col] = sum;
+            }
+        }
+    }
+};
+#endif
+
+}   // End of namespace matrix_kernel
+
+
+template <typename T, size_t R, size_t C, typename A>
+template <typename B>
+SmallMatrixBatch<T, R, C, A>::SmallMatrixBatch (const std::vector<Matrix<T, B>>& matrices)
+    : SmallMatrixBatch(matrices.size())
+{
+    for (size_t i = 0; i < size_; i++) {
+        const Matrix<T, B>& m = matrices[i];
+        if (m.get_num_rows() != R || m.get_num_cols() != C) {
+            throw std::logic_error ("different size");
+        }
+        T* p = values_.data() + get_index(i, 0, 0);
+        for (size_t e = 0; e < R*C; e++) {
+            p[e*lanes] = m.data()[e];
+        }
+    }
+}
+
+
+// A vector with a custom allocator copies element by element; copy the
+// whole buffer instead.
+template <typename T, size_t R, size_t C, typename A>
+SmallMatrixBatch<T, R, C, A>::SmallMatrixBatch (const SmallMatrixBatch& b)
+    : size_(b.size_), values_(b.values_.size())
+{
+    std::copy(b.values_.begin(), b.values_.end(), values_.begin());
+}
+
+
+template <typename T, size_t R, size_t C, typename A>
+SmallMatrixBatch<T, R, C, A> SmallMatrixBatch<T, R, C, A>::uninitialized (size_t size)
+{
+    return SmallMatrixBatch(size, Uninitialized());
+}
+
+
+template <typename T, size_t R, size_t C, typename A>
+SmallMatrix<T, R, C> SmallMatrixBatch<T, R, C, A>::get (size_t i) const
+{
+    SmallMatrix<T, R, C> ret;
+    const T* p = values_.data() + get_index(i, 0, 0);
+    auto f = [&](size_t e) MATRIX_FORCE_INLINE { ret.data()[e] = p[e*lanes]; };
+    matrix_kernel::Unroll<R*C>::run(f);
+    return ret;
+}
+
+
+template <typename T, size_t R, size_t C, typename A>
+void SmallMatrixBatch<T, R, C, A>::set (size_t i, const SmallMatrix<T, R, C>& matrix)
+{
+    T* p = values_.data() + get_index(i, 0, 0);
+    auto f = [&](size_t e) MATRIX_FORCE_INLINE { p[e*lanes] = matrix.data()[e]; };
+    matrix_kernel::Unroll<R*C>::run(f);
+}
+
+
+template <typename T, size_t R, size_t C, typename A>
+std::vector<Matrix<T>> SmallMatrixBatch<T, R, C, A>::to_matrices () const
+{
+    std::vector<Matrix<T>> ret;
+    ret.reserve(size_);
+    for (size_t i = 0; i < size_; i++) {
+        Matrix<T> m = Matrix<T>::uninitialized(R, C);
+        const T* p = values_.data() + get_index(i, 0, 0);
+        for (size_t e = 0; e < R*C; e++) {
+            m.data()[e] = p[e*lanes];
+        }
+        ret.push_back(std::move(m));
+    }
+    return ret;
+}
+
+
+template <typename T, size_t R, size_t C, typename A>
+SmallMatrixBatch<T, C, R, A> SmallMatrixBatch<T, R, C, A>::transpose () const
+{
+    // Transposing every matrix of a block only moves whole element rows.
+    SmallMatrixBatch<T, C, R, A> ret = SmallMatrixBatch<T, C, R, A>::uninitialized(size_);
+    matrix_kernel::for_each_block(get_num_blocks(), block_size, [&](size_t b) {
+        const T* src = get_block(b);
+        T* dst = ret.get_block(b);
+        for (size_t row = 0; row < R; row++) {
+            for (size_t col = 0; col < C; col++) {
+                std::copy(src + (row*C + col)*lanes, src + (row*C + col + 1)*lanes,
+                          dst + (col*R + row)*lanes);
+            }
+        }
+    });
+    return ret;
+}
+
+
+template <typename T, size_t R, size_t C, typename A>
+SmallMatrixBatch<T, R, C, A>& SmallMatrixBatch<T, R, C, A>::operator+= (const SmallMatrixBatch& rhs)
+{
+    if (size_ != rhs.size_) {
+        throw std::logic_error ("different size");
+    }
+    T* x = values_.data();
+    const T* y = rhs.values_.data();
+    matrix_kernel::for_each_block(get_num_blocks(), block_size, [=](size_t b) {
+        for (size_t j = b*block_size; j < (b + 1)*block_size; j++) {
+            x[j] += y[j];
+        }
+    });
+    return *this;
+}
+
+
+template <typename T, size_t R, size_t C, typename A>
+SmallMatrixBatch<T, R, C, A>& SmallMatrixBatch<T, R, C, A>::operator-= (const SmallMatrixBatch& rhs)
+{
+    if (size_ != rhs.size_) {
+        throw std::logic_error ("different size");
+    }
+    T* x = values_.data();
+    const T* y = rhs.values_.data();
+    matrix_kernel::for_each_block(get_num_blocks(), block_size, [=](size_t b) {
+        for (size_t j = b*block_size; j < (b + 1)*block_size; j++) {
+            x[j] -= y[j];
+        }
+    });
+    return *this;
+}
+
+
+template <typename T, size_t R, size_t C, typename A>
+SmallMatrixBatch<T, R, C, A>& SmallMatrixBatch<T, R, C, A>::operator*= (const T& rhs)
+{
+    T* x = values_.data();
+    matrix_kernel::for_each_block(get_num_blocks(), block_size, [=](size_t b) {
+        for (size_t j = b*block_size; j < (b + 1)*block_size; j++) {
+            x[j] *= rhs;
+        }
+    });
+    return *this;
+}
+
+
+// As for SmallMatrix, mismatched dimensions do not compile; the number of
+// matrices is checked at run time.
+template <typename T, size_t R, size_t C, size_t R2, size_t C2, typename A>
+SmallMatrixBatch<T, R, C, A> operator+ (const SmallMatrixBatch<T, R, C, A>& lhs,
+                                        const SmallMatrixBatch<T, R2, C2, A>& rhs)
+{
+    static_assert(R == R2 && C == C2, "different size");
+    if (lhs.size() != rhs.size()) {
+        throw std::logic_error ("different size");
+    }
+
+    const size_t block_size = SmallMatrixBatch<T, R, C, A>::block_size;
+    SmallMatrixBatch<T, R, C, A> ret = SmallMatrixBatch<T, R, C, A>::uninitialized(lhs.size());
+    matrix_kernel::for_each_block(ret.get_num_blocks(), block_size, [&](size_t b) {
+        const T* x = lhs.get_block(b);
+        const T* y = rhs.get_block(b);
+        T* z = ret.get_block(b);
+        for (size_t j = 0; j < block_size; j++) {
+            z[j] = x[j] + y[j];
+        }
+    });
+    return ret;
+}
+
+template <typename T, size_t R, size_t C, size_t R2, size_t C2, typename A>
+SmallMatrixBatch<T, R, C, A> operator- (const SmallMatrixBatch<T, R, C, A>& lhs,
+                                        const SmallMatrixBatch<T, R2, C2, A>& rhs)
+{
+    static_assert(R == R2 && C == C2, "different size");
+    if (lhs.size() != rhs.size()) {
+        throw std::logic_error ("different size");
+    }
+
+    const size_t block_size = SmallMatrixBatch<T, R, C, A>::block_size;
+    SmallMatrixBatch<T, R, C, A> ret = SmallMatrixBatch<T, R, C, A>::uninitialized(lhs.size());
+    matrix_kernel::for_each_block(ret.get_num_blocks(), block_size, [&](size_t b) {
+        const T* x = lhs.get_block(b);
+        const T* y = rhs.get_block(b);
+        T* z = ret.get_block(b);
+        for (size_t j = 0; j < block_size; j++) {
+            z[j] = x[j] - y[j];
+        }
+    });
+    return ret;
+}
+
+/**
+ * The products of the matrices of lhs and rhs, pair by pair.
+ */
+template <typename T, size_t R, size_t K, size_t K2, size_t C, typename A>
+SmallMatrixBatch<T, R, C, A> operator* (const SmallMatrixBatch<T, R, K, A>& lhs,
+                                        const SmallMatrixBatch<T, K2, C, A>& rhs)
+{
+    static_assert(K == K2, "lhs.num_cols != rhs.num_rows");
+    if (lhs.size() != rhs.size()) {
+        throw std::logic_error ("different size");
+    }
+
+    typedef SmallMatrixBatch<T, R, C, A> Batch;
+    typedef matrix_kernel::BatchKernel<T, Batch::lanes> Kernel;
+    Batch ret = Batch::uninitialized(lhs.size());
+    matrix_kernel::for_each_block(ret.get_num_blocks(), Batch::block_size,
+                                  [&](size_t b) {
+        Kernel::template multiply<R, K, C>(lhs.get_block(b), rhs.get_block(b), 
+                                           ret.get_block(b));
+    });
+    return ret;
+}
+
+#endif
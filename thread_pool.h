@@ -0,0 +1,238 @@
+/**
+ * @file    thread_pool.h
+ * @author  Jinwook Jung (jinwookjung@kaist.ac.kr)
+ * @date    2017-10-18 17:05:12
+ *
+ * A fixed pool of worker threads for the matrix kernels.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+namespace matrix_kernel
+{
+
+/**
+ * Runs numbered tasks on a set of worker threads and the calling thread.
+ *
+ * A task is identified only by its number, so splitting work by task
+ * number gives the same results whichever thread runs a task. One
+ * parallel region runs at a time; a run() issued from inside a task, or
+ * while another thread's region is in progress, executes on the calling
+ * thread alone.
+ */
+class ThreadPool
+{
+private:
+    std::vector<std::thread> threads_;
+    size_t num_threads_;                    ///< Threads used by run(), the caller included.
+
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    const std::function<void (size_t)>* task_;
+    size_t num_tasks_;
+    size_t num_workers_;                    ///< Workers taking part in the current region.
+    size_t num_finished_;                   ///< Workers done with the current region.
+    uint64_t generation_;                   ///< Incremented for every region.
+    bool stop_;
+    std::atomic<size_t> next_task_;
+
+    std::mutex run_mutex_;                  ///< Held for the duration of a region.
+
+    ThreadPool () : num_threads_(1), task_(NULL), num_tasks_(0), num_workers_(0),
+                    num_finished_(0), generation_(0), stop_(false), next_task_(0) {
+        set_num_threads(std::thread::hardware_concurrency());
+    }
+    ThreadPool (const ThreadPool& tp) = delete;
+    ThreadPool& operator= (const ThreadPool& tp) = delete;
+
+    static bool& is_in_task () {
+        static thread_local bool in_task = false;
+        return in_task;
+    }
+
+    /**
+     * Take tasks until there are none left.
+     */
+    void work (const std::function<void (size_t)>& task, size_t num_tasks) {
+        bool& in_task = is_in_task();
+        in_task = true;
+        for (size_t i = next_task_++; i < num_tasks; i = next_task_++) {
+            task(i);
+        }
+        in_task = false;
+    }
+
+    void run_worker (size_t id) {
+        uint64_t generation = 0;
+        for (;;) {
+            const std::function<void (size_t)>* task;
+            size_t num_tasks;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                while (!stop_ && (generation_ == generation || id >= num_workers_)) {
+                    if (generation_ != generation) {
+                        generation = generation_;   // Not needed for this region.
+                    }
+                    work_cv_.wait(lock);
+                }
+                if (stop_) {
+                    return;
+                }
+                generation = generation_;
+                task = task_;
+                num_tasks = num_tasks_;
+            }
+
+            work(*task, num_tasks);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (++num_finished_ == num_workers_) {
+                done_cv_.notify_one();
+            }
+        }
+    }
+
+    void stop_workers () {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        work_cv_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+        threads_.clear();
+        stop_ = false;
+    }
+
+public:
+    static ThreadPool& get () {
+        static ThreadPool tp;
+        return tp;
+    }
+
+    ~ThreadPool () {
+        stop_workers();
+    }
+
+    size_t get_num_threads () const { return num_threads_; }
+
+    /**
+     * Use n threads, the calling thread included; zero means one per
+     * hardware thread. Must not be called while a region is running.
+     */
+    void set_num_threads (size_t n) {
+        if (n == 0) {
+            n = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        }
+        std::lock_guard<std::mutex> run_lock(run_mutex_);
+        stop_workers();
+        num_threads_ = n;
+        for (size_t i = 0; i + 1 < n; i++) {
+            threads_.emplace_back(&ThreadPool::run_worker, this, i);
+        }
+    }
+
+    /**
+     * Call task(0) ... task(num_tasks - 1) on up to num_threads threads
+     * (zero means get_num_threads()) and wait for all of them.
+     */
+    void run (size_t num_tasks, const std::function<void (size_t)>& task,
+              size_t num_threads = 0) {
+        if (num_threads == 0) {
+            num_threads = num_threads_;
+        }
+        size_t num_workers = std::min(std::min(num_threads, num_threads_), num_tasks);
+        num_workers = (num_workers > 0) ? num_workers - 1 : 0;
+
+        std::unique_lock<std::mutex> run_lock(run_mutex_, std::defer_lock);
+        if (num_workers == 0 || is_in_task() || !run_lock.try_lock()) {
+            for (size_t i = 0; i < num_tasks; i++) {
+                task(i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ = &task;
+            num_tasks_ = num_tasks;
+            num_workers_ = num_workers;
+            num_finished_ = 0;
+            next_task_.store(0);
+            generation_++;
+        }
+        work_cv_.notify_all();
+
+        work(task, num_tasks);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (num_finished_ < num_workers_) {
+            done_cv_.wait(lock);
+        }
+    }
+};
+
+
+/**
+ * Set the number of threads the matrix kernels use; zero means one per
+ * hardware thread.
+ */
+inline void set_num_threads (size_t n)
+{
+    ThreadPool::get().set_num_threads(n);
+}
+
+inline size_t get_num_threads ()
+{
+    return ThreadPool::get().get_num_threads();
+}
+
+
+/**
+ * Split [begin, end) into contiguous chunks of at least grain elements,
+ * one per thread, and call f(chunk_begin, chunk_end) on each. The chunks
+ * depend only on the range, the grain and the thread count.
+ */
+template <typename F>
+void parallel_for (size_t begin, size_t end, size_t grain, F f,
+                   size_t num_threads = 0)
+{
+    if (end <= begin) {
+        return;
+    }
+    size_t n = end - begin;
+    if (num_threads == 0) {
+        num_threads = get_num_threads();
+    }
+    size_t num_chunks = std::min(num_threads, (n + grain - 1) / std::max<size_t>(grain, 1));
+    if (num_chunks <= 1) {
+        f(begin, end);
+        return;
+    }
+
+    size_t chunk = (n + num_chunks - 1) / num_chunks;
+    ThreadPool::get().run(num_chunks, [&](size_t i) {
+        size_t b = begin + i*chunk;
+        size_t e = std::min(end, b + chunk);
+        if (b < e) {
+            f(b, e);
+        }
+    }, num_threads);
+}
+
+}   // End of namespace matrix_kernel
+
+#endif